@@ -0,0 +1,1774 @@
+/*!
+ * @file bench.c
+ * @brief thinFAT benchmark program running on POSIX environment
+ * @date 2017/02/03
+ * @author Hiroka IHARA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "thinfat.h"
+#include "thinfat_phy.h"
+#include "thinfat_cache.h"
+#include "thinfat_table.h"
+#include "thinfat_file.h"
+#include "thinfat_scan.h"
+#include "bench_image.h"
+
+#define BENCH_EVENT_PHY_READ (THINFAT_USER_EVENT + 1)
+#define BENCH_EVENT_PHY_PING (THINFAT_USER_EVENT + 2)
+#define BENCH_EVENT_QUEUE_READ (THINFAT_USER_EVENT + 3)
+
+#define BENCH_QUEUE_META_SECTORS (256)
+
+typedef struct bench_client_tag
+{
+  thinfat_phy_t *phy;
+  thinfat_sector_t si_read;
+  uint8_t *buffer;
+}
+bench_client_t;
+
+typedef struct bench_phy_job_tag
+{
+  thinfat_sector_t *targets;
+  thinfat_sector_t sc_cluster;
+  unsigned int posted, completed, total;
+  bool vector;
+  bool failed;
+}
+bench_phy_job_t;
+
+static bench_phy_job_t bench_phy_job;
+
+typedef struct bench_ping_tag
+{
+  thinfat_phy_t *phy;
+  double t_posted;
+  double *latencies;
+  unsigned int completed;
+}
+bench_ping_t;
+
+typedef struct bench_queue_tag
+{
+  thinfat_phy_t *phy;
+  unsigned int depth;
+  unsigned int posted, completed, total;
+  uint32_t generation;
+  bool failed;
+}
+bench_queue_t;
+
+typedef struct bench_queue_client_tag
+{
+  bench_queue_t *queue;
+  uint8_t block[THINFAT_SECTOR_SIZE];
+}
+bench_queue_client_t;
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const thinfat_phy_driver_t *bench_find_driver(const char *name)
+{
+  if (strcmp(name, thinfat_phy_mmap_driver.name) == 0)
+    return &thinfat_phy_mmap_driver;
+  if (strcmp(name, thinfat_phy_zerocopy_driver.name) == 0)
+    return &thinfat_phy_zerocopy_driver;
+  if (strcmp(name, thinfat_phy_direct_driver.name) == 0)
+    return &thinfat_phy_direct_driver;
+#if THINFAT_CONFIG_ENABLE_URING
+  if (strcmp(name, thinfat_phy_uring_driver.name) == 0)
+    return &thinfat_phy_uring_driver;
+#endif
+  if (strcmp(name, thinfat_phy_ram_driver.name) == 0)
+    return &thinfat_phy_ram_driver;
+  return NULL;
+}
+
+static void bench_phy_post(bench_client_t *client)
+{
+  bench_phy_job_t *job = &bench_phy_job;
+  thinfat_result_t res;
+  client->si_read = job->targets[job->posted++];
+  if (job->vector)
+  {
+    thinfat_segment_t segment;
+    segment.data = client->buffer;
+    segment.sc_data = job->sc_cluster;
+    res = thinfat_phy_read_vector(client, client->phy, client->si_read, &segment, 1, BENCH_EVENT_PHY_READ);
+  }
+  else
+  {
+    res = thinfat_phy_read_multiple(client, client->phy, client->si_read, job->sc_cluster, BENCH_EVENT_PHY_READ);
+  }
+  if (res != THINFAT_RESULT_OK)
+    job->failed = true;
+}
+
+thinfat_result_t thinfat_user_callback(thinfat_t *tf, thinfat_event_t event, thinfat_sector_t s_param, void *p_param)
+{
+  switch(event)
+  {
+  case BENCH_EVENT_PHY_READ:
+    {
+      bench_client_t *client = (bench_client_t *)tf;
+      bench_phy_job_t *job = &bench_phy_job;
+      if (p_param == NULL)
+      {
+        job->completed++;
+        if (job->posted < job->total)
+          bench_phy_post(client);
+        thinfat_phy_signal(client->phy);
+      }
+      else if (*(void **)p_param == NULL)
+      {
+        *(void **)p_param = client->buffer;
+      }
+      else
+      {
+        *(void **)p_param = client->buffer + THINFAT_SECTOR_SIZE * (s_param - client->si_read + 1);
+      }
+    }
+    break;
+  case BENCH_EVENT_QUEUE_READ:
+    {
+      bench_queue_client_t *client = (bench_queue_client_t *)tf;
+      bench_queue_t *queue = client->queue;
+      uint8_t meta[THINFAT_SECTOR_SIZE];
+      //Every data read is followed by a metadata update, as a table cache eviction would do
+      uint32_t generation = queue->generation++;
+      memset(meta, 0, sizeof(meta));
+      memcpy(meta, &generation, sizeof(generation));
+      if (thinfat_phy_post_single(queue->phy, generation % BENCH_QUEUE_META_SECTORS, meta) != THINFAT_RESULT_OK)
+        queue->failed = true;
+      queue->completed++;
+      if (queue->posted < queue->total)
+      {
+        thinfat_sector_t sector = BENCH_QUEUE_META_SECTORS + queue->posted++;
+        if (thinfat_phy_read_single(client, queue->phy, sector, client->block, BENCH_EVENT_QUEUE_READ) != THINFAT_RESULT_OK)
+          queue->failed = true;
+      }
+      thinfat_phy_signal(queue->phy);
+    }
+    break;
+  case THINFAT_EVENT_MOUNT:
+  case THINFAT_EVENT_UNMOUNT:
+  case THINFAT_EVENT_ALLOCATE:
+  case THINFAT_EVENT_FIND_FILE:
+  case THINFAT_EVENT_READ_FILE:
+  case THINFAT_EVENT_WRITE_FILE:
+    if (event == THINFAT_EVENT_FIND_FILE)
+    {
+      if (p_param != NULL)
+        memcpy(tf->phy->arg, p_param, sizeof(thinfat_dir_entry_t));
+      else
+        ((thinfat_dir_entry_t *)tf->phy->arg)->name[0] = 0x00;
+    }
+    else if (event == THINFAT_EVENT_READ_FILE || event == THINFAT_EVENT_WRITE_FILE)
+    {
+      *(size_t *)tf->phy->arg2 = *(uint32_t *)p_param;
+    }
+    tf->phy->cb_flag = true;
+    thinfat_phy_signal(tf->phy);
+    break;
+  case BENCH_EVENT_PHY_PING:
+    {
+      bench_ping_t *ping = (bench_ping_t *)tf;
+      ping->latencies[ping->completed++] = bench_now() - ping->t_posted;
+      thinfat_phy_signal(ping->phy);
+    }
+    break;
+  }
+  return THINFAT_RESULT_OK;
+}
+
+static const thinfat_phy_driver_t *bench_open_phy(thinfat_phy_t *phy, const char *devpath, const char *driver_name)
+{
+  const thinfat_phy_driver_t *driver = bench_find_driver(driver_name);
+  if (driver == NULL)
+  {
+    fprintf(stderr, "Unknown PHY driver: %s\n", driver_name);
+    return NULL;
+  }
+  if (thinfat_phy_initialize(phy, driver, devpath) != THINFAT_RESULT_OK)
+  {
+    fprintf(stderr, "Failed to open %s.\n", devpath);
+    return NULL;
+  }
+  return driver;
+}
+
+static double bench_cpu_time(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int bench_compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*!
+ * Measures how long a request posted by a client sits before the worker
+ * thread completes it, and how much CPU the worker burns while idle.
+ */
+static int bench_wakeup(const char *devpath, const char *driver_name, unsigned int count)
+{
+  thinfat_phy_t phy;
+  const thinfat_phy_driver_t *driver = bench_open_phy(&phy, devpath, driver_name);
+  if (driver == NULL)
+    return EXIT_FAILURE;
+
+  static uint8_t block[THINFAT_SECTOR_SIZE];
+  bench_ping_t ping;
+  ping.phy = &phy;
+  ping.latencies = (double *)malloc(sizeof(double) * count);
+  ping.completed = 0;
+
+  thinfat_phy_start(&phy);
+
+  double t_idle = bench_now(), cpu_idle = bench_cpu_time();
+  sleep(1);
+  cpu_idle = (bench_cpu_time() - cpu_idle) / (bench_now() - t_idle);
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    thinfat_phy_lock(&phy);
+    ping.t_posted = bench_now();
+    thinfat_phy_read_single(&ping, &phy, i % 64, block, BENCH_EVENT_PHY_PING);
+    while (ping.completed <= i)
+      thinfat_phy_wait(&phy);
+    thinfat_phy_unlock(&phy);
+  }
+
+  thinfat_phy_stop(&phy);
+  thinfat_phy_finalize(&phy);
+
+  double sum = 0;
+  for (unsigned int i = 0; i < count; i++)
+    sum += ping.latencies[i];
+  qsort(ping.latencies, count, sizeof(double), bench_compare_double);
+  printf("%-6s idle CPU %5.1f%%, wakeup latency: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+         driver->name, cpu_idle * 100, sum / count * 1e6, ping.latencies[count / 2] * 1e6,
+         ping.latencies[count * 99 / 100] * 1e6, ping.latencies[count - 1] * 1e6);
+
+  free(ping.latencies);
+  return EXIT_SUCCESS;
+}
+
+static double bench_phy_run(thinfat_phy_t *phy, bench_client_t *clients, unsigned int depth)
+{
+  bench_phy_job_t *job = &bench_phy_job;
+  double t_start = bench_now();
+
+  thinfat_phy_lock(phy);
+  job->posted = job->completed = 0;
+  job->failed = false;
+  for (unsigned int i = 0; i < depth && job->posted < job->total; i++)
+    bench_phy_post(&clients[i]);
+  while (job->completed < job->total && !job->failed)
+    thinfat_phy_wait(phy);
+  thinfat_phy_unlock(phy);
+
+  return bench_now() - t_start;
+}
+
+/*!
+ * Reads clusters straight through the PHY, in order and at random,
+ * with up to `depth` requests queued at once. Each run is done twice:
+ * with a callback per sector, and as a single scattered transfer.
+ */
+static int bench_phy(const char *devpath, const char *driver_name, thinfat_sector_t sc_cluster, unsigned int count, unsigned int depth)
+{
+  const thinfat_phy_driver_t *driver;
+  struct stat st;
+  thinfat_phy_t phy;
+
+  if (stat(devpath, &st) != 0 || (driver = bench_open_phy(&phy, devpath, driver_name)) == NULL)
+    return EXIT_FAILURE;
+  if (depth > THINFAT_CONFIG_PHY_QUEUE_DEPTH)
+    depth = THINFAT_CONFIG_PHY_QUEUE_DEPTH;
+
+  thinfat_sector_t cc_image = st.st_size / THINFAT_SECTOR_SIZE / sc_cluster;
+  bench_client_t *clients = (bench_client_t *)malloc(sizeof(bench_client_t) * depth);
+  for (unsigned int i = 0; i < depth; i++)
+  {
+    clients[i].phy = &phy;
+    clients[i].buffer = (uint8_t *)malloc(THINFAT_SECTOR_SIZE * sc_cluster);
+  }
+  bench_phy_job.targets = (thinfat_sector_t *)malloc(sizeof(thinfat_sector_t) * count);
+  bench_phy_job.sc_cluster = sc_cluster;
+  bench_phy_job.total = count;
+
+  thinfat_phy_start(&phy);
+
+  double mb = (double)count * sc_cluster * THINFAT_SECTOR_SIZE / 1048576.0;
+
+  for (int vector = 0; vector < 2 && !bench_phy_job.failed; vector++)
+  {
+    bench_phy_job.vector = vector;
+
+    for (unsigned int i = 0; i < count; i++)
+      bench_phy_job.targets[i] = (i % cc_image) * sc_cluster;
+    double t_seq = bench_phy_run(&phy, clients, depth);
+
+    srand(1);
+    for (unsigned int i = 0; i < count; i++)
+      bench_phy_job.targets[i] = ((thinfat_sector_t)rand() % cc_image) * sc_cluster;
+    double t_rand = bench_phy_run(&phy, clients, depth);
+
+    printf("%-6s %-6s QD%-3u %u x %u B: sequential %8.1f MB/s, random %8.1f MB/s (%.0f IOPS)%s\n",
+           driver->name, vector ? "vector" : "sector", depth, count, (unsigned int)(sc_cluster * THINFAT_SECTOR_SIZE),
+           mb / t_seq, mb / t_rand, count / t_rand, bench_phy_job.failed ? " FAILED" : "");
+  }
+
+  thinfat_phy_stop(&phy);
+  thinfat_phy_finalize(&phy);
+
+  for (unsigned int i = 0; i < depth; i++)
+    free(clients[i].buffer);
+  free(clients);
+  free(bench_phy_job.targets);
+  return bench_phy_job.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*!
+ * Mixes single-sector data reads from `depth` clients with posted metadata
+ * writes, and reports how many of them the elevator folded together.
+ * The metadata area at the head of the image is overwritten and checked.
+ */
+static int bench_queue(const char *devpath, const char *driver_name, unsigned int count, unsigned int depth)
+{
+  const thinfat_phy_driver_t *driver;
+  thinfat_phy_queue_stats_t stats;
+  thinfat_phy_t phy;
+  bench_queue_t queue;
+
+  if ((driver = bench_open_phy(&phy, devpath, driver_name)) == NULL)
+    return EXIT_FAILURE;
+  //Each client keeps a read and a posted write queued, and slots are freed out of order
+  if (depth > THINFAT_CONFIG_PHY_QUEUE_DEPTH / 4)
+    depth = THINFAT_CONFIG_PHY_QUEUE_DEPTH / 4;
+
+  bench_queue_client_t *clients = (bench_queue_client_t *)malloc(sizeof(bench_queue_client_t) * depth);
+  queue.phy = &phy;
+  queue.depth = depth;
+  queue.posted = queue.completed = 0;
+  queue.total = count;
+  queue.generation = 0;
+  queue.failed = false;
+
+  thinfat_phy_start(&phy);
+  double t_start = bench_now();
+  thinfat_phy_lock(&phy);
+  for (unsigned int i = 0; i < depth && queue.posted < queue.total; i++)
+  {
+    clients[i].queue = &queue;
+    thinfat_phy_read_single(&clients[i], &phy, BENCH_QUEUE_META_SECTORS + queue.posted++, clients[i].block, BENCH_EVENT_QUEUE_READ);
+  }
+  while (queue.completed < queue.total && !queue.failed)
+    thinfat_phy_wait(&phy);
+  thinfat_phy_unlock(&phy);
+  thinfat_phy_stop(&phy);
+  double t_run = bench_now() - t_start;
+  thinfat_phy_get_queue_stats(&phy, &stats);
+  thinfat_phy_finalize(&phy);
+
+  //The last generation posted to each metadata sector must be the one on disk
+  FILE *fp = fopen(devpath, "rb");
+  for (uint32_t s = 0; fp != NULL && s < BENCH_QUEUE_META_SECTORS && s < queue.generation; s++)
+  {
+    uint8_t block[THINFAT_SECTOR_SIZE];
+    uint32_t expected = (queue.generation - 1 - s) / BENCH_QUEUE_META_SECTORS * BENCH_QUEUE_META_SECTORS + s, actual;
+    if (fseek(fp, (long)s * THINFAT_SECTOR_SIZE, SEEK_SET) != 0 || fread(block, THINFAT_SECTOR_SIZE, 1, fp) != 1)
+      break;
+    memcpy(&actual, block, sizeof(actual));
+    if (actual != expected)
+    {
+      fprintf(stderr, "Metadata sector %u holds generation %u, expected %u.\n", s, actual, expected);
+      queue.failed = true;
+      break;
+    }
+  }
+  if (fp != NULL)
+    fclose(fp);
+
+  printf("%-6s QD%-3u %u reads + %u writes: %.0f IOPS, %u transfers, merge ratio %.2f, depth avg %.1f max %u%s\n",
+         driver->name, depth, queue.completed, queue.generation, (queue.completed + queue.generation) / t_run,
+         stats.nc_transfer, stats.nc_transfer ? (double)stats.nc_request / stats.nc_transfer : 0.0,
+         stats.nc_request ? (double)stats.depth_sum / stats.nc_request : 0.0, stats.depth_max,
+         queue.failed ? " FAILED" : "");
+
+  free(clients);
+  return queue.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static bool bench_parse_image(bench_image_config_t *config, int argc, const char *argv[])
+{
+  //A "-4k" suffix formats the volume with 4096-byte sectors
+  size_t sz_type = strlen(argv[0]);
+  config->sz_sector = 0;
+  if (sz_type > 3 && strcmp(argv[0] + sz_type - 3, "-4k") == 0)
+  {
+    config->sz_sector = 4096;
+    sz_type -= 3;
+  }
+  if (sz_type == 5 && strncmp(argv[0], "fat16", 5) == 0)
+    config->type = THINFAT_TYPE_FAT16;
+  else if (sz_type == 5 && strncmp(argv[0], "fat32", 5) == 0)
+    config->type = THINFAT_TYPE_FAT32;
+  else
+    return false;
+  config->sc_volume = (thinfat_sector_t)(atoi(argv[1]) * (1048576 / bench_image_sector_size(config)));
+  config->sc_cluster = (uint8_t)atoi(argv[2]);
+  config->nc_files = (unsigned int)atoi(argv[3]);
+  config->sz_file = (uint32_t)atoi(argv[4]) * 1024;
+  config->cc_run = argc > 5 ? (thinfat_cluster_t)atoi(argv[5]) : 0;
+  config->seed = argc > 6 ? (uint32_t)strtoul(argv[6], NULL, 0) : 0;
+  return true;
+}
+
+static int bench_mkimg(const char *devpath, const bench_image_config_t *config)
+{
+  uint8_t *image = bench_image_create(config);
+  FILE *fp;
+  if (image == NULL)
+    return EXIT_FAILURE;
+  if ((fp = fopen(devpath, "wb")) == NULL
+      || fwrite(image, bench_image_sector_size(config), config->sc_volume, fp) != config->sc_volume)
+  {
+    fprintf(stderr, "Failed to write %s.\n", devpath);
+    if (fp != NULL)
+      fclose(fp);
+    free(image);
+    return EXIT_FAILURE;
+  }
+  fclose(fp);
+  free(image);
+  return EXIT_SUCCESS;
+}
+
+typedef struct bench_volume_tag
+{
+  const bench_image_config_t *config;
+  uint8_t *image;
+  uint8_t *buffer;
+  size_t chunk;
+  thinfat_phy_t phy;
+  thinfat_t tf;
+  thinfat_dir_entry_t entry;
+  uint64_t sz_total;
+  unsigned int nc_calls;
+  bool failed;
+  //Table, directory and file caches, and the background write-back, as of the unmount
+  thinfat_cache_stats_t caches[3];
+  thinfat_cache_flush_stats_t flush;
+  //Cluster lookups of the file layer
+  thinfat_blk_stats_t blk;
+}
+bench_volume_t;
+
+//Contents of file `index` after it has been rewritten `generation` times
+static uint8_t bench_volume_byte(bench_volume_t *vol, unsigned int index, unsigned int generation, uint32_t offset)
+{
+  return bench_image_byte(index + generation * vol->config->nc_files, offset);
+}
+
+//Generates the image and mounts it on the RAM disk, behind the flash model if one is given.
+static bool bench_volume_mount(bench_volume_t *vol, const bench_image_config_t *config, const thinfat_cache_budget_t *budget, size_t chunk, thinfat_phy_flash_t *flash)
+{
+  vol->config = config;
+  vol->chunk = chunk;
+  vol->sz_total = 0;
+  vol->nc_calls = 0;
+  vol->failed = false;
+  vol->buffer = NULL;
+  if ((vol->image = bench_image_create(config)) == NULL || (vol->buffer = (uint8_t *)malloc(chunk)) == NULL)
+  {
+    free(vol->image);
+    return false;
+  }
+  thinfat_phy_initialize_ram(&vol->phy, vol->image, bench_image_sector_size(config) * (size_t)config->sc_volume);
+  if (flash != NULL)
+    thinfat_phy_attach_flash(&vol->phy, flash, NULL);
+  if (thinfat_initialize_budget(&vol->tf, &vol->phy, budget) != THINFAT_RESULT_OK)
+  {
+    fprintf(stderr, "The cache budget does not add up.\n");
+    thinfat_phy_finalize(&vol->phy);
+    free(vol->buffer);
+    free(vol->image);
+    return false;
+  }
+  thinfat_phy_start(&vol->phy);
+
+  thinfat_phy_enter(&vol->phy);
+  if (thinfat_phy_leave(&vol->phy, thinfat_mount(&vol->tf, 0, THINFAT_EVENT_MOUNT)) != THINFAT_RESULT_OK || vol->tf.type != config->type)
+  {
+    fprintf(stderr, "Failed to mount the generated image.\n");
+    vol->failed = true;
+  }
+  return true;
+}
+
+//Writes back everything the volume still holds, FAT mirrors included, and invalidates its caches.
+static void bench_volume_sync(bench_volume_t *vol)
+{
+  thinfat_phy_enter(&vol->phy);
+  if (thinfat_phy_leave(&vol->phy, thinfat_unmount(&vol->tf, THINFAT_EVENT_UNMOUNT)) != THINFAT_RESULT_OK)
+  {
+    fprintf(stderr, "Failed to unmount.\n");
+    vol->failed = true;
+  }
+}
+
+static void bench_volume_unmount(bench_volume_t *vol, thinfat_phy_stats_t *stats)
+{
+  thinfat_phy_stop(&vol->phy);
+  if (stats != NULL)
+    thinfat_phy_get_stats(&vol->phy, stats);
+  thinfat_cache_get_stats(vol->tf.table_cache, &vol->caches[0]);
+  thinfat_cache_get_stats(vol->tf.dir_cache, &vol->caches[1]);
+  thinfat_cache_get_stats(vol->tf.file_cache, &vol->caches[2]);
+  thinfat_cache_pool_get_flush_stats(vol->tf.cache_pool, &vol->flush);
+  vol->blk = vol->tf.cur_file->blk.stats;
+  thinfat_finalize(&vol->tf);
+  thinfat_phy_finalize(&vol->phy);
+  free(vol->buffer);
+  free(vol->image);
+}
+
+static bool bench_volume_open_file(bench_volume_t *vol, unsigned int index)
+{
+  wchar_t name[BENCH_IMAGE_NAME_LENGTH + 1];
+  bench_image_name(name, index);
+  thinfat_phy_enter(&vol->phy);
+  vol->phy.arg = &vol->entry;
+  if (thinfat_phy_leave(&vol->phy, thinfat_find_file_by_longname(&vol->tf, name, THINFAT_EVENT_FIND_FILE)) != THINFAT_RESULT_OK
+      || vol->entry.name[0] == 0x00 || vol->entry.size != vol->config->sz_file || thinfat_open_file(&vol->tf, &vol->entry) != THINFAT_RESULT_OK)
+  {
+    fprintf(stderr, "Failed to open file #%u.\n", index);
+    vol->failed = true;
+    return false;
+  }
+  return true;
+}
+
+static void bench_volume_read_file(bench_volume_t *vol, unsigned int index, unsigned int generation)
+{
+  if (!bench_volume_open_file(vol, index))
+    return;
+  for (uint32_t offset = 0; offset < vol->entry.size; )
+  {
+    size_t sz_read = 0;
+    thinfat_phy_enter(&vol->phy);
+    vol->phy.arg2 = &sz_read;
+    if (thinfat_phy_leave(&vol->phy, thinfat_read_file(&vol->tf, vol->buffer, vol->chunk, THINFAT_EVENT_READ_FILE)) != THINFAT_RESULT_OK || sz_read == 0)
+    {
+      fprintf(stderr, "Failed to read file #%u at %u.\n", index, offset);
+      vol->failed = true;
+      return;
+    }
+    for (size_t i = 0; i < sz_read; i++)
+    {
+      if (vol->buffer[i] != bench_volume_byte(vol, index, generation, offset + (uint32_t)i))
+      {
+        fprintf(stderr, "File #%u differs at %u.\n", index, offset + (uint32_t)i);
+        vol->failed = true;
+        return;
+      }
+    }
+    offset += (uint32_t)sz_read;
+    vol->sz_total += sz_read;
+    vol->nc_calls++;
+  }
+}
+
+static void bench_volume_write_file(bench_volume_t *vol, unsigned int index, unsigned int generation)
+{
+  if (!bench_volume_open_file(vol, index))
+    return;
+  for (uint32_t offset = 0; offset < vol->entry.size; )
+  {
+    size_t sz_written = 0, size = vol->entry.size - offset < vol->chunk ? vol->entry.size - offset : vol->chunk;
+    for (size_t i = 0; i < size; i++)
+      vol->buffer[i] = bench_volume_byte(vol, index, generation, offset + (uint32_t)i);
+    thinfat_phy_enter(&vol->phy);
+    vol->phy.arg2 = &sz_written;
+    if (thinfat_phy_leave(&vol->phy, thinfat_write_file(&vol->tf, vol->buffer, size, THINFAT_EVENT_WRITE_FILE)) != THINFAT_RESULT_OK || sz_written != size)
+    {
+      fprintf(stderr, "Failed to write file #%u at %u.\n", index, offset);
+      vol->failed = true;
+      return;
+    }
+    offset += (uint32_t)size;
+    vol->sz_total += size;
+    vol->nc_calls++;
+  }
+}
+
+static void bench_print_image(const bench_image_config_t *config)
+{
+  printf("%s/%-4u %3u files x %6u KiB, %3u sectors/cluster, run %4u%s",
+         config->type == THINFAT_TYPE_FAT32 ? "FAT32" : "FAT16", (unsigned int)bench_image_sector_size(config),
+         config->nc_files, config->sz_file / 1024, config->sc_cluster, config->cc_run, config->seed != 0 ? " shuffled" : "");
+}
+
+static void bench_print_stats(const thinfat_phy_stats_t *stats)
+{
+  static const char *types[THINFAT_PHY_STATE_MAX] = {NULL, "single read", "single write", "multiple read", "multiple write", "vector read", "vector write"};
+  static const char *classes[THINFAT_CLASS_MAX] = {"core", "cache", "table", "file", "dir", "user"};
+
+  for (unsigned int t = 1; t < THINFAT_PHY_STATE_MAX; t++)
+  {
+    const thinfat_phy_type_stats_t *type = &stats->types[t];
+    if (type->nc_request == 0)
+      continue;
+    printf("  %-14s %8u requests %9.1f MiB, latency mean %7.1f us, p50 < %5u us, p99 < %5u us, max %8.1f us\n",
+           types[t], type->nc_request, type->sz_transferred / 1048576.0, type->ns_total / 1e3 / type->nc_request,
+           (unsigned int)thinfat_phy_latency_percentile(type, 50), (unsigned int)thinfat_phy_latency_percentile(type, 99),
+           type->ns_max / 1e3);
+  }
+  printf("  by origin:");
+  for (unsigned int c = 0; c < THINFAT_CLASS_MAX; c++)
+    if (stats->nc_class[c] != 0)
+      printf(" %s %u (%.1f MiB)", classes[c], stats->nc_class[c], stats->sz_class[c] / 1048576.0);
+  printf("\n");
+}
+
+static void bench_print_caches(const bench_volume_t *vol)
+{
+  static const char *names[3] = {"table", "dir", "file"};
+  const thinfat_cache_stats_t *caches = vol->caches;
+  const thinfat_cache_flush_stats_t *flush = &vol->flush;
+  printf("  extents %8u cluster lookups from the map, %8u from the FAT, %8u links in %8u FAT sector reads\n",
+         vol->blk.nc_mapped, vol->blk.nc_walked, vol->blk.nc_hops, vol->blk.nc_table_reads);
+  printf("  flusher %6u ticks, %6u flushes, %6u expired + %6u idle lines in %6u runs, oldest %u ms\n",
+         flush->nc_tick, flush->nc_flush, flush->nc_expired, flush->nc_idle, flush->nc_run, flush->ms_max_age);
+  for (unsigned int c = 0; c < 3; c++)
+  {
+    uint32_t nc_lookup = caches[c].nc_hit + caches[c].nc_miss;
+    printf("  %-5s cache %4u lines, %8u hits %8u misses (%5.1f%% hit), %8u evictions, %8u write-backs\n",
+           names[c], caches[c].nc_lines, caches[c].nc_hit, caches[c].nc_miss, nc_lookup ? 100.0 * caches[c].nc_hit / nc_lookup : 0.0,
+           caches[c].nc_eviction, caches[c].nc_write_back);
+  }
+}
+
+/*!
+ * Generates an image in memory, mounts it through the RAM-disk PHY and reads
+ * every file back in `chunk` byte calls, so that the cost of the filesystem
+ * layers is measured without a device or the page cache underneath.
+ */
+static int bench_file(const bench_image_config_t *config, const thinfat_cache_budget_t *budget, size_t chunk)
+{
+  thinfat_phy_stats_t stats;
+  bench_volume_t vol;
+
+  if (!bench_volume_mount(&vol, config, budget, chunk, NULL))
+    return EXIT_FAILURE;
+  double t_start = bench_now(), cpu_start = bench_cpu_time();
+  for (unsigned int f = 0; f < config->nc_files && !vol.failed; f++)
+    bench_volume_read_file(&vol, f, 0);
+  double t_run = bench_now() - t_start, cpu_run = bench_cpu_time() - cpu_start;
+  bench_volume_unmount(&vol, &stats);
+
+  bench_print_image(config);
+  printf(": %8.1f MB/s, %.2f us CPU per %zu byte read%s\n",
+         vol.sz_total / t_run / 1e6, vol.nc_calls ? cpu_run / vol.nc_calls * 1e6 : 0.0, chunk, vol.failed ? " FAILED" : "");
+  bench_print_stats(&stats);
+  bench_print_caches(&vol);
+  return vol.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Reads `nc_seeks` 4 KiB pieces of every file at random offsets, seeking to
+ * each in increasing order, in decreasing order and as they come, and checks
+ * what comes back. How many FAT sectors the walks read is what the chain
+ * layout costs; a seek backwards starts walking from the head again.
+ */
+static int bench_seek(const bench_image_config_t *config, unsigned int nc_seeks)
+{
+  static const char *orders[3] = {"forward", "backward", "random"};
+  uint32_t *offsets = (uint32_t *)malloc(sizeof(uint32_t) * (nc_seeks > 0 ? nc_seeks : 1));
+  bool failed = false;
+
+  if (offsets == NULL)
+    return EXIT_FAILURE;
+  bench_print_image(config);
+  printf(", %u seeks per file\n", nc_seeks);
+  for (unsigned int o = 0; o < 3 && !failed; o++)
+  {
+    thinfat_phy_stats_t stats;
+    bench_volume_t vol;
+
+    if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, 4096, NULL))
+    {
+      failed = true;
+      break;
+    }
+    srand(1);
+    double t_start = bench_now();
+    for (unsigned int f = 0; f < config->nc_files && !vol.failed; f++)
+    {
+      if (!bench_volume_open_file(&vol, f))
+        break;
+      for (unsigned int i = 0; i < nc_seeks; i++)
+        offsets[i] = (uint32_t)(((uint64_t)rand() * RAND_MAX + rand()) % vol.entry.size);
+      if (o < 2)
+        qsort(offsets, nc_seeks, sizeof(uint32_t), bench_compare_u32);
+      //Backwards, the last seek is to the start of the file, its head cluster long forgotten by the extent map
+      for (unsigned int i = 0; o == 1 && i < nc_seeks / 2; i++)
+      {
+        uint32_t offset = offsets[i];
+        offsets[i] = offsets[nc_seeks - 1 - i];
+        offsets[nc_seeks - 1 - i] = offset;
+      }
+      if (o == 1 && nc_seeks > 0)
+        offsets[nc_seeks - 1] = 0;
+      for (unsigned int i = 0; i < nc_seeks && !vol.failed; i++)
+      {
+        size_t sz_read = 0;
+        thinfat_phy_enter(&vol.phy);
+        vol.phy.arg2 = &sz_read;
+        if (thinfat_seek_file(&vol.tf, offsets[i]) != THINFAT_RESULT_OK
+            || thinfat_phy_leave(&vol.phy, thinfat_read_file(&vol.tf, vol.buffer, vol.chunk, THINFAT_EVENT_READ_FILE)) != THINFAT_RESULT_OK || sz_read == 0)
+        {
+          fprintf(stderr, "Failed to read file #%u at %u.\n", f, offsets[i]);
+          vol.failed = true;
+          break;
+        }
+        for (size_t b = 0; b < sz_read && !vol.failed; b++)
+        {
+          if (vol.buffer[b] != bench_volume_byte(&vol, f, 0, offsets[i] + (uint32_t)b))
+          {
+            fprintf(stderr, "File #%u differs at %u.\n", f, offsets[i] + (uint32_t)b);
+            vol.failed = true;
+          }
+        }
+        vol.nc_calls++;
+      }
+    }
+    double t_run = bench_now() - t_start;
+    bench_volume_unmount(&vol, &stats);
+    failed = vol.failed;
+
+    printf(" %-8s %u seeks in %.1f ms, %.2f us each%s\n", orders[o], vol.nc_calls, t_run * 1e3, vol.nc_calls ? t_run / vol.nc_calls * 1e6 : 0.0, vol.failed ? " FAILED" : "");
+    bench_print_stats(&stats);
+    bench_print_caches(&vol);
+  }
+  free(offsets);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void bench_print_flash(const char *phase, const thinfat_phy_flash_stats_t *stats, uint64_t sz_payload)
+{
+  printf("  %-7s %6u reads %6u writes, %7.1f MiB in %7.1f MiB out, %7.1f MiB programmed (WA %.2f), %5u units opened, %5u erases, %8.1f ms on flash (%.1f MB/s)\n",
+         phase, stats->nc_read, stats->nc_write,
+         stats->sc_read * THINFAT_SECTOR_SIZE / 1048576.0, stats->sc_written * THINFAT_SECTOR_SIZE / 1048576.0,
+         stats->nc_page_programmed * thinfat_phy_flash_default_config.sc_page * THINFAT_SECTOR_SIZE / 1048576.0,
+         stats->sc_written ? (double)stats->nc_page_programmed * thinfat_phy_flash_default_config.sc_page / stats->sc_written : 0.0,
+         stats->nc_unit_opened, stats->nc_erase, stats->us_busy / 1e3,
+         stats->us_busy ? sz_payload / (double)stats->us_busy : 0.0);
+}
+
+static void bench_diff_flash(thinfat_phy_flash_stats_t *after, const thinfat_phy_flash_stats_t *before)
+{
+  after->nc_read -= before->nc_read;
+  after->nc_write -= before->nc_write;
+  after->sc_read -= before->sc_read;
+  after->sc_written -= before->sc_written;
+  after->nc_page_read -= before->nc_page_read;
+  after->nc_page_programmed -= before->nc_page_programmed;
+  after->nc_page_copied -= before->nc_page_copied;
+  after->nc_unit_opened -= before->nc_unit_opened;
+  after->nc_erase -= before->nc_erase;
+  after->us_busy -= before->us_busy;
+}
+
+/*!
+ * Rewrites every file of a generated image in `chunk` byte calls and reads
+ * them back, through the flash cost model in front of the RAM disk, and
+ * reports what the workload would cost on an SD card.
+ */
+static int bench_flash(const bench_image_config_t *config, const thinfat_cache_budget_t *budget, size_t chunk)
+{
+  thinfat_phy_flash_stats_t mount, written, read;
+  thinfat_phy_flash_t flash;
+  bench_volume_t vol;
+  uint64_t sz_written;
+
+  if (!bench_volume_mount(&vol, config, budget, chunk, &flash))
+    return EXIT_FAILURE;
+  thinfat_phy_lock(&vol.phy);
+  thinfat_phy_get_flash_stats(&vol.phy, &mount);
+  thinfat_phy_unlock(&vol.phy);
+  for (unsigned int f = 0; f < config->nc_files && !vol.failed; f++)
+    bench_volume_write_file(&vol, f, 1);
+  thinfat_phy_lock(&vol.phy);
+  thinfat_phy_get_flash_stats(&vol.phy, &written);
+  thinfat_phy_unlock(&vol.phy);
+  sz_written = vol.sz_total;
+  for (unsigned int f = 0; f < config->nc_files && !vol.failed; f++)
+    bench_volume_read_file(&vol, f, 1);
+  thinfat_phy_lock(&vol.phy);
+  thinfat_phy_get_flash_stats(&vol.phy, &read);
+  thinfat_phy_unlock(&vol.phy);
+  bench_volume_unmount(&vol, NULL);
+
+  bench_print_image(config);
+  printf(", %zu byte calls%s\n", chunk, vol.failed ? " FAILED" : "");
+  bench_diff_flash(&read, &written);
+  bench_diff_flash(&written, &mount);
+  bench_print_flash("mount", &mount, 0);
+  bench_print_flash("rewrite", &written, sz_written);
+  bench_print_flash("read", &read, vol.sz_total - sz_written);
+  bench_print_caches(&vol);
+  return vol.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//Whether every copy of the FAT of a generated image reads the same
+static bool bench_mirrors_equal(const bench_volume_t *vol)
+{
+  const thinfat_t *tf = &vol->tf;
+  size_t sz_table = (size_t)tf->sc_table_size * tf->sz_sector;
+  const uint8_t *table = vol->image + (size_t)(tf->si_hidden + tf->sc_reserved) * tf->sz_sector;
+  for (unsigned int i = 1; i < tf->table_redundancy; i++)
+    if (memcmp(table, table + i * sz_table, sz_table) != 0)
+      return false;
+  return true;
+}
+
+//Whether the FSInfo sector on the image holds the free count and hint the volume has in memory; FAT16 has none.
+static bool bench_fsinfo_current(const bench_volume_t *vol)
+{
+  const thinfat_t *tf = &vol->tf;
+  const uint8_t *fsinfo = vol->image + (size_t)tf->si_fsinfo * tf->sz_sector;
+  if (!THINFAT_IS_SECTOR_VALID(tf->si_fsinfo))
+    return true;
+  return thinfat_read_u32(fsinfo, 488) == tf->cc_free && thinfat_read_u32(fsinfo, 492) == tf->ci_next_free;
+}
+
+/*
+ * Creates `nc_files` chains of `cc_file` clusters on an empty generated
+ * volume behind the flash model, then unmounts it, once with the FAT mirrors
+ * written along with the first FAT and once with them deferred to the sync.
+ */
+static int bench_alloc(const bench_image_config_t *config, thinfat_cluster_t cc_file, unsigned int nc_files)
+{
+  static const char *policies[2] = {"immediate", "deferred"};
+  bool failed = false;
+
+  bench_print_image(config);
+  printf(", %u chains x %u clusters\n", nc_files, cc_file);
+  for (unsigned int p = 0; p < 2; p++)
+  {
+    thinfat_phy_flash_stats_t mount, allocated, synced;
+    thinfat_phy_flash_t flash;
+    bool equal, counted, current;
+    bench_volume_t vol;
+    double t_start, t_run;
+    thinfat_cluster_t cc_free_mount, cc_free;
+    size_t sz_map;
+
+    if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, 4096, &flash))
+      return EXIT_FAILURE;
+    thinfat_set_mirror_policy(&vol.tf, p == 0 ? THINFAT_MIRROR_IMMEDIATE : THINFAT_MIRROR_DEFERRED);
+    thinfat_phy_lock(&vol.phy);
+    thinfat_phy_get_flash_stats(&vol.phy, &mount);
+    thinfat_phy_unlock(&vol.phy);
+    cc_free_mount = thinfat_get_free_clusters(&vol.tf);
+    sz_map = thinfat_get_free_map_size(&vol.tf);
+    t_start = bench_now();
+    for (unsigned int f = 0; f < nc_files && !vol.failed; f++)
+    {
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_table_allocate(&vol.tf, vol.tf.table, cc_file, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+      {
+        fprintf(stderr, "Failed to allocate chain #%u.\n", f);
+        vol.failed = true;
+      }
+    }
+    t_run = bench_now() - t_start;
+    cc_free = thinfat_get_free_clusters(&vol.tf);
+    //FAT16 without the bitmap has no count to check
+    counted = cc_free_mount == THINFAT_UNKNOWN_FREE_COUNT || cc_free_mount - cc_free == cc_file * nc_files;
+    thinfat_phy_lock(&vol.phy);
+    thinfat_phy_get_flash_stats(&vol.phy, &allocated);
+    thinfat_phy_unlock(&vol.phy);
+    if (!vol.failed)
+      bench_volume_sync(&vol);
+    thinfat_phy_lock(&vol.phy);
+    thinfat_phy_get_flash_stats(&vol.phy, &synced);
+    thinfat_phy_unlock(&vol.phy);
+    equal = !vol.failed && bench_mirrors_equal(&vol);
+    current = !vol.failed && bench_fsinfo_current(&vol);
+    bench_volume_unmount(&vol, NULL);
+    bench_diff_flash(&synced, &allocated);
+    bench_diff_flash(&allocated, &mount);
+
+    printf(" %s mirrors: %.1f ms, %u writes while allocating, %u at unmount, FAT copies %s%s\n",
+           policies[p], t_run * 1e3, allocated.nc_write, synced.nc_write, equal ? "equal" : "DIFFER", vol.failed ? " FAILED" : "");
+    printf("  free clusters " TFF_U32 " -> " TFF_U32 "%s, bitmap %zu bytes, FSInfo %s\n",
+           cc_free_mount, cc_free, counted ? "" : " MISCOUNTED", sz_map, current ? "current" : "STALE");
+    bench_print_flash("alloc", &allocated, 0);
+    bench_print_flash("unmount", &synced, 0);
+    failed = failed || vol.failed || !equal || !counted || !current;
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//Clusters in the chain from ci_start as the first FAT of the image has it, 0 if it does not end properly
+static thinfat_cluster_t bench_chain_length(const bench_volume_t *vol, thinfat_cluster_t ci_start)
+{
+  const thinfat_t *tf = &vol->tf;
+  const uint8_t *table = vol->image + (size_t)(tf->si_hidden + tf->sc_reserved) * tf->sz_sector;
+  thinfat_cluster_t nc_entries = tf->sc_table_size * (tf->sz_sector >> tf->type), cc = 0, ci = ci_start;
+  while (ci >= 2 && ci < nc_entries && cc < nc_entries)
+  {
+    cc++;
+    if (tf->type == THINFAT_TYPE_FAT32)
+      ci = thinfat_read_u32(table, ci * 4) & THINFAT_FAT32_CLUSTER_MASK;
+    else
+      ci = thinfat_read_u16(table, ci * 2);
+    if (ci >= (tf->type == THINFAT_TYPE_FAT32 ? 0x0FFFFFF8 : 0xFFF8))
+      return cc;
+  }
+  return 0;
+}
+
+//Longest run of free clusters in the first FAT of the image
+static thinfat_cluster_t bench_longest_free(const bench_volume_t *vol)
+{
+  const thinfat_t *tf = &vol->tf;
+  const uint8_t *table = vol->image + (size_t)(tf->si_hidden + tf->sc_reserved) * tf->sz_sector;
+  thinfat_cluster_t ci_end = ((tf->si_hidden + tf->sc_volume_size - tf->si_data) >> tf->ctos_shift) + 2, cc = 0, cc_longest = 0;
+  for (thinfat_cluster_t ci = 2; ci < ci_end; ci++)
+  {
+    bool free = tf->type == THINFAT_TYPE_FAT32 ? (thinfat_read_u32(table, ci * 4) & THINFAT_FAT32_CLUSTER_MASK) == 0 : thinfat_read_u16(table, ci * 2) == 0;
+    cc = free ? cc + 1 : 0;
+    if (cc > cc_longest)
+      cc_longest = cc;
+  }
+  return cc_longest;
+}
+
+//Free clusters in the first FAT of the image
+static thinfat_cluster_t bench_count_free(const bench_volume_t *vol)
+{
+  const thinfat_t *tf = &vol->tf;
+  const uint8_t *table = vol->image + (size_t)(tf->si_hidden + tf->sc_reserved) * tf->sz_sector;
+  thinfat_cluster_t ci_end = ((tf->si_hidden + tf->sc_volume_size - tf->si_data) >> tf->ctos_shift) + 2, cc = 0;
+  for (thinfat_cluster_t ci = 2; ci < ci_end; ci++)
+    if (tf->type == THINFAT_TYPE_FAT32 ? (thinfat_read_u32(table, ci * 4) & THINFAT_FAT32_CLUSTER_MASK) == 0 : thinfat_read_u16(table, ci * 2) == 0)
+      cc++;
+  return cc;
+}
+
+/*
+ * Frees the chain of every file of a generated image, then syncs it.
+ * Reports how many FAT sectors the chains spanned against how many times
+ * the table cache was asked for one, and checks the free count and the
+ * FAT the image ends up with.
+ */
+static int bench_delete(const bench_image_config_t *config)
+{
+  thinfat_phy_stats_t stats;
+  bench_volume_t vol;
+  thinfat_cluster_t cc_freed = 0, cc_free_mount, cc_free;
+  uint8_t *spanned;
+  unsigned int nc_spanned = 0;
+  bool counted;
+
+  if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, 4096, NULL))
+    return EXIT_FAILURE;
+  spanned = (uint8_t *)calloc(vol.tf.sc_table_size, 1);
+  cc_free_mount = thinfat_get_free_clusters(&vol.tf);
+  double t_start = bench_now();
+  for (unsigned int f = 0; f < config->nc_files && spanned != NULL && !vol.failed; f++)
+  {
+    const uint8_t *table = vol.image + (size_t)(vol.tf.si_hidden + vol.tf.sc_reserved) * vol.tf.sz_sector;
+    thinfat_cluster_t nc_entries = vol.tf.sz_sector >> vol.tf.type, ci;
+    if (!bench_volume_open_file(&vol, f))
+      break;
+    //Nothing has been written back yet, so the image still has the chain
+    for (ci = vol.entry.ci_head; ci >= 2 && ci < vol.tf.sc_table_size * nc_entries; )
+    {
+      if (!spanned[ci / nc_entries])
+        nc_spanned += spanned[ci / nc_entries] = 1;
+      ci = vol.tf.type == THINFAT_TYPE_FAT32 ? thinfat_read_u32(table, ci * 4) & THINFAT_FAT32_CLUSTER_MASK : thinfat_read_u16(table, ci * 2);
+      if (ci >= (vol.tf.type == THINFAT_TYPE_FAT32 ? 0x0FFFFFF7 : 0xFFF7))
+        break;
+    }
+    thinfat_phy_enter(&vol.phy);
+    if (thinfat_phy_leave(&vol.phy, thinfat_table_free_chain(&vol.tf, vol.tf.table, vol.entry.ci_head, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+      vol.failed = true;
+    cc_freed += vol.tf.table->cc_freed;
+  }
+  double t_run = bench_now() - t_start;
+  cc_free = thinfat_get_free_clusters(&vol.tf);
+  if (!vol.failed)
+    bench_volume_sync(&vol);
+  //FAT16 without the bitmap keeps no free count to check
+  counted = !vol.failed && (cc_free == THINFAT_UNKNOWN_FREE_COUNT || cc_free == bench_count_free(&vol)) &&
+            (cc_free_mount == THINFAT_UNKNOWN_FREE_COUNT || cc_free - cc_free_mount == cc_freed);
+  vol.failed = vol.failed || !bench_fsinfo_current(&vol);
+  bench_volume_unmount(&vol, &stats);
+  free(spanned);
+
+  bench_print_image(config);
+  printf(": " TFF_U32 " clusters freed in %.2f ms across %u FAT sectors, free count %s%s\n",
+         cc_freed, t_run * 1e3, nc_spanned, counted ? "matches the FAT" : "WRONG", vol.failed ? " FAILED" : "");
+  bench_print_stats(&stats);
+  bench_print_caches(&vol);
+  return vol.failed || !counted ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Follows the chain from ci_head on the image and checks that it holds `size`
+ * bytes of file #index as rewritten once. Leaves the number of contiguous
+ * runs the chain is made of in *nc_runs.
+ */
+static bool bench_chain_holds(bench_volume_t *vol, unsigned int index, thinfat_cluster_t ci_head, uint32_t size, unsigned int *nc_runs)
+{
+  thinfat_t *tf = &vol->tf;
+  const uint8_t *table = vol->image + (size_t)(tf->si_hidden + tf->sc_reserved) * tf->sz_sector;
+  thinfat_cluster_t nc_entries = tf->sc_table_size * (tf->sz_sector >> tf->type), ci = ci_head, ci_prev = 0;
+  uint32_t sz_cluster = (uint32_t)thinfat_stob(tf, 1 << tf->ctos_shift), offset = 0;
+
+  *nc_runs = 0;
+  for (; offset < size; offset += sz_cluster)
+  {
+    const uint8_t *data;
+    if (ci < 2 || ci >= nc_entries)
+      return false;
+    data = vol->image + (size_t)thinfat_ctos(tf, ci) * tf->sz_sector;
+    if (ci != ci_prev + 1)
+      (*nc_runs)++;
+    for (uint32_t i = 0; i < sz_cluster && offset + i < size; i++)
+      if (data[i] != bench_volume_byte(vol, index, 1, offset + i))
+        return false;
+    ci_prev = ci;
+    ci = tf->type == THINFAT_TYPE_FAT32 ? thinfat_read_u32(table, ci * 4) & THINFAT_FAT32_CLUSTER_MASK : thinfat_read_u16(table, ci * 2);
+  }
+  return true;
+}
+
+/*
+ * A logger streaming `sz_total` bytes into an empty file in `chunk` byte
+ * writes, while another takes `nc_stray` single clusters after each one.
+ * The file first grows as it is written, each write preceded by a
+ * preallocation of just what it needs, and then has all of it preallocated
+ * up front. Reports the sustained throughput and write latency, and how
+ * many runs the file ended up in. Throughput counts the time spent in the
+ * preallocation and write calls only.
+ */
+static int bench_stream(const bench_image_config_t *config, uint32_t sz_total, size_t chunk, unsigned int nc_stray)
+{
+  static const char *modes[2] = {"grown as written", "preallocated"};
+  unsigned int nc_writes = (unsigned int)((sz_total + chunk - 1) / chunk);
+  double *latencies = (double *)malloc(sizeof(double) * (nc_writes > 0 ? nc_writes : 1));
+  bool failed = false;
+
+  if (latencies == NULL || chunk == 0)
+  {
+    free(latencies);
+    return EXIT_FAILURE;
+  }
+  bench_print_image(config);
+  printf(", %u MiB in %zu byte writes, %u stray clusters after each\n", sz_total / 1048576, chunk, nc_stray);
+  for (unsigned int p = 0; p < 2; p++)
+  {
+    bench_volume_t vol;
+    unsigned int completed = 0, nc_runs = 0;
+    double t_start, t_prealloc = 0.0, t_sum = 0.0;
+    bool held = false;
+
+    if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, chunk, NULL))
+      break;
+    if (!bench_volume_open_file(&vol, 0))
+      vol.failed = true;
+    t_start = bench_now();
+    if (p == 1 && !vol.failed)
+    {
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_preallocate_file(&vol.tf, sz_total, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+        vol.failed = true;
+      t_prealloc = bench_now() - t_start;
+    }
+    for (uint32_t offset = 0; offset < sz_total && !vol.failed; completed++)
+    {
+      size_t sz_written = 0, size = sz_total - offset < chunk ? sz_total - offset : chunk;
+      double t_write;
+      for (size_t i = 0; i < size; i++)
+        vol.buffer[i] = bench_volume_byte(&vol, 0, 1, offset + (uint32_t)i);
+      t_write = bench_now();
+      if (p == 0)
+      {
+        thinfat_phy_enter(&vol.phy);
+        if (thinfat_phy_leave(&vol.phy, thinfat_preallocate_file(&vol.tf, offset + size, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+          vol.failed = true;
+      }
+      thinfat_phy_enter(&vol.phy);
+      vol.phy.arg2 = &sz_written;
+      if (vol.failed || thinfat_phy_leave(&vol.phy, thinfat_write_file(&vol.tf, vol.buffer, size, THINFAT_EVENT_WRITE_FILE)) != THINFAT_RESULT_OK || sz_written != size)
+      {
+        fprintf(stderr, "Failed to write at %u.\n", offset);
+        vol.failed = true;
+        break;
+      }
+      latencies[completed] = bench_now() - t_write;
+      t_sum += latencies[completed];
+      offset += (uint32_t)size;
+      for (unsigned int i = 0; i < nc_stray && !vol.failed; i++)
+      {
+        thinfat_phy_enter(&vol.phy);
+        if (thinfat_phy_leave(&vol.phy, thinfat_table_allocate(&vol.tf, vol.tf.table, 1, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+          vol.failed = true;
+      }
+    }
+    if (!vol.failed)
+      bench_volume_sync(&vol);
+    held = !vol.failed && bench_chain_holds(&vol, 0, vol.tf.cur_file->blk.ci_head, sz_total, &nc_runs);
+    bench_volume_unmount(&vol, NULL);
+
+    qsort(latencies, completed, sizeof(double), bench_compare_double);
+    printf(" %-16s %8.1f MB/s, write avg %7.1f us, p99 %7.1f us, max %7.1f us, preallocation %.2f ms\n",
+           modes[p], completed ? sz_total / (t_sum + t_prealloc) / 1e6 : 0.0, completed ? t_sum / completed * 1e6 : 0.0,
+           completed ? latencies[completed * 99 / 100] * 1e6 : 0.0, completed ? latencies[completed - 1] * 1e6 : 0.0, t_prealloc * 1e3);
+    printf("  %u extensions adding %u clusters, file in %u runs%s%s\n",
+           vol.blk.nc_extends, vol.blk.cc_extended, nc_runs, held ? "" : " CORRUPT", vol.failed ? " FAILED" : "");
+    bench_print_caches(&vol);
+    failed = failed || vol.failed || !held;
+  }
+  free(latencies);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * `nc_files` loggers growing empty files side by side, each writing `chunk`
+ * bytes in turn until it has `sz_file`. The files first get their clusters
+ * write by write, and then with delayed allocation through a `sz_buffer`
+ * byte pending buffer each, flushed at the end. Every file is then opened
+ * afresh and read back. Reports the write and read throughput, counting the
+ * time in the calls only, how many runs the files ended up in, and what
+ * reading them took from the FAT.
+ */
+static int bench_interleave(const bench_image_config_t *config, uint32_t sz_file, size_t chunk, uint32_t sz_buffer)
+{
+  static const char *modes[2] = {"allocated on write", "delayed"};
+  thinfat_file_t *files = (thinfat_file_t *)calloc(config->nc_files > 0 ? config->nc_files : 1, sizeof(thinfat_file_t));
+  bool failed = false;
+
+  if (files == NULL || chunk == 0)
+  {
+    free(files);
+    return EXIT_FAILURE;
+  }
+  bench_print_image(config);
+  printf(", %u MiB each in %zu byte writes taking turns, %u KiB pending buffers\n", sz_file / 1048576, chunk, sz_buffer / 1024);
+  for (unsigned int p = 0; p < 2; p++)
+  {
+    bench_volume_t vol;
+    unsigned int nc_open = 0, nc_runs = 0, nc_bad = 0;
+    uint64_t sz_read = 0;
+    double t_write = 0.0, t_read = 0.0;
+    thinfat_blk_stats_t blk;
+
+    memset(&blk, 0, sizeof(blk));
+    if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, chunk, NULL))
+      break;
+    for (; nc_open < config->nc_files && !vol.failed; nc_open++)
+    {
+      if (!bench_volume_open_file(&vol, nc_open))
+        break;
+      thinfat_file_init(&files[nc_open], &vol.tf, vol.tf.file_cache);
+      thinfat_file_open(&files[nc_open], &vol.entry);
+      if (p == 1 && thinfat_file_set_delayed(&files[nc_open], sz_buffer) != THINFAT_RESULT_OK)
+        vol.failed = true;
+    }
+
+    for (uint32_t offset = 0; offset < sz_file && !vol.failed; offset += (uint32_t)chunk)
+    {
+      size_t size = sz_file - offset < chunk ? sz_file - offset : chunk;
+      for (unsigned int f = 0; f < nc_open && !vol.failed; f++)
+      {
+        size_t sz_written = 0;
+        double t_start;
+        for (size_t i = 0; i < size; i++)
+          vol.buffer[i] = bench_volume_byte(&vol, f, 1, offset + (uint32_t)i);
+        t_start = bench_now();
+        if (p == 0)
+        {
+          thinfat_phy_enter(&vol.phy);
+          if (thinfat_phy_leave(&vol.phy, thinfat_file_preallocate(&vol.tf, &files[f], offset + size, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+            vol.failed = true;
+        }
+        thinfat_phy_enter(&vol.phy);
+        vol.phy.arg2 = &sz_written;
+        if (vol.failed || thinfat_phy_leave(&vol.phy, thinfat_file_write(&vol.tf, &files[f], vol.buffer, size, THINFAT_EVENT_WRITE_FILE)) != THINFAT_RESULT_OK || sz_written != size)
+        {
+          fprintf(stderr, "Failed to write file #%u at %u.\n", f, offset);
+          vol.failed = true;
+        }
+        t_write += bench_now() - t_start;
+      }
+    }
+    for (unsigned int f = 0; f < nc_open && !vol.failed; f++)
+    {
+      double t_start = bench_now();
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_file_flush(&vol.tf, &files[f], THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK || files[f].sz_pending > 0)
+      {
+        fprintf(stderr, "Failed to flush file #%u.\n", f);
+        vol.failed = true;
+      }
+      t_write += bench_now() - t_start;
+    }
+
+    //The directory entries are not rewritten, so the files are reopened from what their handles know
+    for (unsigned int f = 0; f < nc_open && !vol.failed; f++)
+    {
+      thinfat_dir_entry_t entry = vol.entry;
+      entry.ci_head = files[f].blk.ci_head;
+      entry.size = files[f].size;
+      blk.nc_extends += files[f].blk.stats.nc_extends;
+      memset(&files[f].blk.stats, 0, sizeof(thinfat_blk_stats_t));
+      thinfat_file_open(&files[f], &entry);
+      for (uint32_t offset = 0; offset < entry.size && !vol.failed; )
+      {
+        size_t sz_chunk = 0;
+        double t_start = bench_now();
+        thinfat_phy_enter(&vol.phy);
+        vol.phy.arg2 = &sz_chunk;
+        if (thinfat_phy_leave(&vol.phy, thinfat_file_read(&vol.tf, &files[f], vol.buffer, (thinfat_size_t)vol.chunk, THINFAT_EVENT_READ_FILE)) != THINFAT_RESULT_OK || sz_chunk == 0)
+        {
+          fprintf(stderr, "Failed to read file #%u at %u.\n", f, offset);
+          vol.failed = true;
+          break;
+        }
+        t_read += bench_now() - t_start;
+        for (size_t i = 0; i < sz_chunk && !vol.failed; i++)
+          if (vol.buffer[i] != bench_volume_byte(&vol, f, 1, offset + (uint32_t)i))
+          {
+            fprintf(stderr, "File #%u differs at %u.\n", f, offset + (uint32_t)i);
+            vol.failed = true;
+          }
+        offset += (uint32_t)sz_chunk;
+        sz_read += sz_chunk;
+      }
+    }
+
+    if (!vol.failed)
+      bench_volume_sync(&vol);
+    for (unsigned int f = 0; f < nc_open; f++)
+    {
+      unsigned int nc_file = 0;
+      if (!vol.failed && !bench_chain_holds(&vol, f, files[f].blk.ci_head, sz_file, &nc_file))
+        nc_bad++;
+      nc_runs += nc_file;
+      blk.nc_walked += files[f].blk.stats.nc_walked;
+      blk.nc_table_reads += files[f].blk.stats.nc_table_reads;
+      thinfat_file_finalize(&files[f]);
+    }
+    bench_volume_unmount(&vol, NULL);
+
+    printf(" %-18s write %8.1f MB/s, read %8.1f MB/s, %.1f runs per file, %u bad%s\n",
+           modes[p], t_write > 0.0 ? (double)sz_file * nc_open / t_write / 1e6 : 0.0, t_read > 0.0 ? sz_read / t_read / 1e6 : 0.0,
+           nc_open ? (double)nc_runs / nc_open : 0.0, nc_bad, vol.failed ? " FAILED" : "");
+    printf("  %u extensions while writing, %u lookups from the FAT in %u FAT sector reads while reading\n", blk.nc_extends, blk.nc_walked, blk.nc_table_reads);
+    failed = failed || vol.failed || nc_bad > 0;
+  }
+  free(files);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Fragments an empty generated volume with `nc_chains` chains of 1 to 64
+ * clusters, frees a random half of them and then spends half the free space
+ * on chains of `cc_file` clusters, once placing them next-fit and once
+ * best-fit. Reports how many pieces the chains took and the longest free run
+ * left, and checks the chains on the image.
+ */
+static int bench_frag(const bench_image_config_t *config, unsigned int nc_chains, thinfat_cluster_t cc_file)
+{
+  static const char *policies[2] = {"next-fit", "best-fit"};
+  static const thinfat_alloc_policy_t values[2] = {THINFAT_ALLOC_NEXT_FIT, THINFAT_ALLOC_BEST_FIT};
+  thinfat_cluster_t *starts = (thinfat_cluster_t *)malloc(sizeof(thinfat_cluster_t) * (nc_chains > 0 ? nc_chains : 1));
+  thinfat_cluster_t *lengths = (thinfat_cluster_t *)malloc(sizeof(thinfat_cluster_t) * (nc_chains > 0 ? nc_chains : 1));
+  bool failed = false;
+
+  bench_print_image(config);
+  printf(", %u chains of 1-64 clusters, half freed, then half the space in %u-cluster chains\n", nc_chains, cc_file);
+  for (unsigned int p = 0; p < 2 && starts != NULL && lengths != NULL && cc_file > 0; p++)
+  {
+    thinfat_cluster_t *files = NULL, cc_free, cc_free_holes, cc_longest = 0;
+    unsigned int nc_made = 0, nc_target, nc_files = 0, nc_pieces = 0, nc_split = 0, nc_bad = 0;
+    bench_volume_t vol;
+    double t_start, t_run;
+
+    if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, 4096, NULL))
+      break;
+    thinfat_set_alloc_policy(&vol.tf, values[p]);
+    if (thinfat_get_free_clusters(&vol.tf) == THINFAT_UNKNOWN_FREE_COUNT)
+    {
+      fprintf(stderr, "The free count is unknown; build with the free-cluster bitmap.\n");
+      vol.failed = true;
+    }
+    srand(1);
+    for (; nc_made < nc_chains && !vol.failed; nc_made++)
+    {
+      cc_free = thinfat_get_free_clusters(&vol.tf);
+      lengths[nc_made] = 1 + rand() % 64;
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_table_allocate(&vol.tf, vol.tf.table, lengths[nc_made], THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+        vol.failed = true;
+      if (thinfat_get_free_clusters(&vol.tf) == cc_free)
+        break;
+      starts[nc_made] = vol.tf.table->ci_chain;
+    }
+    for (unsigned int i = 0; i < nc_made && !vol.failed; i++)
+    {
+      if (rand() % 2)
+        continue;
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_table_deallocate(&vol.tf, vol.tf.table, starts[i], lengths[i], THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+        vol.failed = true;
+    }
+
+    cc_free_holes = thinfat_get_free_clusters(&vol.tf);
+    nc_target = cc_free_holes / 2 / cc_file;
+    files = (thinfat_cluster_t *)malloc(sizeof(thinfat_cluster_t) * (nc_target + 1));
+    t_start = bench_now();
+    while (files != NULL && nc_files < nc_target && !vol.failed)
+    {
+      cc_free = thinfat_get_free_clusters(&vol.tf);
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_table_allocate(&vol.tf, vol.tf.table, cc_file, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+        vol.failed = true;
+      if (thinfat_get_free_clusters(&vol.tf) == cc_free)
+        break;
+      files[nc_files++] = vol.tf.table->ci_chain;
+      nc_pieces += vol.tf.table->nc_runs;
+      if (vol.tf.table->nc_runs > 1)
+        nc_split++;
+    }
+    t_run = bench_now() - t_start;
+    cc_free = thinfat_get_free_clusters(&vol.tf);
+    if (!vol.failed)
+      bench_volume_sync(&vol);
+    for (unsigned int f = 0; f < nc_files && !vol.failed; f++)
+      if (bench_chain_length(&vol, files[f]) != cc_file)
+        nc_bad++;
+    if (!vol.failed)
+      cc_longest = bench_longest_free(&vol);
+    bench_volume_unmount(&vol, NULL);
+
+    printf(" %s: %u chains in %.1f ms, %.2f pieces each, %u split, %u bad%s\n",
+           policies[p], nc_files, t_run * 1e3, nc_files > 0 ? (double)nc_pieces / nc_files : 0.0, nc_split, nc_bad, vol.failed ? " FAILED" : "");
+    printf("  free clusters " TFF_U32 " -> " TFF_U32 ", longest free run left " TFF_U32 "\n", cc_free_holes, cc_free, cc_longest);
+    failed = failed || vol.failed || nc_bad > 0 || files == NULL || nc_files < nc_target;
+    free(files);
+  }
+  free(starts);
+  free(lengths);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*!
+ * A logger growing its file: one cluster is allocated every `us_period`
+ * microseconds, first with the background write-back off and then with the
+ * default policy. Reports the latency of the calls, how long FAT sectors
+ * stayed dirty and how many were still dirty, that is at risk, at the end.
+ */
+static int bench_log(const bench_image_config_t *config, unsigned int nc_records, unsigned int us_period)
+{
+  static const char *policies[2] = {"no flusher", "flusher"};
+  double *latencies = (double *)malloc(sizeof(double) * (nc_records > 0 ? nc_records : 1));
+  bool failed = false;
+
+  if (latencies == NULL)
+    return EXIT_FAILURE;
+  bench_print_image(config);
+  printf(", %u records every %u us\n", nc_records, us_period);
+  for (unsigned int p = 0; p < 2; p++)
+  {
+    thinfat_phy_flash_t flash;
+    bench_volume_t vol;
+    unsigned int nc_dirty = 0, completed = 0;
+    double t_sum = 0.0;
+
+    if (!bench_volume_mount(&vol, config, &thinfat_default_cache_budget, 4096, &flash))
+    {
+      free(latencies);
+      return EXIT_FAILURE;
+    }
+    if (p == 0)
+      thinfat_set_flush_policy(&vol.tf, 0, 0);
+    for (; completed < nc_records && !vol.failed; completed++)
+    {
+      double t_start = bench_now();
+      thinfat_phy_enter(&vol.phy);
+      if (thinfat_phy_leave(&vol.phy, thinfat_table_allocate(&vol.tf, vol.tf.table, 1, THINFAT_EVENT_ALLOCATE)) != THINFAT_RESULT_OK)
+      {
+        fprintf(stderr, "Failed to allocate record #%u.\n", completed);
+        vol.failed = true;
+        break;
+      }
+      latencies[completed] = bench_now() - t_start;
+      t_sum += latencies[completed];
+      usleep(us_period);
+    }
+    thinfat_phy_lock(&vol.phy);
+    for (unsigned int c = 0; c < THINFAT_CACHE_CLASS_MAX; c++)
+      nc_dirty += vol.tf.cache_pool->nc_dirty[c];
+    thinfat_phy_unlock(&vol.phy);
+    bench_volume_unmount(&vol, NULL);
+
+    qsort(latencies, completed, sizeof(double), bench_compare_double);
+    printf(" %-10s avg %7.1f us, p99 %7.1f us, max %7.1f us, %u sectors dirty at the end%s\n",
+           policies[p], completed ? t_sum / completed * 1e6 : 0.0, completed ? latencies[completed * 99 / 100] * 1e6 : 0.0,
+           completed ? latencies[completed - 1] * 1e6 : 0.0, nc_dirty, vol.failed ? " FAILED" : "");
+    bench_print_caches(&vol);
+    failed = failed || vol.failed;
+  }
+  free(latencies);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Mounts the image at `devpath` once without the free-space scan and then
+ * with the FAT cut into 1 to THINFAT_CONFIG_TABLE_SCAN_STREAMS slices read
+ * side by side, checking that every split finds the same free space.
+ */
+static int bench_mount(const char *devpath, const char *driver_name, unsigned int nc_repeat)
+{
+  thinfat_table_summary_t reference;
+  bool failed = false;
+
+  memset(&reference, 0, sizeof(reference));
+  for (unsigned int nc_streams = 0; nc_streams <= THINFAT_CONFIG_TABLE_SCAN_STREAMS; nc_streams++)
+  {
+    thinfat_table_summary_t summary;
+    thinfat_cluster_t cc_free = 0;
+    double t_best = 0;
+    size_t sz_map = 0;
+    bool mismatch;
+
+    memset(&summary, 0, sizeof(summary));
+    for (unsigned int r = 0; r < nc_repeat && !failed; r++)
+    {
+      thinfat_phy_t phy;
+      thinfat_t tf;
+      double t_start, t_mount;
+      if (bench_open_phy(&phy, devpath, driver_name) == NULL)
+        return EXIT_FAILURE;
+      if (thinfat_initialize(&tf, &phy) != THINFAT_RESULT_OK)
+      {
+        thinfat_phy_finalize(&phy);
+        return EXIT_FAILURE;
+      }
+      thinfat_set_scan_streams(&tf, nc_streams);
+      thinfat_phy_start(&phy);
+      t_start = bench_now();
+      thinfat_phy_enter(&phy);
+      if (thinfat_phy_leave(&phy, thinfat_mount(&tf, 0, THINFAT_EVENT_MOUNT)) != THINFAT_RESULT_OK)
+      {
+        fprintf(stderr, "Failed to mount %s.\n", devpath);
+        failed = true;
+      }
+      t_mount = bench_now() - t_start;
+      if (r == 0 || t_mount < t_best)
+        t_best = t_mount;
+      cc_free = thinfat_get_free_clusters(&tf);
+      sz_map = thinfat_get_free_map_size(&tf);
+      thinfat_phy_lock(&phy);
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+      summary = tf.table->summary;
+#endif
+      thinfat_phy_unlock(&phy);
+      thinfat_phy_stop(&phy);
+      thinfat_finalize(&tf);
+      thinfat_phy_finalize(&phy);
+    }
+    if (nc_streams == 1)
+      reference = summary;
+    mismatch = nc_streams > 1 && sz_map > 0 && memcmp(&summary, &reference, sizeof(summary)) != 0;
+    failed = failed || mismatch;
+    if (nc_streams == 0)
+      printf("%-6s no scan:    %8.2f ms, " TFF_U32 " free as FSInfo says\n", driver_name, t_best * 1e3, cc_free);
+    else
+      printf("%-6s %u stream%s:   %8.2f ms, " TFF_U32 " free, longest run " TFF_U32 " @ " TFF_U32 ", bitmap %zu bytes%s\n", driver_name, nc_streams,
+             nc_streams > 1 ? "s" : " ", t_best * 1e3, cc_free, summary.cc_longest, summary.ci_longest, sz_map, mismatch ? " MISMATCH" : "");
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//Counts the free entries and the successive runs of cc_search of them one entry at a time, as the FAT search used to.
+static thinfat_cluster_t bench_scan_scalar(thinfat_type_t type, const uint8_t *fat, thinfat_cluster_t nc_entries, thinfat_cluster_t cc_search, thinfat_cluster_t *nc_free)
+{
+  thinfat_cluster_t nc_runs = 0, cc_run = 0;
+  *nc_free = 0;
+  for (thinfat_cluster_t i = 0; i < nc_entries; i++)
+  {
+    thinfat_cluster_t value;
+    if (type == THINFAT_TYPE_FAT32)
+      value = thinfat_read_u32(fat, i * 4) & THINFAT_FAT32_CLUSTER_MASK;
+    else
+      value = thinfat_read_u16(fat, i * 2);
+    if (value != 0)
+    {
+      cc_run = 0;
+      continue;
+    }
+    (*nc_free)++;
+    if (++cc_run == cc_search)
+    {
+      nc_runs++;
+      cc_run = 0;
+    }
+  }
+  return nc_runs;
+}
+
+//The same with the selected kernel: the mask first, as the mount scan builds it, then the runs in it.
+static thinfat_cluster_t bench_scan_kernel(thinfat_type_t type, const uint8_t *fat, thinfat_cluster_t nc_entries, thinfat_cluster_t cc_search, uint32_t *mask, thinfat_cluster_t *nc_free)
+{
+  thinfat_cluster_t nc_runs = 0;
+  thinfat_scan_zero_mask(type, fat, nc_entries, mask);
+  *nc_free = thinfat_scan_count(mask, nc_entries / 32);
+  for (thinfat_cluster_t bi = 0; bi < nc_entries; bi++)
+  {
+    thinfat_cluster_t cc_run = 0;
+    bi = thinfat_scan_find_run(mask, bi, nc_entries, cc_search, &cc_run);
+    if (bi < nc_entries)
+      nc_runs++;
+  }
+  return nc_runs;
+}
+
+/*
+ * Times the FAT scanning kernels against the entry-at-a-time loop on `kib`
+ * KiB of generated FAT, in which runs of 1 to 64 entries are free with
+ * probability free_pct percent. Free and used FAT32 entries get random high
+ * nibbles, which the kernels must ignore.
+ */
+static int bench_scan(const char *type_name, unsigned int kib, thinfat_cluster_t cc_search, unsigned int free_pct)
+{
+  thinfat_type_t type = strcmp(type_name, "fat16") == 0 ? THINFAT_TYPE_FAT16 : THINFAT_TYPE_FAT32;
+  size_t sz_entry = type == THINFAT_TYPE_FAT32 ? 4 : 2;
+  thinfat_cluster_t nc_entries = (thinfat_cluster_t)((size_t)kib * 1024 / sz_entry / 32 * 32);
+  uint8_t *fat = (uint8_t *)malloc(nc_entries * sz_entry);
+  uint32_t *mask = (uint32_t *)malloc(nc_entries / 8);
+  thinfat_scan_kernel_t best = thinfat_scan_get_kernel();
+  thinfat_cluster_t nc_free_ref, nc_runs_ref;
+  unsigned int nc_rounds = 0;
+  double t_start, t_scalar;
+  bool failed = false;
+
+  if (fat == NULL || mask == NULL || nc_entries == 0 || cc_search == 0)
+  {
+    free(fat);
+    free(mask);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  for (thinfat_cluster_t i = 0; i < nc_entries;)
+  {
+    bool is_free = (unsigned int)(rand() % 100) < free_pct;
+    for (thinfat_cluster_t cc = 1 + rand() % 64; cc > 0 && i < nc_entries; cc--, i++)
+    {
+      if (type == THINFAT_TYPE_FAT32)
+        thinfat_write_u32(fat, i * 4, ((uint32_t)(rand() & 0xF) << 28) | (is_free ? 0 : (i + 3) & THINFAT_FAT32_CLUSTER_MASK));
+      else
+        thinfat_write_u16(fat, i * 2, is_free ? 0 : (uint16_t)(i % 0xFFE0 + 2));
+    }
+  }
+
+  t_start = bench_now();
+  do
+  {
+    nc_runs_ref = bench_scan_scalar(type, fat, nc_entries, cc_search, &nc_free_ref);
+    nc_rounds++;
+  }
+  while ((t_scalar = bench_now() - t_start) < 0.2);
+  t_scalar /= nc_rounds;
+  printf("%s, %u KiB of FAT, %u%% free in runs: " TFF_U32 " free, " TFF_U32 " runs of " TFF_U32 "\n",
+         type == THINFAT_TYPE_FAT32 ? "FAT32" : "FAT16", kib, free_pct, nc_free_ref, nc_runs_ref, cc_search);
+  printf(" %-8s %9.1f MB/s\n", "scalar", nc_entries * sz_entry / t_scalar / 1e6);
+
+  for (thinfat_scan_kernel_t k = THINFAT_SCAN_KERNEL_PORTABLE; k < THINFAT_SCAN_KERNEL_MAX; k++)
+  {
+    thinfat_cluster_t nc_free, nc_runs;
+    double t_mask, t_run;
+    if (thinfat_scan_set_kernel(k) != THINFAT_RESULT_OK)
+    {
+      printf(" %-8s not available\n", thinfat_scan_kernel_name(k));
+      continue;
+    }
+    t_start = bench_now();
+    for (nc_rounds = 0; nc_rounds == 0 || (t_mask = bench_now() - t_start) < 0.2; nc_rounds++)
+      thinfat_scan_zero_mask(type, fat, nc_entries, mask);
+    t_mask /= nc_rounds;
+    t_start = bench_now();
+    for (nc_rounds = 0; nc_rounds == 0 || (t_run = bench_now() - t_start) < 0.2; nc_rounds++)
+      nc_runs = bench_scan_kernel(type, fat, nc_entries, cc_search, mask, &nc_free);
+    t_run /= nc_rounds;
+    printf(" %-8s %9.1f MB/s masking, %9.1f MB/s with the run search (x%.1f)%s\n", thinfat_scan_kernel_name(k),
+           nc_entries * sz_entry / t_mask / 1e6, nc_entries * sz_entry / t_run / 1e6, t_scalar / t_run,
+           nc_free != nc_free_ref || nc_runs != nc_runs_ref ? " MISMATCH" : "");
+    failed = failed || nc_free != nc_free_ref || nc_runs != nc_runs_ref;
+  }
+  thinfat_scan_set_kernel(best);
+
+  free(fat);
+  free(mask);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//Gives the cache nc_lines sectors, keeping the default guarantees and letting any class borrow the rest.
+static void bench_scale_budget(thinfat_cache_budget_t *budget, unsigned int nc_lines)
+{
+  unsigned int nc_reserved = 0;
+  for (unsigned int c = 0; c < THINFAT_CACHE_CLASS_MAX; c++)
+    nc_reserved += budget->nc_min[c];
+  budget->nc_lines = nc_lines;
+  for (unsigned int c = 0; c < THINFAT_CACHE_CLASS_MAX; c++)
+    budget->nc_max[c] = nc_lines >= nc_reserved ? nc_lines - nc_reserved + budget->nc_min[c] : budget->nc_min[c];
+}
+
+int main(int argc, const char *argv[])
+{
+  if (argc >= 4 && strcmp(argv[1], "phy") == 0)
+  {
+    thinfat_sector_t sc_cluster = argc > 4 ? (thinfat_sector_t)atoi(argv[4]) : 8;
+    unsigned int count = argc > 5 ? (unsigned int)atoi(argv[5]) : 65536;
+    unsigned int depth = argc > 6 ? (unsigned int)atoi(argv[6]) : 1;
+    return bench_phy(argv[2], argv[3], sc_cluster, count, depth);
+  }
+  else if (argc >= 4 && strcmp(argv[1], "wakeup") == 0)
+  {
+    unsigned int count = argc > 4 ? (unsigned int)atoi(argv[4]) : 10000;
+    return bench_wakeup(argv[2], argv[3], count);
+  }
+  else if (argc >= 4 && strcmp(argv[1], "queue") == 0)
+  {
+    unsigned int count = argc > 4 ? (unsigned int)atoi(argv[4]) : 65536;
+    unsigned int depth = argc > 5 ? (unsigned int)atoi(argv[5]) : 8;
+    return bench_queue(argv[2], argv[3], count, depth);
+  }
+  else if (argc >= 8 && strcmp(argv[1], "mkimg") == 0)
+  {
+    bench_image_config_t config;
+    if (bench_parse_image(&config, argc - 3, argv + 3))
+      return bench_mkimg(argv[2], &config);
+  }
+  else if (argc >= 7 && strcmp(argv[1], "alloc") == 0)
+  {
+    bench_image_config_t config;
+    const char *image[5] = {argv[2], argv[3], argv[4], "0", "0"};
+    if (bench_parse_image(&config, 5, image))
+      return bench_alloc(&config, (thinfat_cluster_t)atoi(argv[5]), (unsigned int)atoi(argv[6]));
+  }
+  else if (argc >= 7 && strcmp(argv[1], "delete") == 0)
+  {
+    bench_image_config_t config;
+    if (bench_parse_image(&config, argc - 2 < 7 ? argc - 2 : 7, argv + 2))
+      return bench_delete(&config);
+  }
+  else if (argc >= 8 && strcmp(argv[1], "seek") == 0)
+  {
+    bench_image_config_t config;
+    if (bench_parse_image(&config, argc - 3 < 7 ? argc - 3 : 7, argv + 3))
+      return bench_seek(&config, (unsigned int)atoi(argv[2]));
+  }
+  else if (argc >= 7 && strcmp(argv[1], "frag") == 0)
+  {
+    bench_image_config_t config;
+    const char *image[5] = {argv[2], argv[3], argv[4], "0", "0"};
+    if (bench_parse_image(&config, 5, image))
+      return bench_frag(&config, (unsigned int)atoi(argv[5]), (thinfat_cluster_t)atoi(argv[6]));
+  }
+  else if (argc >= 6 && strcmp(argv[1], "stream") == 0)
+  {
+    bench_image_config_t config;
+    const char *image[5] = {argv[2], argv[3], argv[4], "1", "0"};
+    size_t chunk = argc > 6 ? (size_t)atoi(argv[6]) : 4096;
+    unsigned int nc_stray = argc > 7 ? (unsigned int)atoi(argv[7]) : 1;
+    if (bench_parse_image(&config, 5, image))
+      return bench_stream(&config, (uint32_t)atoi(argv[5]) * 1048576, chunk, nc_stray);
+  }
+  else if (argc >= 7 && strcmp(argv[1], "interleave") == 0)
+  {
+    bench_image_config_t config;
+    const char *image[5] = {argv[2], argv[3], argv[4], argv[5], "0"};
+    uint32_t sz_file = (uint32_t)atoi(argv[6]) * 1048576;
+    size_t chunk = argc > 7 ? (size_t)atoi(argv[7]) : 4096;
+    uint32_t sz_buffer = argc > 8 ? (uint32_t)atoi(argv[8]) * 1024 : sz_file;
+    if (bench_parse_image(&config, 5, image))
+      return bench_interleave(&config, sz_file, chunk, sz_buffer);
+  }
+  else if (argc >= 7 && strcmp(argv[1], "log") == 0)
+  {
+    bench_image_config_t config;
+    const char *image[5] = {argv[2], argv[3], argv[4], "0", "0"};
+    if (bench_parse_image(&config, 5, image))
+      return bench_log(&config, (unsigned int)atoi(argv[5]), (unsigned int)atoi(argv[6]));
+  }
+  else if (argc >= 4 && strcmp(argv[1], "mount") == 0)
+  {
+    unsigned int nc_repeat = argc > 4 ? (unsigned int)atoi(argv[4]) : 3;
+    return bench_mount(argv[2], argv[3], nc_repeat > 0 ? nc_repeat : 1);
+  }
+  else if (argc >= 5 && strcmp(argv[1], "scan") == 0)
+  {
+    unsigned int free_pct = argc > 5 ? (unsigned int)atoi(argv[5]) : 10;
+    return bench_scan(argv[2], (unsigned int)atoi(argv[3]), (thinfat_cluster_t)atoi(argv[4]), free_pct);
+  }
+  else if (argc >= 7 && (strcmp(argv[1], "file") == 0 || strcmp(argv[1], "flash") == 0))
+  {
+    bench_image_config_t config;
+    thinfat_cache_budget_t budget = thinfat_default_cache_budget;
+    size_t chunk = argc > 9 ? (size_t)atoi(argv[9]) : 65536;
+    if (argc > 10)
+      bench_scale_budget(&budget, (unsigned int)atoi(argv[10]));
+    if (bench_parse_image(&config, argc - 2 < 7 ? argc - 2 : 7, argv + 2))
+      return strcmp(argv[1], "file") == 0 ? bench_file(&config, &budget, chunk) : bench_flash(&config, &budget, chunk);
+  }
+
+  fprintf(stderr, "Usage: %s phy <image> <driver> [sectors per cluster] [count] [depth]\n", argv[0]);
+  fprintf(stderr, "       %s wakeup <image> <driver> [count]\n", argv[0]);
+  fprintf(stderr, "       %s queue <image> <driver> [count] [depth]\n", argv[0]);
+  fprintf(stderr, "       %s mkimg <image> <fat16|fat32>[-4k] <MiB> <sectors per cluster> <files> <file KiB> [run] [seed]\n", argv[0]);
+  fprintf(stderr, "       %s file <fat16|fat32>[-4k] <MiB> <sectors per cluster> <files> <file KiB> [run] [seed] [chunk] [cache lines]\n", argv[0]);
+  fprintf(stderr, "       %s flash <fat16|fat32>[-4k] <MiB> <sectors per cluster> <files> <file KiB> [run] [seed] [chunk] [cache lines]\n", argv[0]);
+  fprintf(stderr, "       %s delete <fat16|fat32>[-4k] <MiB> <sectors per cluster> <files> <file KiB> [run] [seed]\n", argv[0]);
+  fprintf(stderr, "       %s seek <seeks per file> <fat16|fat32>[-4k] <MiB> <sectors per cluster> <files> <file KiB> [run] [seed]\n", argv[0]);
+  fprintf(stderr, "       %s alloc <fat16|fat32>[-4k] <MiB> <sectors per cluster> <clusters per chain> <chains>\n", argv[0]);
+  fprintf(stderr, "       %s frag <fat16|fat32>[-4k] <MiB> <sectors per cluster> <chains> <clusters per chain>\n", argv[0]);
+  fprintf(stderr, "       %s stream <fat16|fat32>[-4k] <MiB> <sectors per cluster> <MiB written> [chunk] [stray clusters per write]\n", argv[0]);
+  fprintf(stderr, "       %s interleave <fat16|fat32>[-4k] <MiB> <sectors per cluster> <files> <MiB per file> [chunk] [pending KiB]\n", argv[0]);
+  fprintf(stderr, "       %s log <fat16|fat32>[-4k] <MiB> <sectors per cluster> <records> <us between records>\n", argv[0]);
+  fprintf(stderr, "       %s mount <image> <driver> [repeat]\n", argv[0]);
+  fprintf(stderr, "       %s scan <fat16|fat32> <FAT KiB> <clusters per run> [percent free]\n", argv[0]);
+  return EXIT_FAILURE;
+}
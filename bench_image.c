@@ -0,0 +1,289 @@
+/*!
+ * @file bench_image.c
+ * @brief Reproducible FAT image generator for the thinFAT benchmarks <br>
+ *        Lays out FAT16/FAT32 volumes in memory with a chosen cluster size,
+ *        file count and degree of fragmentation.
+ * @date 2017/02/08
+ * @author Hiroka IHARA
+ */
+#include "bench_image.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_IMAGE_ROOT_ENTRIES (512)
+#define BENCH_IMAGE_FSINFO_SECTOR (1)
+
+typedef struct bench_image_layout_tag
+{
+  uint8_t *image;
+  const bench_image_config_t *config;
+  size_t sz_sector;
+  thinfat_sector_t sc_reserved, sc_table, sc_root;
+  thinfat_sector_t si_data;
+  thinfat_cluster_t cc_volume;
+}
+bench_image_layout_t;
+
+static void bench_put_u16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void bench_put_u32(uint8_t *p, uint32_t v)
+{
+  bench_put_u16(p, (uint16_t)v);
+  bench_put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static uint32_t bench_xorshift32(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+void bench_image_name(wchar_t *name, unsigned int index)
+{
+  static const char format[] = "file0000.bin";
+  for (unsigned int i = 0; i < BENCH_IMAGE_NAME_LENGTH; i++)
+    name[i] = format[i];
+  for (unsigned int i = 7; i >= 4; i--, index /= 10)
+    name[i] = L'0' + index % 10;
+  name[BENCH_IMAGE_NAME_LENGTH] = L'\0';
+}
+
+static void bench_image_set_next(bench_image_layout_t *layout, thinfat_cluster_t ci, thinfat_cluster_t ci_next)
+{
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    uint8_t *table = layout->image + layout->sz_sector * (size_t)(layout->sc_reserved + i * layout->sc_table);
+    if (layout->config->type == THINFAT_TYPE_FAT32)
+      bench_put_u32(table + 4 * (size_t)ci, ci_next);
+    else
+      bench_put_u16(table + 2 * (size_t)ci, (uint16_t)ci_next);
+  }
+}
+
+static uint8_t *bench_image_cluster(bench_image_layout_t *layout, thinfat_cluster_t ci)
+{
+  return layout->image + layout->sz_sector * ((size_t)layout->si_data + (size_t)(ci - 2) * layout->config->sc_cluster);
+}
+
+static uint8_t bench_image_checksum(const uint8_t *name)
+{
+  uint8_t sum = 0;
+  for (unsigned int i = 0; i < 11; i++)
+    sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+  return sum;
+}
+
+//Writes the LFN entry and the short entry of file `index` at `entries`.
+static void bench_image_put_entry(uint8_t *entries, unsigned int index, thinfat_cluster_t ci_head, uint32_t size)
+{
+  wchar_t name[BENCH_IMAGE_NAME_LENGTH + 1];
+  uint8_t *lfn = entries, *sfn = entries + 32;
+  uint16_t chars[13];
+
+  bench_image_name(name, index);
+  memset(sfn, 0, 32);
+  memcpy(sfn, "FILE0000BIN", 11);
+  for (unsigned int i = 0; i < 4; i++)
+    sfn[4 + i] = (uint8_t)name[4 + i];
+  sfn[11] = 0x20;
+  bench_put_u16(sfn + 20, (uint16_t)(ci_head >> 16));
+  bench_put_u16(sfn + 26, (uint16_t)ci_head);
+  bench_put_u32(sfn + 28, size);
+
+  for (unsigned int i = 0; i < 13; i++)
+    chars[i] = i < BENCH_IMAGE_NAME_LENGTH ? (uint16_t)name[i] : i == BENCH_IMAGE_NAME_LENGTH ? 0x0000 : 0xFFFF;
+  memset(lfn, 0, 32);
+  lfn[0] = 0x41;
+  lfn[11] = 0x0F;
+  lfn[13] = bench_image_checksum(sfn);
+  for (unsigned int i = 0; i < 5; i++)
+    bench_put_u16(lfn + 1 + 2 * i, chars[i]);
+  for (unsigned int i = 0; i < 6; i++)
+    bench_put_u16(lfn + 14 + 2 * i, chars[5 + i]);
+  for (unsigned int i = 0; i < 2; i++)
+    bench_put_u16(lfn + 28 + 2 * i, chars[11 + i]);
+}
+
+static bool bench_image_plan(bench_image_layout_t *layout)
+{
+  const bench_image_config_t *config = layout->config;
+  unsigned int sz_entry = config->type == THINFAT_TYPE_FAT32 ? 4 : 2;
+
+  layout->sc_reserved = config->type == THINFAT_TYPE_FAT32 ? 32 : 1;
+  layout->sc_root = config->type == THINFAT_TYPE_FAT32 ? 0 : BENCH_IMAGE_ROOT_ENTRIES * 32 / layout->sz_sector;
+  for (layout->sc_table = 1; ; )
+  {
+    thinfat_sector_t sc_data = config->sc_volume - layout->sc_reserved - 2 * layout->sc_table - layout->sc_root;
+    thinfat_sector_t sc_needed;
+    layout->cc_volume = sc_data / config->sc_cluster;
+    sc_needed = ((layout->cc_volume + 2) * sz_entry + layout->sz_sector - 1) / layout->sz_sector;
+    if (sc_needed <= layout->sc_table)
+      break;
+    layout->sc_table = sc_needed;
+  }
+  layout->si_data = layout->sc_reserved + 2 * layout->sc_table + layout->sc_root;
+
+  //thinFAT tells the type apart by the cluster count alone
+  if (config->type == THINFAT_TYPE_FAT16 && (layout->cc_volume < 4085 || layout->cc_volume >= 65525))
+  {
+    THINFAT_ERROR("%u clusters do not make a FAT16 volume.\n", layout->cc_volume);
+    return false;
+  }
+  if (config->type == THINFAT_TYPE_FAT32 && layout->cc_volume < 65525)
+  {
+    THINFAT_ERROR("%u clusters do not make a FAT32 volume.\n", layout->cc_volume);
+    return false;
+  }
+  if (config->type == THINFAT_TYPE_FAT16 && 2 * config->nc_files > BENCH_IMAGE_ROOT_ENTRIES)
+  {
+    THINFAT_ERROR("The FAT16 root directory holds at most %u files.\n", BENCH_IMAGE_ROOT_ENTRIES / 2);
+    return false;
+  }
+  return true;
+}
+
+static void bench_image_format(bench_image_layout_t *layout, thinfat_cluster_t cc_root, thinfat_cluster_t ci_next_free)
+{
+  const bench_image_config_t *config = layout->config;
+  uint8_t *bpb = layout->image;
+  bool fat32 = config->type == THINFAT_TYPE_FAT32;
+
+  memcpy(bpb, "\xEB\x3C\x90MSWIN4.1", 11);
+  bench_put_u16(bpb + 11, (uint16_t)layout->sz_sector);
+  bpb[13] = config->sc_cluster;
+  bench_put_u16(bpb + 14, (uint16_t)layout->sc_reserved);
+  bpb[16] = 2;
+  bench_put_u16(bpb + 17, fat32 ? 0 : BENCH_IMAGE_ROOT_ENTRIES);
+  bench_put_u16(bpb + 19, !fat32 && config->sc_volume < 0x10000 ? (uint16_t)config->sc_volume : 0);
+  bpb[21] = 0xF8;
+  bench_put_u16(bpb + 22, fat32 ? 0 : (uint16_t)layout->sc_table);
+  bench_put_u16(bpb + 24, 63);
+  bench_put_u16(bpb + 26, 255);
+  bench_put_u32(bpb + 32, !fat32 && config->sc_volume < 0x10000 ? 0 : config->sc_volume);
+  if (fat32)
+  {
+    uint8_t *fsinfo = layout->image + layout->sz_sector * BENCH_IMAGE_FSINFO_SECTOR;
+    bench_put_u32(bpb + 36, layout->sc_table);
+    bench_put_u32(bpb + 44, 2);
+    bench_put_u16(bpb + 48, BENCH_IMAGE_FSINFO_SECTOR);
+    bench_put_u16(bpb + 50, 6);
+
+    bench_put_u32(fsinfo, 0x41615252);
+    bench_put_u32(fsinfo + 484, 0x61417272);
+    bench_put_u32(fsinfo + 488, layout->cc_volume + 2 - ci_next_free);
+    bench_put_u32(fsinfo + 492, ci_next_free);
+    bench_put_u32(fsinfo + 508, 0xAA550000);
+  }
+  //Larger sectors carry the signature at 510 and at their very end
+  bench_put_u16(bpb + 510, 0xAA55);
+  bench_put_u16(bpb + layout->sz_sector - 2, 0xAA55);
+
+  bench_image_set_next(layout, 0, fat32 ? 0x0FFFFFF8 : 0xFFF8);
+  bench_image_set_next(layout, 1, fat32 ? 0x0FFFFFFF : 0xFFFF);
+  for (thinfat_cluster_t i = 0; i < cc_root; i++)
+    bench_image_set_next(layout, 2 + i, i + 1 < cc_root ? 3 + i : 0x0FFFFFFF);
+}
+
+/*!
+ * Builds a volume of config->sc_volume sectors holding config->nc_files files
+ * named file0000.bin and on, each config->sz_file bytes long. Every file is
+ * cut into fragments of config->cc_run clusters, laid out round-robin across
+ * the files, or in an order shuffled by config->seed. Returns NULL if the
+ * geometry does not fit the requested FAT type.
+ */
+uint8_t *bench_image_create(const bench_image_config_t *config)
+{
+  bench_image_layout_t layout;
+  size_t sz_sector = bench_image_sector_size(config);
+  uint32_t sz_cluster = (uint32_t)sz_sector * config->sc_cluster;
+  thinfat_cluster_t cc_file = (config->sz_file + sz_cluster - 1) / sz_cluster;
+  thinfat_cluster_t cc_run = config->cc_run == 0 || config->cc_run > cc_file ? cc_file : config->cc_run;
+  unsigned int nc_runs = cc_run == 0 ? 0 : (cc_file + cc_run - 1) / cc_run;
+  unsigned int nc_pieces = config->nc_files * nc_runs;
+  thinfat_cluster_t cc_root = 0, ci_next;
+  uint32_t *pieces, *starts;
+  uint8_t *entries;
+
+  layout.config = config;
+  layout.sz_sector = sz_sector;
+  if (!bench_image_plan(&layout))
+    return NULL;
+  if (config->type == THINFAT_TYPE_FAT32)
+    cc_root = ((config->nc_files * 2 + 1) * 32 + sz_cluster - 1) / sz_cluster;
+  if (cc_root + (thinfat_cluster_t)config->nc_files * cc_file > layout.cc_volume)
+  {
+    THINFAT_ERROR("The files do not fit in %u clusters.\n", layout.cc_volume);
+    return NULL;
+  }
+
+  layout.image = (uint8_t *)calloc(config->sc_volume, sz_sector);
+  pieces = (uint32_t *)malloc(sizeof(uint32_t) * (nc_pieces + 1));
+  starts = (uint32_t *)malloc(sizeof(uint32_t) * (nc_pieces + 1));
+  if (layout.image == NULL || pieces == NULL || starts == NULL)
+  {
+    free(layout.image);
+    free(pieces);
+    free(starts);
+    return NULL;
+  }
+
+  //Piece r * nc_files + f is fragment r of file f
+  for (unsigned int i = 0; i < nc_pieces; i++)
+    pieces[i] = i;
+  if (config->seed != 0)
+  {
+    uint32_t state = config->seed;
+    for (unsigned int i = nc_pieces; i > 1; i--)
+    {
+      unsigned int j = bench_xorshift32(&state) % i;
+      uint32_t t = pieces[i - 1];
+      pieces[i - 1] = pieces[j];
+      pieces[j] = t;
+    }
+  }
+  ci_next = 2 + cc_root;
+  for (unsigned int i = 0; i < nc_pieces; i++)
+  {
+    unsigned int run = pieces[i] / config->nc_files;
+    starts[pieces[i]] = ci_next;
+    ci_next += run + 1 < nc_runs ? cc_run : cc_file - run * cc_run;
+  }
+
+  bench_image_format(&layout, cc_root, ci_next);
+  entries = config->type == THINFAT_TYPE_FAT32 ? bench_image_cluster(&layout, 2) : layout.image + sz_sector * (size_t)(layout.sc_reserved + 2 * layout.sc_table);
+
+  for (unsigned int f = 0; f < config->nc_files; f++)
+  {
+    thinfat_cluster_t ci_prev = 0;
+    uint32_t offset = 0;
+    for (unsigned int r = 0; r < nc_runs; r++)
+    {
+      thinfat_cluster_t ci = starts[r * config->nc_files + f];
+      thinfat_cluster_t cc = r + 1 < nc_runs ? cc_run : cc_file - r * cc_run;
+      for (thinfat_cluster_t c = 0; c < cc; c++, ci++)
+      {
+        uint8_t *data = bench_image_cluster(&layout, ci);
+        for (uint32_t i = 0; i < sz_cluster && offset < config->sz_file; i++, offset++)
+          data[i] = bench_image_byte(f, offset);
+        if (ci_prev != 0)
+          bench_image_set_next(&layout, ci_prev, ci);
+        ci_prev = ci;
+      }
+    }
+    if (ci_prev != 0)
+      bench_image_set_next(&layout, ci_prev, 0x0FFFFFFF);
+    bench_image_put_entry(entries + 64 * (size_t)f, f, nc_runs > 0 ? starts[f] : 0, config->sz_file);
+  }
+
+  free(pieces);
+  free(starts);
+  return layout.image;
+}
@@ -0,0 +1,47 @@
+/*!
+ * @file bench_image.h
+ * @brief Reproducible FAT image generator for the thinFAT benchmarks
+ * @date 2017/02/08
+ * @author Hiroka IHARA
+ */
+#ifndef BENCH_IMAGE_H
+#define BENCH_IMAGE_H
+
+#include "thinfat.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BENCH_IMAGE_NAME_LENGTH (12)
+
+typedef struct bench_image_config_tag
+{
+  thinfat_type_t type;
+  //Bytes per sector; 0 means 512
+  thinfat_size_t sz_sector;
+  thinfat_sector_t sc_volume;
+  uint8_t sc_cluster;
+  unsigned int nc_files;
+  uint32_t sz_file;
+  //Clusters per fragment; 0 keeps every file contiguous
+  thinfat_cluster_t cc_run;
+  //Shuffles the fragments across the volume unless 0
+  uint32_t seed;
+}
+bench_image_config_t;
+
+uint8_t *bench_image_create(const bench_image_config_t *config);
+void bench_image_name(wchar_t *name, unsigned int index);
+
+static inline size_t bench_image_sector_size(const bench_image_config_t *config)
+{
+  return config->sz_sector != 0 ? config->sz_sector : 512;
+}
+
+//Contents of byte `offset` of file `index`
+static inline uint8_t bench_image_byte(unsigned int index, uint32_t offset)
+{
+  return (uint8_t)((offset * 7 + index * 13) % 251);
+}
+
+#endif
@@ -47,7 +47,7 @@ int main(int argc, const char *argv[])
   }
 
   thinfat_phy_t phy;
-  if (thinfat_phy_initialize(&phy, argv[1]) != THINFAT_RESULT_OK)
+  if (thinfat_phy_initialize(&phy, NULL, argv[1]) != THINFAT_RESULT_OK)
   {
     fprintf(stderr, "Failed to initialize the PHY.\n");
     return EXIT_FAILURE;
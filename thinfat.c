@@ -18,6 +18,10 @@
 static thinfat_result_t thinfat_read_mbr_callback(thinfat_t *tf, void *mbr);
 static thinfat_result_t thinfat_read_parameter_block_callback(thinfat_t *tf, void *bpb);
 static thinfat_result_t thinfat_read_fsinfo_callback(thinfat_t *tf, void *fsi);
+static thinfat_result_t thinfat_write_fsinfo_callback(thinfat_t *tf, void *fsi);
+static thinfat_result_t thinfat_sync_table(thinfat_t *tf);
+static thinfat_result_t thinfat_sync_failed(thinfat_t *tf, thinfat_result_t result);
+static thinfat_result_t thinfat_sync_done(thinfat_t *tf);
 
 /*static void thinfat_memcpy(void *dest, const void *src, size_t len)
 {
@@ -40,6 +44,16 @@ thinfat_result_t thinfat_core_callback(void *instance, thinfat_core_event_t even
       return thinfat_read_parameter_block_callback((thinfat_t *)instance, *(void **)p_param);
     case THINFAT_CORE_EVENT_READ_FSINFO:
       return thinfat_read_fsinfo_callback((thinfat_t *)instance, *(void **)p_param);
+    case THINFAT_CORE_EVENT_SCAN_TABLE:
+      return thinfat_core_callback(instance, ((thinfat_t *)instance)->event, ((thinfat_t *)instance)->si_hidden, NULL);
+    case THINFAT_CORE_EVENT_WRITE_FSINFO:
+      return thinfat_write_fsinfo_callback((thinfat_t *)instance, *(void **)p_param);
+    case THINFAT_CORE_EVENT_FLUSH_FILE:
+      if (p_param == NULL)
+        return thinfat_sync_failed((thinfat_t *)instance, (thinfat_result_t)s_param);
+      return thinfat_sync_table((thinfat_t *)instance);
+    case THINFAT_CORE_EVENT_SYNCED:
+      return thinfat_sync_done((thinfat_t *)instance);
     }
   }
   else if (event < THINFAT_CACHE_EVENT_MAX)
@@ -56,6 +70,26 @@ thinfat_result_t thinfat_core_callback(void *instance, thinfat_core_event_t even
   return thinfat_user_callback((thinfat_t *)instance, event, s_param, p_param);
 }
 
+//Looks through the cache and BLK layers for the layer a PHY request is really made for.
+thinfat_event_class_t thinfat_core_classify(void *instance, thinfat_core_event_t event)
+{
+  if (event < THINFAT_CORE_EVENT_MAX)
+    return THINFAT_CLASS_CORE;
+  else if (event < THINFAT_CACHE_EVENT_MAX)
+    return thinfat_core_classify(((thinfat_cache_t *)instance)->client, ((thinfat_cache_t *)instance)->event);
+  else if (event < THINFAT_BLK_EVENT_MAX)
+    return thinfat_core_classify(((thinfat_blk_t *)instance)->client, ((thinfat_blk_t *)instance)->event);
+  else if (event < THINFAT_TABLE_EVENT_MAX)
+    return THINFAT_CLASS_TABLE;
+  else if (event < THINFAT_FILE_EVENT_MAX)
+    return THINFAT_CLASS_FILE;
+  else if (event < THINFAT_DIR_EVENT_MAX)
+    return THINFAT_CLASS_DIR;
+  else if (event < THINFAT_EVENT_MAX)
+    return THINFAT_CLASS_CORE;
+  return THINFAT_CLASS_USER;
+}
+
 static thinfat_type_t thinfat_determine_type(const thinfat_t *tf)
 {
   thinfat_cluster_t cluster_count = (tf->sc_volume_size - tf->si_data) >> tf->ctos_shift;
@@ -70,6 +104,27 @@ static thinfat_type_t thinfat_determine_type(const thinfat_t *tf)
   return THINFAT_TYPE_FAT32;
 }
 
+static void thinfat_set_sector_size(thinfat_t *tf, thinfat_size_t sz_sector)
+{
+  tf->sz_sector = sz_sector;
+  for (tf->stob_shift = 0; ((thinfat_size_t)1 << tf->stob_shift) < sz_sector; tf->stob_shift++);
+}
+
+//Switches the PHY and every sector-sized buffer over to the volume's own sector size.
+static thinfat_result_t thinfat_resize(thinfat_t *tf, thinfat_size_t sz_sector)
+{
+  thinfat_result_t result;
+  if ((result = thinfat_phy_set_sector_size(tf->phy, sz_sector)) != THINFAT_RESULT_OK)
+  {
+    THINFAT_ERROR("PHY refused a sector size of %u bytes.\n", (unsigned int)sz_sector);
+    return result;
+  }
+  thinfat_set_sector_size(tf, sz_sector);
+  if ((result = thinfat_cache_pool_resize(tf->cache_pool)) != THINFAT_RESULT_OK)
+    return result;
+  return thinfat_file_resize(tf->cur_file);
+}
+
 static thinfat_result_t thinfat_read_parameter_block_callback(thinfat_t *tf, void *bpb)
 {
   uint16_t signature = thinfat_read_u16(bpb, 510);
@@ -80,11 +135,24 @@ static thinfat_result_t thinfat_read_parameter_block_callback(thinfat_t *tf, voi
   }
 
   uint16_t BPB_BytsPerSec = thinfat_read_u16(bpb, 11);
-  if (BPB_BytsPerSec != THINFAT_SECTOR_SIZE)
+  if (BPB_BytsPerSec < 512 || BPB_BytsPerSec > THINFAT_CONFIG_MAX_SECTOR_SIZE || (BPB_BytsPerSec & (BPB_BytsPerSec - 1)) != 0)
   {
-    THINFAT_ERROR("Illegal sector size: %u(read) != %u(configured).\n", BPB_BytsPerSec, THINFAT_SECTOR_SIZE);
+    THINFAT_ERROR("Illegal sector size: %u(read), up to %u supported.\n", BPB_BytsPerSec, THINFAT_CONFIG_MAX_SECTOR_SIZE);
     return THINFAT_RESULT_ERROR_BPB;
   }
+  THINFAT_INFO("Bytes per sector: %u\n", BPB_BytsPerSec);
+
+  //The volume was located in units of the sector size we were running with
+  if (BPB_BytsPerSec != tf->sz_sector)
+  {
+    uint64_t so_hidden = (uint64_t)thinfat_stob(tf, tf->si_hidden);
+    if (so_hidden % BPB_BytsPerSec != 0)
+    {
+      THINFAT_ERROR("Partition offset is not aligned to %u bytes.\n", BPB_BytsPerSec);
+      return THINFAT_RESULT_ERROR_BPB;
+    }
+    tf->si_hidden = (thinfat_sector_t)(so_hidden / BPB_BytsPerSec);
+  }
 
   uint8_t BPB_SecPerClus = thinfat_read_u8(bpb, 13);
   for (tf->ctos_shift = 0; !(BPB_SecPerClus & 1); BPB_SecPerClus >>= 1)
@@ -124,7 +192,7 @@ static thinfat_result_t thinfat_read_parameter_block_callback(thinfat_t *tf, voi
     THINFAT_INFO("FAT size(32bit): %u sectors\n", tf->sc_table_size);
   }
 
-  tf->si_data = tf->si_hidden + tf->sc_reserved + tf->sc_table_size * tf->table_redundancy + (tf->root_entry_count * 32 + THINFAT_SECTOR_SIZE - 1) / THINFAT_SECTOR_SIZE;
+  tf->si_data = tf->si_hidden + tf->sc_reserved + tf->sc_table_size * tf->table_redundancy + (tf->root_entry_count * 32 + BPB_BytsPerSec - 1) / BPB_BytsPerSec;
 
   tf->type = thinfat_determine_type(tf);
 
@@ -136,20 +204,30 @@ static thinfat_result_t thinfat_read_parameter_block_callback(thinfat_t *tf, voi
 
   tf->si_root = tf->si_hidden + tf->sc_reserved + tf->sc_table_size * tf->table_redundancy;
 
+  tf->si_fsinfo = tf->type == THINFAT_TYPE_FAT32 ? tf->si_hidden + thinfat_read_u16(bpb, 48) : THINFAT_INVALID_SECTOR;
+  tf->fsinfo_dirty = 0;
+
+  //`bpb` lives in the table cache, so nothing may be read from it past this point
+  if (BPB_BytsPerSec != tf->sz_sector)
+  {
+    thinfat_result_t result = thinfat_resize(tf, BPB_BytsPerSec);
+    if (result != THINFAT_RESULT_OK)
+      return result;
+  }
+
   thinfat_dir_open(tf->cur_dir, tf->ci_root);
 
   if (tf->type == THINFAT_TYPE_FAT16)
   {
+    //FAT16 has nowhere to keep either, so the hint lives in memory only
     tf->ci_next_free = 2;
-    tf->cc_free = 0;
+    tf->cc_free = THINFAT_UNKNOWN_FREE_COUNT;
 
-    return thinfat_core_callback(tf, tf->event, tf->si_hidden, NULL);
+    return thinfat_table_scan(tf, tf->table, THINFAT_CORE_EVENT_SCAN_TABLE);
   }
   else
   {
-    thinfat_sector_t si_fsinfo = tf->si_hidden + thinfat_read_u16(bpb, 48);
-
-    return thinfat_cached_read_single(tf, tf->table_cache, si_fsinfo, THINFAT_CORE_EVENT_READ_FSINFO);
+    return thinfat_cached_read_single(tf, tf->table_cache, tf->si_fsinfo, THINFAT_CORE_EVENT_READ_FSINFO);
   }
 }
 
@@ -169,8 +247,11 @@ static thinfat_result_t thinfat_read_fsinfo_callback(thinfat_t *tf, void *fsi)
 
   tf->cc_free = thinfat_read_u32(fsi, 488);
   tf->ci_next_free = thinfat_read_u32(fsi, 492);
-    
-  return thinfat_core_callback(tf, tf->event, tf->si_hidden, NULL);
+  if (tf->cc_free != THINFAT_UNKNOWN_FREE_COUNT && tf->cc_free > ((tf->si_hidden + tf->sc_volume_size - tf->si_data) >> tf->ctos_shift))
+    tf->cc_free = THINFAT_UNKNOWN_FREE_COUNT;
+
+  //With the free-cluster bitmap, the scan replaces the FSInfo count with an exact one
+  return thinfat_table_scan(tf, tf->table, THINFAT_CORE_EVENT_SCAN_TABLE);
 }
 
 static thinfat_result_t thinfat_read_mbr_callback(thinfat_t *tf, void *mbr)
@@ -217,22 +298,162 @@ thinfat_result_t thinfat_mount(thinfat_t *tf, thinfat_sector_t sector, thinfat_e
   return thinfat_cached_read_single(tf, tf->table_cache, sector, THINFAT_CORE_EVENT_READ_BPB);
 }
 
+//Everything still cached goes to the device, and the FAT mirrors are made whole, before the callback.
+static thinfat_result_t thinfat_write_fsinfo_callback(thinfat_t *tf, void *fsi)
+{
+  thinfat_write_u32(fsi, 488, tf->cc_free);
+  thinfat_write_u32(fsi, 492, THINFAT_IS_CLUSTER_VALID(tf->ci_next_free) ? tf->ci_next_free : 0xFFFFFFFF);
+  thinfat_cache_touch(tf->table_cache);
+  tf->fsinfo_dirty = 0;
+  return thinfat_cache_sync(tf, tf->table_cache, THINFAT_CORE_EVENT_SYNCED);
+}
+
+//Puts the free count and hint into FSInfo if they have moved, then writes back everything.
+static thinfat_result_t thinfat_sync_table(thinfat_t *tf)
+{
+  if (tf->fsinfo_dirty && THINFAT_IS_SECTOR_VALID(tf->si_fsinfo))
+    return thinfat_cached_read_single(tf, tf->table_cache, tf->si_fsinfo, THINFAT_CORE_EVENT_WRITE_FSINFO);
+  return thinfat_cache_sync(tf, tf->table_cache, THINFAT_CORE_EVENT_SYNCED);
+}
+
+/*
+ * Calls back with sync_event, after taking the volume down if that is an
+ * unmount. A sync that wrote out the current file's pending data passes on
+ * what the flush reported, the clusters it added and a pointer to the head
+ * of the chain, for the caller to record in the directory entry; otherwise
+ * the callback gets THINFAT_INVALID_SECTOR and NULL.
+ */
+static thinfat_result_t thinfat_sync_done(thinfat_t *tf)
+{
+  thinfat_core_event_t event = tf->sync_event;
+  thinfat_sector_t s_param = tf->sync_flushed ? tf->cur_file->cc_flushed : THINFAT_INVALID_SECTOR;
+  void *p_param = tf->sync_flushed ? &tf->cur_file->blk.ci_head : NULL;
+  if (event == THINFAT_CORE_EVENT_UNMOUNT)
+  {
+    thinfat_cache_pool_unmount(tf->cache_pool);
+    thinfat_table_release(tf->table);
+    event = tf->event;
+  }
+  return thinfat_core_callback(tf, event, s_param, p_param);
+}
+
+/*
+ * A flush of the pending data that failed stops the sync there, and an
+ * unmount with it: the volume stays mounted, and the data pending, until it
+ * is flushed or discarded. The callback gets NULL, with why for s_param.
+ */
+static thinfat_result_t thinfat_sync_failed(thinfat_t *tf, thinfat_result_t result)
+{
+  thinfat_core_event_t event = tf->sync_event == THINFAT_CORE_EVENT_UNMOUNT ? tf->event : tf->sync_event;
+  return thinfat_core_callback(tf, event, result, NULL);
+}
+
+/*
+ * The current file's pending data goes first, as it changes the FAT and the
+ * free count. A file that has no clusters yet would get its head from the
+ * flush, with no directory entry pointing to it, so that has to be flushed
+ * by the caller first: the sync fails with THINFAT_RESULT_FILE_PENDING.
+ */
+static thinfat_result_t thinfat_sync_volume(thinfat_t *tf, thinfat_core_event_t sync_event)
+{
+  const thinfat_blk_t *blk = &tf->cur_file->blk;
+  tf->sync_event = sync_event;
+  tf->sync_flushed = tf->cur_file->sz_pending > 0;
+  if (!tf->sync_flushed)
+    return thinfat_sync_table(tf);
+  else if (blk->ci_head < 2 || !THINFAT_IS_CLUSTER_VALID(blk->ci_head))
+    return THINFAT_RESULT_FILE_PENDING;
+  return thinfat_file_flush(tf, tf->cur_file, THINFAT_CORE_EVENT_FLUSH_FILE);
+}
+
 thinfat_result_t thinfat_unmount(thinfat_t *tf, thinfat_event_t event)
 {
   tf->event = event;
-  return THINFAT_RESULT_OK;
+  return thinfat_sync_volume(tf, THINFAT_CORE_EVENT_UNMOUNT);
+}
+
+thinfat_result_t thinfat_sync(thinfat_t *tf, thinfat_event_t event)
+{
+  return thinfat_sync_volume(tf, event);
+}
+
+void thinfat_set_mirror_policy(thinfat_t *tf, thinfat_mirror_policy_t policy)
+{
+  tf->cache_pool->mirror_policy = policy;
+}
+
+//Applies from the next allocation on; only matters with the free-cluster bitmap.
+void thinfat_set_alloc_policy(thinfat_t *tf, thinfat_alloc_policy_t policy)
+{
+  tf->table->alloc_policy = policy;
+}
+
+//How long dirty cache lines may wait for the PHY worker to write them back; 0 turns either trigger off.
+void thinfat_set_flush_policy(thinfat_t *tf, uint32_t ms_expire, uint32_t ms_idle)
+{
+  thinfat_phy_lock(tf->phy);
+  tf->cache_pool->ms_expire = ms_expire;
+  tf->cache_pool->ms_idle = ms_idle;
+  //Runs the next tick as soon as the worker looks
+  tf->phy->ms_tick = tf->cache_pool->ms_now;
+  thinfat_phy_unlock(tf->phy);
+}
+
+//Free clusters on the mounted volume: exact with the free-cluster bitmap, otherwise what FSInfo says, or THINFAT_UNKNOWN_FREE_COUNT
+thinfat_cluster_t thinfat_get_free_clusters(thinfat_t *tf)
+{
+  thinfat_phy_lock(tf->phy);
+  thinfat_cluster_t cc_free = tf->cc_free;
+  thinfat_phy_unlock(tf->phy);
+  return cc_free;
+}
+
+/*
+ * Sets how many slices of the FAT the next mount scans side by side, up to
+ * THINFAT_CONFIG_TABLE_SCAN_STREAMS. 0 skips the scan: the free count is then
+ * whatever FSInfo says, and allocation searches the FAT itself.
+ */
+void thinfat_set_scan_streams(thinfat_t *tf, unsigned int nc_streams)
+{
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  thinfat_phy_lock(tf->phy);
+  tf->table->nc_scan_streams = nc_streams < THINFAT_CONFIG_TABLE_SCAN_STREAMS ? nc_streams : THINFAT_CONFIG_TABLE_SCAN_STREAMS;
+  thinfat_phy_unlock(tf->phy);
+#else
+  (void)tf;
+  (void)nc_streams;
+#endif
+}
+
+//Bytes of memory the free-cluster bitmap of the mounted volume takes
+size_t thinfat_get_free_map_size(thinfat_t *tf)
+{
+  thinfat_phy_lock(tf->phy);
+  size_t sz_map = thinfat_table_map_size(tf->table);
+  thinfat_phy_unlock(tf->phy);
+  return sz_map;
 }
 
 thinfat_result_t thinfat_initialize(thinfat_t *tf, struct thinfat_phy_tag *phy)
+{
+  return thinfat_initialize_budget(tf, phy, &thinfat_default_cache_budget);
+}
+
+thinfat_result_t thinfat_initialize_budget(thinfat_t *tf, struct thinfat_phy_tag *phy, const thinfat_cache_budget_t *budget)
 {
   tf->phy = phy;
+  //Until a BPB says otherwise, sectors are whatever size the PHY was opened with
+  thinfat_set_sector_size(tf, phy->sz_sector);
 
+  tf->cache_pool = (thinfat_cache_pool_t *)malloc(sizeof(thinfat_cache_pool_t));
+  if (thinfat_cache_pool_init(tf->cache_pool, tf, budget) != THINFAT_RESULT_OK)
+    return THINFAT_RESULT_UNSUPPORTED;
   tf->table_cache = (thinfat_cache_t *)malloc(sizeof(thinfat_cache_t));
-  thinfat_cache_init(tf->table_cache, tf);
+  thinfat_cache_init(tf->table_cache, tf->cache_pool, THINFAT_CACHE_CLASS_TABLE);
   tf->dir_cache = (thinfat_cache_t *)malloc(sizeof(thinfat_cache_t));
-  thinfat_cache_init(tf->dir_cache, tf);
+  thinfat_cache_init(tf->dir_cache, tf->cache_pool, THINFAT_CACHE_CLASS_DIR);
   tf->file_cache = (thinfat_cache_t *)malloc(sizeof(thinfat_cache_t));
-  thinfat_cache_init(tf->file_cache, tf);
+  thinfat_cache_init(tf->file_cache, tf->cache_pool, THINFAT_CACHE_CLASS_FILE);
 
   tf->table = (thinfat_table_t *)malloc(sizeof(thinfat_table_t));
   thinfat_table_init(tf->table, tf, tf->table_cache);
@@ -241,13 +462,20 @@ thinfat_result_t thinfat_initialize(thinfat_t *tf, struct thinfat_phy_tag *phy)
   thinfat_dir_init(tf->cur_dir, tf, tf->dir_cache);
 
   tf->cur_file = (thinfat_file_t *)malloc(sizeof(thinfat_file_t));
-  thinfat_file_init(tf->cur_file, tf, tf->file_cache);
+  if (thinfat_file_init(tf->cur_file, tf, tf->file_cache) != THINFAT_RESULT_OK)
+    return THINFAT_RESULT_UNSUPPORTED;
 
+  thinfat_phy_set_tick(phy, thinfat_cache_pool_tick, tf->cache_pool);
   return THINFAT_RESULT_OK;
 }
 
 thinfat_result_t thinfat_finalize(thinfat_t *tf)
 {
+  thinfat_phy_set_tick(tf->phy, NULL, NULL);
+  thinfat_file_finalize(tf->cur_file);
+  thinfat_cache_pool_finalize(tf->cache_pool);
+  thinfat_table_release(tf->table);
+
   free(tf->table);
   free(tf->cur_dir);
   free(tf->cur_file);
@@ -255,6 +483,7 @@ thinfat_result_t thinfat_finalize(thinfat_t *tf)
   free(tf->table_cache);
   free(tf->dir_cache);
   free(tf->file_cache);
+  free(tf->cache_pool);
 
   return THINFAT_RESULT_OK;
 }
@@ -274,6 +503,16 @@ thinfat_result_t thinfat_open_file(thinfat_t *tf, const thinfat_dir_entry_t *ent
   return thinfat_file_open(tf->cur_file, entry);
 }
 
+thinfat_result_t thinfat_preallocate_file(thinfat_t *tf, size_t size, thinfat_event_t event)
+{
+  return thinfat_file_preallocate(tf, tf->cur_file, size, event);
+}
+
+thinfat_result_t thinfat_seek_file(thinfat_t *tf, thinfat_off_t position)
+{
+  return thinfat_file_seek(tf->cur_file, position);
+}
+
 thinfat_result_t thinfat_read_file(thinfat_t *tf, void *buf, size_t size, thinfat_event_t event)
 {
   return thinfat_file_read(tf, tf->cur_file, buf, size, event);
@@ -283,3 +522,24 @@ thinfat_result_t thinfat_write_file(thinfat_t *tf, const void *buf, size_t size,
 {
   return thinfat_file_write(tf, tf->cur_file, buf, size, event);
 }
+
+/*
+ * Holds up to sz_buffer bytes written to the current file back from the
+ * allocator until it is flushed, read, synced or unmounted, so that its
+ * clusters are picked once its size is known; 0 turns it off.
+ */
+thinfat_result_t thinfat_set_delayed_allocation(thinfat_t *tf, size_t sz_buffer)
+{
+  return thinfat_file_set_delayed(tf->cur_file, sz_buffer);
+}
+
+thinfat_result_t thinfat_flush_file(thinfat_t *tf, thinfat_event_t event)
+{
+  return thinfat_file_flush(tf, tf->cur_file, event);
+}
+
+//Throws away what a flush could not find room for, instead of retrying it.
+thinfat_result_t thinfat_discard_file(thinfat_t *tf)
+{
+  return thinfat_file_discard(tf->cur_file);
+}
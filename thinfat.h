@@ -29,6 +29,7 @@ struct thinfat_table_tag;
 struct thinfat_dir_tag;
 struct thinfat_file_tag;
 struct thinfat_cache_tag;
+struct thinfat_cache_pool_tag;
 
 typedef enum
 {
@@ -38,6 +39,51 @@ typedef enum
 }
 thinfat_type_t;
 
+//Callers sharing the sector cache, each under its own quota
+typedef enum
+{
+  THINFAT_CACHE_CLASS_TABLE = 0,
+  THINFAT_CACHE_CLASS_DIR,
+  THINFAT_CACHE_CLASS_FILE,
+  THINFAT_CACHE_CLASS_MAX
+}
+thinfat_cache_class_t;
+
+/*
+ * Memory given to the sector cache: nc_lines sectors in all, of which each
+ * class is guaranteed nc_min[] and may hold at most nc_max[]. Every class
+ * needs at least one line, and the guarantees must fit in the total.
+ */
+typedef struct thinfat_cache_budget_tag
+{
+  unsigned int nc_lines;
+  unsigned int nc_min[THINFAT_CACHE_CLASS_MAX];
+  unsigned int nc_max[THINFAT_CACHE_CLASS_MAX];
+}
+thinfat_cache_budget_t;
+
+extern const thinfat_cache_budget_t thinfat_default_cache_budget;
+
+//When the second and later copies of the FAT are written
+typedef enum
+{
+  //Along with the first copy, whenever a FAT sector leaves the cache
+  THINFAT_MIRROR_IMMEDIATE = 0,
+  //Only at thinfat_sync() and thinfat_unmount(), for the sectors changed since
+  THINFAT_MIRROR_DEFERRED
+}
+thinfat_mirror_policy_t;
+
+//Where an allocation takes its clusters from, with the free-cluster bitmap; without it allocation is always next-fit
+typedef enum
+{
+  //The first run long enough from ci_next_free on, so that successive chains follow each other
+  THINFAT_ALLOC_NEXT_FIT = 0,
+  //The shortest free extent long enough, leaving the long ones for the files that need them
+  THINFAT_ALLOC_BEST_FIT
+}
+thinfat_alloc_policy_t;
+
 typedef struct thinfat_tag
 {
   thinfat_type_t type;
@@ -46,8 +92,11 @@ typedef struct thinfat_tag
   struct thinfat_dir_tag *cur_dir;
   struct thinfat_file_tag *cur_file;
   struct thinfat_table_tag *table;
+  struct thinfat_cache_pool_tag *cache_pool;
   struct thinfat_cache_tag *table_cache, *dir_cache, *file_cache;
   uint8_t ctos_shift;
+  uint8_t stob_shift;
+  thinfat_size_t sz_sector;
   uint8_t table_redundancy;
   thinfat_sector_t sc_reserved;
   uint16_t root_entry_count;
@@ -57,8 +106,14 @@ typedef struct thinfat_tag
   thinfat_sector_t si_data;
   thinfat_sector_t si_hidden;
   thinfat_sector_t si_root;
+  thinfat_sector_t si_fsinfo;
+  //Free clusters, THINFAT_UNKNOWN_FREE_COUNT if nobody knows, and where to look for one first
   thinfat_cluster_t cc_free, ci_next_free;
-  thinfat_event_t event;
+  //Both have changed since FSInfo was last written
+  uint8_t fsinfo_dirty;
+  //The sync in progress has written out the current file's pending data
+  uint8_t sync_flushed;
+  thinfat_event_t event, sync_event;
 }
 thinfat_t;
 
@@ -110,6 +165,24 @@ static inline void thinfat_write_u32(void *p, size_t offset, uint32_t value)
   ((uint8_t *)p)[offset + 3] = (value >> 24) & 0xFF;
 }
 
+//Bytes in sc sectors
+static inline thinfat_size_t thinfat_stob(const thinfat_t *tf, thinfat_sector_t sc)
+{
+  return (thinfat_size_t)sc << tf->stob_shift;
+}
+
+//Sector holding byte `position`
+static inline thinfat_sector_t thinfat_btos(const thinfat_t *tf, thinfat_size_t position)
+{
+  return position >> tf->stob_shift;
+}
+
+//Offset of byte `position` within its sector
+static inline thinfat_size_t thinfat_sector_offset(const thinfat_t *tf, thinfat_size_t position)
+{
+  return position & (tf->sz_sector - 1);
+}
+
 static inline thinfat_cluster_t thinfat_stoc(thinfat_t *tf, thinfat_sector_t si)
 {
   return ((si - tf->si_data) >> tf->ctos_shift) + 2;
@@ -140,16 +213,29 @@ thinfat_lfn_entry_t;
 thinfat_result_t thinfat_core_callback(void *instance, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param);
 
 thinfat_result_t thinfat_initialize(thinfat_t *tf, struct thinfat_phy_tag *phy);
+thinfat_result_t thinfat_initialize_budget(thinfat_t *tf, struct thinfat_phy_tag *phy, const thinfat_cache_budget_t *budget);
 thinfat_result_t thinfat_finalize(thinfat_t *tf);
 
 thinfat_result_t thinfat_find_partition(thinfat_t *tf, thinfat_event_t event);
 thinfat_result_t thinfat_mount(thinfat_t *tf, thinfat_sector_t sector, thinfat_event_t event);
 thinfat_result_t thinfat_unmount(thinfat_t *tf, thinfat_event_t event);
+thinfat_result_t thinfat_sync(thinfat_t *tf, thinfat_event_t event);
+void thinfat_set_mirror_policy(thinfat_t *tf, thinfat_mirror_policy_t policy);
+void thinfat_set_alloc_policy(thinfat_t *tf, thinfat_alloc_policy_t policy);
+void thinfat_set_flush_policy(thinfat_t *tf, uint32_t ms_expire, uint32_t ms_idle);
+thinfat_cluster_t thinfat_get_free_clusters(thinfat_t *tf);
+size_t thinfat_get_free_map_size(thinfat_t *tf);
+void thinfat_set_scan_streams(thinfat_t *tf, unsigned int nc_streams);
 
 thinfat_result_t thinfat_dump_current_directory(thinfat_t *tf, thinfat_event_t event);
 thinfat_result_t thinfat_open_file(thinfat_t *tf, const thinfat_dir_entry_t *entry);
 thinfat_result_t thinfat_find_file_by_longname(thinfat_t *tf, const wchar_t *name, thinfat_event_t event);
+thinfat_result_t thinfat_preallocate_file(thinfat_t *tf, size_t size, thinfat_event_t event);
+thinfat_result_t thinfat_seek_file(thinfat_t *tf, thinfat_off_t position);
 thinfat_result_t thinfat_read_file(thinfat_t *tf, void *buf, size_t size, thinfat_event_t event);
 thinfat_result_t thinfat_write_file(thinfat_t *tf, const void *buf, size_t size, thinfat_event_t event);
+thinfat_result_t thinfat_set_delayed_allocation(thinfat_t *tf, size_t sz_buffer);
+thinfat_result_t thinfat_flush_file(thinfat_t *tf, thinfat_event_t event);
+thinfat_result_t thinfat_discard_file(thinfat_t *tf);
 
 #endif
@@ -13,6 +13,282 @@
 #include <stdlib.h>
 #include <string.h>
 
+//Cuts the next sc_run sectors off the client's segment list.
+static unsigned int thinfat_blk_slice(thinfat_blk_t *blk, thinfat_segment_t *run, thinfat_sector_t sc_run)
+{
+  unsigned int nc_run = 0;
+  blk->sc_done += sc_run;
+  while (sc_run > 0)
+  {
+    thinfat_segment_t *segment = &blk->segments[blk->ni_segment];
+    thinfat_sector_t sc_slice = segment->sc_data - blk->so_segment;
+    if (sc_slice > sc_run)
+      sc_slice = sc_run;
+    run[nc_run].data = (uint8_t *)segment->data + thinfat_stob((thinfat_t *)blk->parent, blk->so_segment);
+    run[nc_run].sc_data = sc_slice;
+    nc_run++;
+    sc_run -= sc_slice;
+    if ((blk->so_segment += sc_slice) == segment->sc_data)
+    {
+      blk->ni_segment++;
+      blk->so_segment = 0;
+    }
+  }
+  return nc_run;
+}
+
+/*
+ * Records cc clusters from ci on as clusters co_cluster on of the chain, if
+ * they start right past the mapped part. A full map forgets its older half,
+ * since the chain is only ever walked forward.
+ */
+static void thinfat_blk_map(thinfat_blk_t *blk, thinfat_cluster_t co_cluster, thinfat_cluster_t ci, thinfat_cluster_t cc)
+{
+  thinfat_extent_t *last = blk->nc_extents > 0 ? &blk->extents[blk->nc_extents - 1] : NULL;
+  if (co_cluster != blk->cc_mapped || ci < 2 || !THINFAT_IS_CLUSTER_VALID(ci))
+    return;
+  if (last != NULL && last->ci_start + last->cc_length == ci)
+    last->cc_length += cc;
+  else
+  {
+    if (blk->nc_extents == THINFAT_CONFIG_BLK_EXTENTS)
+    {
+      blk->nc_extents -= THINFAT_CONFIG_BLK_EXTENTS / 2;
+      memmove(blk->extents, blk->extents + THINFAT_CONFIG_BLK_EXTENTS / 2, sizeof(thinfat_extent_t) * blk->nc_extents);
+    }
+    last = &blk->extents[blk->nc_extents++];
+    last->co_start = co_cluster;
+    last->ci_start = ci;
+    last->cc_length = cc;
+  }
+  blk->cc_mapped += cc;
+}
+
+//The extent holding cluster co_cluster of the chain, or NULL outside the mapped part
+static const thinfat_extent_t *thinfat_blk_find_extent(const thinfat_blk_t *blk, thinfat_cluster_t co_cluster)
+{
+  unsigned int lo = 0, hi = blk->nc_extents;
+  if (co_cluster >= blk->cc_mapped || co_cluster < blk->extents[0].co_start)
+    return NULL;
+  while (hi - lo > 1)
+  {
+    unsigned int mid = (lo + hi) / 2;
+    if (blk->extents[mid].co_start <= co_cluster)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &blk->extents[lo];
+}
+
+//Cluster co_cluster of the chain, or THINFAT_INVALID_CLUSTER outside the mapped part
+static thinfat_cluster_t thinfat_blk_mapped(const thinfat_blk_t *blk, thinfat_cluster_t co_cluster)
+{
+  const thinfat_extent_t *extent = thinfat_blk_find_extent(blk, co_cluster);
+  return extent != NULL ? extent->ci_start + (co_cluster - extent->co_start) : THINFAT_INVALID_CLUSTER;
+}
+
+/*
+ * Plans the next transfer from sector so_current, in cluster ci_current: on
+ * to the end of the contiguous run the extent map knows of, within
+ * THINFAT_CONFIG_BLK_MAX_TRANSFER and the sc_left sectors still wanted.
+ * Leaves so_current and ci_current on the last sector of it.
+ */
+static thinfat_sector_t thinfat_blk_span(thinfat_blk_t *blk, thinfat_sector_t sc_left, thinfat_sector_t *si_xfer)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  thinfat_cluster_t co_cluster = blk->so_current >> tf->ctos_shift, cc_run = 1;
+  thinfat_cluster_t cc_max = THINFAT_CONFIG_BLK_MAX_TRANSFER >> (tf->ctos_shift + tf->stob_shift);
+  const thinfat_extent_t *extent = thinfat_blk_find_extent(blk, co_cluster);
+  thinfat_sector_t so_cluster = blk->so_current & ((1 << tf->ctos_shift) - 1), sc_xfer, so_last;
+
+  if (extent != NULL && extent->ci_start + (co_cluster - extent->co_start) == blk->ci_current)
+    cc_run = extent->co_start + extent->cc_length - co_cluster;
+  if (cc_run > cc_max)
+    cc_run = cc_max > 0 ? cc_max : 1;
+  sc_xfer = (cc_run << tf->ctos_shift) - so_cluster;
+  if (sc_xfer > sc_left)
+    sc_xfer = sc_left;
+
+  *si_xfer = thinfat_ctos(tf, blk->ci_current) + so_cluster;
+  so_last = blk->so_current + sc_xfer - 1;
+  blk->ci_current += (so_last >> tf->ctos_shift) - co_cluster;
+  blk->so_current = so_last;
+  return sc_xfer;
+}
+
+/*
+ * Finds the cluster holding sector so_seek of the chain and calls back with
+ * it, like thinfat_table_lookup(). Clusters already walked come from the
+ * extent map. Past its end, the FAT is walked from the last mapped cluster
+ * on to the end of the transfer in progress, and every cluster passed is
+ * mapped, so that a transfer costs a FAT read per FAT sector of its chain.
+ */
+static thinfat_result_t thinfat_blk_lookup(thinfat_blk_t *blk, thinfat_sector_t so_seek, thinfat_core_event_t event)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  thinfat_cluster_t ci = thinfat_blk_mapped(blk, so_seek >> tf->ctos_shift);
+  thinfat_sector_t so_end = so_seek;
+  if (THINFAT_IS_CLUSTER_VALID(ci))
+  {
+    blk->stats.nc_mapped++;
+    return thinfat_core_callback(blk, event, so_seek, &ci);
+  }
+  //A cluster the map has let go of is walked to from the current one instead
+  if (blk->cc_mapped > 0 && blk->so_current >> tf->ctos_shift < blk->cc_mapped - 1 && so_seek >> tf->ctos_shift >= blk->cc_mapped)
+  {
+    const thinfat_extent_t *last = &blk->extents[blk->nc_extents - 1];
+    blk->ci_current = last->ci_start + last->cc_length - 1;
+    blk->so_current = (blk->cc_mapped - 1) << tf->ctos_shift;
+  }
+  //The FAT16 root directory has no chain to walk
+  if (blk->ci_current >= 2)
+  {
+    blk->stats.nc_walked++;
+    so_end += blk->sc_read > 1 ? blk->sc_read - 1 : 0;
+  }
+  blk->lookup_event = event;
+  blk->so_lookup = so_seek;
+  blk->ci_lookup = THINFAT_INVALID_CLUSTER;
+  //The walk reports the clusters it moves to, never the one it starts from, where a rewind may have left the seek
+  if (blk->ci_current >= 2 && so_seek >> tf->ctos_shift == blk->so_current >> tf->ctos_shift)
+    blk->ci_lookup = blk->ci_current;
+  return thinfat_table_walk(blk, tf->table, blk->ci_current, blk->so_current, so_end, THINFAT_BLK_EVENT_EXTENT_LINK, THINFAT_BLK_EVENT_EXTENT_LOOKUP);
+}
+
+//Clusters the next allocation asks for: a chunk, or what the chain still lacks if that is less
+static inline thinfat_cluster_t thinfat_blk_extend_chunk(const thinfat_blk_t *blk)
+{
+  thinfat_cluster_t cc_lack = blk->cc_extend - blk->cc_chain;
+  return blk->cc_chunk < cc_lack ? blk->cc_chunk : cc_lack;
+}
+
+//Takes what the chain lacks from the allocator, a chunk at a time
+static thinfat_result_t thinfat_blk_extend_allocate(thinfat_blk_t *blk)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  return thinfat_table_allocate(blk, tf->table, thinfat_blk_extend_chunk(blk), THINFAT_BLK_EVENT_EXTEND_ALLOCATED);
+}
+
+//Starts the allocation once the walk has found the end of the chain, all of it in one chunk to begin with
+static thinfat_result_t thinfat_blk_extend_start(thinfat_blk_t *blk)
+{
+  const thinfat_extent_t *last = blk->nc_extents > 0 ? &blk->extents[blk->nc_extents - 1] : NULL;
+  blk->cc_base = blk->cc_chain;
+  blk->ci_base = blk->cc_chain > 0 && last != NULL ? last->ci_start + last->cc_length - 1 : THINFAT_INVALID_CLUSTER;
+  blk->ci_tail = blk->ci_base;
+  blk->cc_chunk = blk->cc_extend - blk->cc_chain;
+  return thinfat_blk_extend_allocate(blk);
+}
+
+/*
+ * Maps the runs the chunk was made of after the old end of the chain, and
+ * goes on with the next one. Only the last batch of a chunk made in several
+ * is known, and nothing past a chunk that was not all mapped, so the rest
+ * is left to be walked, as for a chain opened from its head.
+ */
+static thinfat_result_t thinfat_blk_extended(thinfat_blk_t *blk)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  const thinfat_table_extent_t *last = &tf->table->pieces[tf->table->nc_pieces - 1];
+  thinfat_cluster_t co_cluster = blk->cc_chain;
+  if (tf->table->nc_runs == tf->table->nc_pieces)
+    for (unsigned int i = 0; i < tf->table->nc_pieces; i++)
+    {
+      thinfat_blk_map(blk, co_cluster, tf->table->pieces[i].ci_start, tf->table->pieces[i].cc_length);
+      co_cluster += tf->table->pieces[i].cc_length;
+    }
+  else if (blk->cc_mapped == 0)
+    thinfat_blk_map(blk, 0, blk->ci_head, 1);
+  blk->cc_chain += thinfat_blk_extend_chunk(blk);
+  blk->ci_tail = last->ci_start + last->cc_length - 1;
+  if (blk->cc_chain < blk->cc_extend)
+    return thinfat_blk_extend_allocate(blk);
+  blk->stats.nc_extends++;
+  blk->stats.cc_extended += blk->cc_extend - blk->cc_base;
+  return thinfat_core_callback(blk->client, blk->event, blk->cc_extend - blk->cc_base, &blk->ci_head);
+}
+
+/*
+ * Whether the allocation came up short for want of free clusters, or of a
+ * way to reach those the free count says there are. Undoing the chunks
+ * already linked moves both sides alike, so either way gives the same answer.
+ */
+static thinfat_result_t thinfat_blk_extend_reason(const thinfat_blk_t *blk)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  if (tf->cc_free != THINFAT_UNKNOWN_FREE_COUNT && tf->cc_free >= blk->cc_extend - blk->cc_chain)
+    return THINFAT_RESULT_FRAGMENTED;
+  return THINFAT_RESULT_NO_SPACE;
+}
+
+/*
+ * Halves the chunk and tries again, unless the free count already says the
+ * chain cannot be made that long. Past a chunk of one cluster, the chunks
+ * linked so far are freed and the old end of the chain put back, so that a
+ * failed extension leaves the chain as it found it.
+ */
+static thinfat_result_t thinfat_blk_extend_failed(thinfat_blk_t *blk)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  if (blk->cc_chunk > 1 && thinfat_blk_extend_reason(blk) == THINFAT_RESULT_FRAGMENTED)
+  {
+    blk->cc_chunk /= 2;
+    return thinfat_blk_extend_allocate(blk);
+  }
+  if (blk->cc_chain == blk->cc_base)
+    return thinfat_core_callback(blk->client, blk->event, thinfat_blk_extend_reason(blk), NULL);
+  else if (blk->ci_base == THINFAT_INVALID_CLUSTER)
+    return thinfat_table_free_chain(blk, tf->table, blk->ci_head, THINFAT_BLK_EVENT_EXTEND_UNDONE);
+  else
+    return thinfat_table_truncate(blk, tf->table, blk->ci_base, THINFAT_BLK_EVENT_EXTEND_UNDONE);
+}
+
+//Forgets the clusters mapped past co_cluster, which the chain no longer has
+static void thinfat_blk_unmap(thinfat_blk_t *blk, thinfat_cluster_t co_cluster)
+{
+  while (blk->nc_extents > 0 && blk->extents[blk->nc_extents - 1].co_start >= co_cluster)
+    blk->nc_extents--;
+  if (blk->nc_extents > 0)
+  {
+    thinfat_extent_t *last = &blk->extents[blk->nc_extents - 1];
+    if (last->co_start + last->cc_length > co_cluster)
+      last->cc_length = co_cluster - last->co_start;
+    blk->cc_mapped = last->co_start + last->cc_length;
+  }
+  else
+  {
+    blk->cc_mapped = 0;
+    thinfat_blk_map(blk, 0, blk->ci_head, 1);
+  }
+}
+
+//The chain is back as it was before the extension
+static thinfat_result_t thinfat_blk_extend_undone(thinfat_blk_t *blk)
+{
+  blk->cc_chain = blk->cc_base;
+  if (blk->ci_base == THINFAT_INVALID_CLUSTER)
+    thinfat_blk_open(blk, 0);
+  else
+    thinfat_blk_unmap(blk, blk->cc_base);
+  return thinfat_core_callback(blk->client, blk->event, thinfat_blk_extend_reason(blk), NULL);
+}
+
+static thinfat_result_t thinfat_blk_set_segments(thinfat_blk_t *blk, const thinfat_segment_t *segments, unsigned int nc_segments)
+{
+  if (nc_segments > THINFAT_CONFIG_MAX_SEGMENTS)
+    return THINFAT_RESULT_UNSUPPORTED;
+  memcpy(blk->segments, segments, sizeof(thinfat_segment_t) * nc_segments);
+  blk->nc_segments = nc_segments;
+  blk->ni_segment = 0;
+  blk->so_segment = 0;
+  blk->sc_done = 0;
+  blk->sc_read = 0;
+  for (unsigned int i = 0; i < nc_segments; i++)
+    blk->sc_read += segments[i].sc_data;
+  return THINFAT_RESULT_OK;
+}
+
 thinfat_result_t thinfat_blk_callback(thinfat_blk_t *blk, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param)
 {
   thinfat_t *tf = (thinfat_t *)blk->parent;
@@ -41,7 +317,7 @@ thinfat_result_t thinfat_blk_callback(thinfat_blk_t *blk, thinfat_core_event_t e
     {
       if (--blk->sc_read > 0)
       {
-        return thinfat_table_lookup(blk, tf->table, blk->ci_current, blk->so_current, blk->so_current + 1, THINFAT_BLK_EVENT_READ_SINGLE_LOOKUP);
+        return thinfat_blk_lookup(blk, blk->so_current + 1, THINFAT_BLK_EVENT_READ_SINGLE_LOOKUP);
       }
       else
       {
@@ -55,7 +331,7 @@ thinfat_result_t thinfat_blk_callback(thinfat_blk_t *blk, thinfat_core_event_t e
     break;
   case THINFAT_BLK_EVENT_READ_CLUSTER_LOOKUP:
     if (!THINFAT_IS_CLUSTER_VALID(*(thinfat_cluster_t *)p_param))
-      return thinfat_core_callback(blk->client, blk->event, THINFAT_INVALID_SECTOR, NULL);
+      return thinfat_core_callback(blk->client, blk->event, blk->sc_done, NULL);
     else
     {
       blk->so_current = s_param;
@@ -63,80 +339,94 @@ thinfat_result_t thinfat_blk_callback(thinfat_blk_t *blk, thinfat_core_event_t e
 
       THINFAT_INFO("READ_CLUSTER_LOOKUP: " TFF_X32 ", " TFF_X32 "\n", blk->so_current, blk->ci_current);
 
-      thinfat_sector_t so_cluster = (blk->so_current & ((1 << tf->ctos_shift) - 1));
-      thinfat_sector_t si_read = thinfat_ctos(tf, blk->ci_current) + so_cluster;
-      thinfat_sector_t sc_read = (1 << tf->ctos_shift) - so_cluster;
-      if (sc_read > blk->sc_read)
-        sc_read = blk->sc_read;
+      thinfat_sector_t si_read;
+      thinfat_sector_t sc_read = thinfat_blk_span(blk, blk->sc_read, &si_read);
+      thinfat_segment_t segments[THINFAT_CONFIG_MAX_SEGMENTS];
       blk->sc_read -= sc_read;
-      return thinfat_phy_read_multiple(blk, tf->phy, si_read, sc_read, THINFAT_BLK_EVENT_READ_CLUSTER);
+      return thinfat_phy_read_vector(blk, tf->phy, si_read, segments, thinfat_blk_slice(blk, segments, sc_read), THINFAT_BLK_EVENT_READ_CLUSTER);
     }
     break;
   case THINFAT_BLK_EVENT_READ_CLUSTER:
-    if (p_param == NULL)
-    {
-      if (blk->sc_read > 0)
-        return thinfat_table_lookup(blk, tf->table, blk->ci_current, blk->so_current, ((blk->so_current >> tf->ctos_shift) + 1) << tf->ctos_shift, THINFAT_BLK_EVENT_READ_CLUSTER_LOOKUP);
-      else
-        return thinfat_core_callback(blk->client, blk->event, THINFAT_INVALID_SECTOR, NULL);
-    }
-    else if (*(void **)p_param == NULL)
-    {
-      if (blk->next_data != NULL)
-      {
-        *(void **)p_param = blk->next_data;
-        return THINFAT_RESULT_OK;
-      }
-      return thinfat_core_callback(blk->client, blk->event, s_param, p_param);
-    }
-    else
-    {
-      thinfat_result_t res = thinfat_core_callback(blk->client, blk->event, s_param, p_param);
-      blk->next_data = *(void **)p_param;
-      return res;
-    }
-    break;
+    if (blk->sc_read > 0)
+      return thinfat_blk_lookup(blk, ((blk->so_current >> tf->ctos_shift) + 1) << tf->ctos_shift, THINFAT_BLK_EVENT_READ_CLUSTER_LOOKUP);
+    return thinfat_core_callback(blk->client, blk->event, blk->sc_done, NULL);
   case THINFAT_BLK_EVENT_WRITE_CLUSTER_LOOKUP:
     if (!THINFAT_IS_CLUSTER_VALID(*(thinfat_cluster_t *)p_param))
-      return thinfat_core_callback(blk->client, blk->event, THINFAT_INVALID_SECTOR, NULL);
+      return thinfat_core_callback(blk->client, blk->event, blk->sc_done, NULL);
     else
     {
       blk->so_current = s_param;
       blk->ci_current = *(thinfat_cluster_t *)p_param;
 
-      thinfat_sector_t so_cluster = blk->so_current & ((1 << tf->ctos_shift) - 1);
-      thinfat_sector_t si_write = thinfat_ctos(tf, blk->ci_current) + so_cluster;
-      thinfat_sector_t sc_write = (1 << tf->ctos_shift) - so_cluster;
-      if (sc_write > blk->sc_write)
-        sc_write = blk->sc_write;
+      thinfat_sector_t si_write;
+      thinfat_sector_t sc_write = thinfat_blk_span(blk, blk->sc_write, &si_write);
+      thinfat_segment_t segments[THINFAT_CONFIG_MAX_SEGMENTS];
       blk->sc_write -= sc_write;
-      return thinfat_phy_write_multiple(blk, tf->phy, si_write, sc_write, THINFAT_BLK_EVENT_WRITE_CLUSTER);
+      //The device copy is about to supersede whatever the cache holds for these sectors
+      thinfat_cache_discard(blk->cache, si_write, sc_write);
+      return thinfat_phy_write_vector(blk, tf->phy, si_write, segments, thinfat_blk_slice(blk, segments, sc_write), THINFAT_BLK_EVENT_WRITE_CLUSTER);
     }
     break;
   case THINFAT_BLK_EVENT_WRITE_CLUSTER:
-    if (p_param == NULL)
+    if (blk->sc_write > 0)
+      return thinfat_blk_lookup(blk, ((blk->so_current >> tf->ctos_shift) + 1) << tf->ctos_shift, THINFAT_BLK_EVENT_WRITE_CLUSTER_LOOKUP);
+    return thinfat_core_callback(blk->client, blk->event, blk->sc_done, NULL);
+  case THINFAT_BLK_EVENT_EXTENT_LINK:
     {
-      if (blk->sc_write > 0)
-        return thinfat_table_lookup(blk, tf->table, blk->ci_current, blk->so_current, ((blk->so_current >> tf->ctos_shift) + 1) << tf->ctos_shift, THINFAT_BLK_EVENT_WRITE_CLUSTER_LOOKUP);
-      else
-        return thinfat_core_callback(blk->client, blk->event, s_param, p_param);
+      const thinfat_extent_t *last = &blk->extents[blk->nc_extents - 1];
+      //Walking on would only push out what was just mapped, so the lookup is answered here
+      if (THINFAT_IS_CLUSTER_VALID(blk->ci_lookup) && blk->nc_extents == THINFAT_CONFIG_BLK_EXTENTS && last->ci_start + last->cc_length != *(thinfat_cluster_t *)p_param)
+      {
+        blk->stats.nc_hops += tf->table->cc_hops;
+        blk->stats.nc_table_reads += tf->table->nc_sectors;
+        res = thinfat_core_callback(blk, blk->lookup_event, blk->so_lookup, &blk->ci_lookup);
+        return res == THINFAT_RESULT_OK ? THINFAT_RESULT_ABORT : res;
+      }
+      thinfat_blk_map(blk, s_param >> tf->ctos_shift, *(thinfat_cluster_t *)p_param, 1);
+      if (s_param >> tf->ctos_shift == blk->so_lookup >> tf->ctos_shift)
+        blk->ci_lookup = *(thinfat_cluster_t *)p_param;
     }
-    else if (*(void **)p_param == NULL)
+    return THINFAT_RESULT_OK;
+  case THINFAT_BLK_EVENT_EXTENT_LOOKUP:
     {
-      if (blk->next_data != NULL)
+      const thinfat_table_run_t *run = (const thinfat_table_run_t *)p_param;
+      blk->stats.nc_hops += run->cc_hops;
+      blk->stats.nc_table_reads += run->nc_sectors;
+      thinfat_blk_map(blk, s_param >> tf->ctos_shift, run->ci_next, run->cc_run);
+      if (s_param >> tf->ctos_shift == blk->so_lookup >> tf->ctos_shift)
+        blk->ci_lookup = run->ci_next;
+      return thinfat_core_callback(blk, blk->lookup_event, blk->so_lookup, &blk->ci_lookup);
+    }
+  case THINFAT_BLK_EVENT_EXTEND_LOOKUP:
+    {
+      const thinfat_table_run_t *run = (const thinfat_table_run_t *)p_param;
+      blk->stats.nc_hops += run->cc_hops;
+      blk->stats.nc_table_reads += run->nc_sectors;
+      //The chain ended short of the target, and every cluster of it is mapped
+      if (run->ci_next < 2 || !THINFAT_IS_CLUSTER_VALID(run->ci_next))
       {
-        *(void **)p_param = blk->next_data;
-        return THINFAT_RESULT_OK;
+        blk->cc_chain = blk->cc_mapped;
+        return thinfat_blk_extend_start(blk);
       }
-      return thinfat_core_callback(blk->client, blk->event, s_param, p_param);
+      thinfat_blk_map(blk, s_param >> tf->ctos_shift, run->ci_next, run->cc_run);
+      return thinfat_core_callback(blk->client, blk->event, 0, &blk->ci_head);
     }
-    else
+  case THINFAT_BLK_EVENT_EXTEND_ALLOCATED:
+    if (p_param == NULL)
+      return thinfat_blk_extend_failed(blk);
+    else if (blk->ci_tail == THINFAT_INVALID_CLUSTER)
     {
-      thinfat_result_t res = thinfat_core_callback(blk->client, blk->event, s_param, p_param);
-      blk->next_data = *(void **)p_param;
-      return res;
+      blk->ci_head = *(thinfat_cluster_t *)p_param;
+      blk->ci_current = blk->ci_head;
+      blk->so_current = 0;
+      return thinfat_blk_extended(blk);
     }
-    break;
+    else
+      return thinfat_table_concatenate(blk, tf->table, blk->ci_tail, *(thinfat_cluster_t *)p_param, THINFAT_BLK_EVENT_EXTEND_LINKED);
+  case THINFAT_BLK_EVENT_EXTEND_LINKED:
+    return thinfat_blk_extended(blk);
+  case THINFAT_BLK_EVENT_EXTEND_UNDONE:
+    return thinfat_blk_extend_undone(blk);
   }
   return THINFAT_RESULT_OK;
 }
@@ -145,6 +435,10 @@ thinfat_result_t thinfat_blk_init(thinfat_blk_t *blk, thinfat_t *parent, thinfat
 {
   blk->cache = cache;
   blk->parent = parent;
+  blk->nc_extents = 0;
+  blk->cc_mapped = 0;
+  blk->cc_chain = 0;
+  memset(&blk->stats, 0, sizeof(thinfat_blk_stats_t));
   return THINFAT_RESULT_OK;
 }
 
@@ -153,6 +447,10 @@ thinfat_result_t thinfat_blk_open(thinfat_blk_t *blk, thinfat_cluster_t ci)
   blk->ci_head = ci;
   blk->ci_current = ci;
   blk->so_current = 0;
+  blk->nc_extents = 0;
+  blk->cc_mapped = 0;
+  blk->cc_chain = 0;
+  thinfat_blk_map(blk, 0, ci, 1);
   return THINFAT_RESULT_OK;
 }
 
@@ -169,47 +467,72 @@ thinfat_result_t thinfat_blk_read_each_sector(void *client, thinfat_blk_t *blk,
     return thinfat_core_callback(blk->client, blk->event, THINFAT_INVALID_SECTOR, NULL);
   else
   {
-    thinfat_t *tf = (thinfat_t *)blk->parent;
     blk->event = event;
     blk->sc_read = sc_read;
     blk->client = client;
-    blk->next_data = NULL;
-    return thinfat_table_lookup(blk, tf->table, blk->ci_current, blk->so_current, so_read, THINFAT_BLK_EVENT_READ_SINGLE_LOOKUP);
+    return thinfat_blk_lookup(blk, so_read, THINFAT_BLK_EVENT_READ_SINGLE_LOOKUP);
   }
 }
 
-thinfat_result_t thinfat_blk_read_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_read, thinfat_sector_t sc_read, thinfat_core_event_t event)
+/*!
+ * The segments list where each sector from so_read on goes, in file order.
+ * Every contiguous run of the chain is moved in a single PHY transfer, and
+ * the client is called back once with the number of sectors moved.
+ */
+thinfat_result_t thinfat_blk_read_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_read, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event)
 {
   thinfat_t *tf = (thinfat_t *)blk->parent;
+  thinfat_result_t res;
   if (!THINFAT_IS_CLUSTER_VALID(blk->ci_current))
     return THINFAT_RESULT_EOF;
   else if (so_read >> tf->ctos_shift < blk->so_current >> tf->ctos_shift)
     return THINFAT_RESULT_POINTER_LEAP;
+  else if ((res = thinfat_blk_set_segments(blk, segments, nc_segments)) != THINFAT_RESULT_OK)
+    return res;
   else
   {
     blk->event = event;
-    blk->sc_read = sc_read;
     blk->client = client;
-    blk->next_data = NULL;
-    return thinfat_table_lookup(blk, tf->table, blk->ci_current, blk->so_current, so_read, THINFAT_BLK_EVENT_READ_CLUSTER_LOOKUP);
+    return thinfat_blk_lookup(blk, so_read, THINFAT_BLK_EVENT_READ_CLUSTER_LOOKUP);
   }
   return THINFAT_RESULT_OK;
 }
 
-thinfat_result_t thinfat_blk_write_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_write, thinfat_sector_t sc_write, thinfat_core_event_t event)
+thinfat_result_t thinfat_blk_extend(void *client, thinfat_blk_t *blk, thinfat_cluster_t cc_chain, thinfat_core_event_t event)
 {
   thinfat_t *tf = (thinfat_t *)blk->parent;
+  const thinfat_extent_t *last;
+
+  blk->client = client;
+  blk->event = event;
+  blk->cc_extend = cc_chain;
+  if (blk->cc_mapped >= cc_chain)
+    return thinfat_core_callback(client, event, 0, &blk->ci_head);
+  else if (blk->cc_mapped == 0 || blk->cc_chain == blk->cc_mapped)
+    return thinfat_blk_extend_start(blk);
+  last = &blk->extents[blk->nc_extents - 1];
+  //The walk maps the rest of the chain from the last cluster mapped on, and finds its end
+  blk->ci_lookup = THINFAT_INVALID_CLUSTER;
+  blk->so_lookup = THINFAT_INVALID_SECTOR;
+  return thinfat_table_walk(blk, tf->table, last->ci_start + last->cc_length - 1, (blk->cc_mapped - 1) << tf->ctos_shift,
+                            (cc_chain - 1) << tf->ctos_shift, THINFAT_BLK_EVENT_EXTENT_LINK, THINFAT_BLK_EVENT_EXTEND_LOOKUP);
+}
+
+thinfat_result_t thinfat_blk_write_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_write, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event)
+{
+  thinfat_t *tf = (thinfat_t *)blk->parent;
+  thinfat_result_t res;
   if (!THINFAT_IS_CLUSTER_VALID(blk->ci_current))
     return THINFAT_RESULT_EOF;
   else if (so_write >> tf->ctos_shift < blk->so_current >> tf->ctos_shift)
     return THINFAT_RESULT_POINTER_LEAP;
+  else if ((res = thinfat_blk_set_segments(blk, segments, nc_segments)) != THINFAT_RESULT_OK)
+    return res;
   else
   {
     blk->event = event;
-    blk->sc_write = sc_write;
     blk->client = client;
-    blk->next_data = NULL;
-    return thinfat_table_lookup(blk, tf->table, blk->ci_current, blk->so_current, so_write, THINFAT_BLK_EVENT_WRITE_CLUSTER_LOOKUP);
+    return thinfat_blk_lookup(blk, so_write, THINFAT_BLK_EVENT_WRITE_CLUSTER_LOOKUP);
   }
   return THINFAT_RESULT_OK;
 }
@@ -12,6 +12,26 @@
 struct thinfat_tag;
 struct thinfat_cache_tag;
 
+//co_start clusters into the chain begins a run of cc_length clusters from ci_start on
+typedef struct thinfat_extent_tag
+{
+  thinfat_cluster_t co_start;
+  thinfat_cluster_t ci_start;
+  thinfat_cluster_t cc_length;
+}
+thinfat_extent_t;
+
+typedef struct thinfat_blk_stats_tag
+{
+  //Cluster lookups answered by the extent map, and those that went to the FAT
+  uint32_t nc_mapped, nc_walked;
+  //Links those walks followed, and FAT sectors they read them from
+  uint32_t nc_hops, nc_table_reads;
+  //Preallocations that grew the chain, and the clusters they added
+  uint32_t nc_extends, cc_extended;
+}
+thinfat_blk_stats_t;
+
 typedef struct thinfat_blk_tag
 {
   void *client;
@@ -21,12 +41,29 @@ typedef struct thinfat_blk_tag
   thinfat_cluster_t ci_current;
   thinfat_sector_t so_current;
   thinfat_core_event_t event;
-  void *next_data;
   union
   {
     thinfat_sector_t sc_read;
     thinfat_sector_t sc_write;
   };
+  thinfat_segment_t segments[THINFAT_CONFIG_MAX_SEGMENTS];
+  unsigned int nc_segments, ni_segment;
+  thinfat_sector_t so_segment;
+  thinfat_sector_t sc_done;
+  //Clusters of the chain up to cc_mapped, as found while walking it; the oldest extents give way once it is full
+  thinfat_extent_t extents[THINFAT_CONFIG_BLK_EXTENTS];
+  unsigned int nc_extents;
+  thinfat_cluster_t cc_mapped;
+  thinfat_core_event_t lookup_event;
+  //Sector the lookup in progress is for, and its cluster once the walk has passed it
+  thinfat_sector_t so_lookup;
+  thinfat_cluster_t ci_lookup;
+  //Clusters the chain is being extended to, and those it has once the end has been mapped, 0 before
+  thinfat_cluster_t cc_extend, cc_chain;
+  //Clusters each allocation of the extension asks for, the last cluster linked, and the chain's length and last cluster before it
+  thinfat_cluster_t cc_chunk, ci_tail;
+  thinfat_cluster_t cc_base, ci_base;
+  thinfat_blk_stats_t stats;
 }
 thinfat_blk_t;
 
@@ -37,7 +74,18 @@ thinfat_result_t thinfat_blk_open(thinfat_blk_t *blk, thinfat_cluster_t ci);
 thinfat_result_t thinfat_blk_rewind(thinfat_blk_t *blk);
 thinfat_result_t thinfat_blk_seek(void *client, thinfat_blk_t *blk, thinfat_sector_t so_seek, thinfat_core_event_t event);
 thinfat_result_t thinfat_blk_read_each_sector(void *client, thinfat_blk_t *blk, thinfat_sector_t so_read, thinfat_sector_t sc_read, thinfat_core_event_t event);
-thinfat_result_t thinfat_blk_read_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_read, thinfat_sector_t sc_read, thinfat_core_event_t event);
-thinfat_result_t thinfat_blk_write_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_write, thinfat_sector_t sc_write, thinfat_core_event_t event);
+thinfat_result_t thinfat_blk_read_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_read, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event);
+/*
+ * Makes the chain at least cc_chain clusters long, hanging what it lacks off
+ * its end in as few runs as the allocator can find, and maps all of it, so
+ * that reads and writes within it go to neither the FAT nor the allocator.
+ * Calls back with the number of clusters added and a pointer to the head of
+ * the chain, which is new if it was empty. An allocation that fails is
+ * tried again in chunks of half the size, each linked to the one before;
+ * if it still falls short, the chunks are freed again and the callback gets
+ * NULL, with THINFAT_RESULT_NO_SPACE or THINFAT_RESULT_FRAGMENTED for s_param.
+ */
+thinfat_result_t thinfat_blk_extend(void *client, thinfat_blk_t *blk, thinfat_cluster_t cc_chain, thinfat_core_event_t event);
+thinfat_result_t thinfat_blk_write_each_cluster(void *client, thinfat_blk_t *blk, thinfat_sector_t so_write, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event);
 
 #endif
@@ -9,95 +9,510 @@
 #include "thinfat_phy.h"
 #include "thinfat_cache.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+const thinfat_cache_budget_t thinfat_default_cache_budget =
+{
+  THINFAT_CONFIG_CACHE_LINES,
+  {THINFAT_CONFIG_TABLE_CACHE_MIN, THINFAT_CONFIG_DIR_CACHE_MIN, THINFAT_CONFIG_FILE_CACHE_MIN},
+  {THINFAT_CONFIG_TABLE_CACHE_MAX, THINFAT_CONFIG_DIR_CACHE_MAX, THINFAT_CONFIG_FILE_CACHE_MAX}
+};
+
+static inline int *thinfat_cache_bucket(thinfat_cache_pool_t *pool, thinfat_sector_t si)
+{
+  return &pool->buckets[si & (pool->nc_buckets - 1)];
+}
+
+static int thinfat_cache_find(thinfat_cache_pool_t *pool, thinfat_sector_t si)
+{
+  int i;
+  for (i = *thinfat_cache_bucket(pool, si); i != THINFAT_CACHE_NO_LINE; i = pool->lines[i].next)
+    if (pool->lines[i].si_cached == si)
+      break;
+  return i;
+}
+
+static void thinfat_cache_unlink(thinfat_cache_pool_t *pool, int index)
+{
+  int *link = thinfat_cache_bucket(pool, pool->lines[index].si_cached);
+  while (*link != index)
+    link = &pool->lines[*link].next;
+  *link = pool->lines[index].next;
+}
+
+//Returns a cached line to the free state, without writing it back.
+static void thinfat_cache_release(thinfat_cache_pool_t *pool, int index)
+{
+  thinfat_cache_line_t *line = &pool->lines[index];
+  if (line->state == THINFAT_CACHE_STATE_INVALID)
+    return;
+  //A line being read in is not hashed yet; one being synced still is
+  if (line->state != THINFAT_CACHE_STATE_PENDING || thinfat_cache_find(pool, line->si_cached) == index)
+    thinfat_cache_unlink(pool, index);
+  if (line->state == THINFAT_CACHE_STATE_DIRTY)
+    pool->nc_dirty[line->owner]--;
+  pool->nc_class[line->owner]--;
+  line->state = THINFAT_CACHE_STATE_INVALID;
+  line->si_cached = THINFAT_INVALID_SECTOR;
+  line->data = line->buffer;
+}
+
+static thinfat_result_t thinfat_cache_sync_next(thinfat_cache_t *cache);
+static thinfat_result_t thinfat_cache_sync_mirror(thinfat_cache_t *cache);
+
 thinfat_result_t thinfat_cache_callback(thinfat_cache_t *cache, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param)
 {
-  thinfat_t *tf = (thinfat_t *)cache->parent;
+  thinfat_cache_pool_t *pool = cache->pool;
+  thinfat_cache_line_t *line = &pool->lines[cache->current];
+  int *bucket;
   switch(event)
   {
   case THINFAT_CACHE_EVENT_READ:
-    cache->si_cached = s_param;
-    cache->state = THINFAT_CACHE_STATE_CLEAN;
-    return thinfat_core_callback(cache->client, cache->event, s_param, p_param);
-  case THINFAT_CACHE_EVENT_WRITE:
-    if (tf->si_hidden + tf->sc_reserved <= s_param && s_param < tf->si_root)
-    {
-      thinfat_sector_t si_next_copy = s_param + tf->sc_table_size;
-      if (si_next_copy < tf->si_root)
-      {
-        return thinfat_phy_write_single(cache, tf->phy, si_next_copy, cache->data, THINFAT_CACHE_EVENT_WRITE);
-      }
-    }
-    if (THINFAT_IS_SECTOR_VALID(cache->si_replace))
-    {
-      if (cache->si_replace == cache->si_cached)
-      {
-        cache->state = THINFAT_CACHE_STATE_CLEAN;
-        return thinfat_core_callback(cache->client, cache->event, s_param, p_param);
-      }
-      return thinfat_phy_read_single(cache, tf->phy, cache->si_replace, cache->data, THINFAT_CACHE_EVENT_READ);
-    }
-    cache->si_cached = THINFAT_INVALID_SECTOR;
-    cache->state = THINFAT_CACHE_STATE_INVALID;
+    //A zero-copy PHY lends its own storage instead of filling the buffer
+    line->data = *(void **)p_param;
+    line->si_cached = s_param;
+    line->state = THINFAT_CACHE_STATE_CLEAN;
+    bucket = thinfat_cache_bucket(pool, s_param);
+    line->next = *bucket;
+    *bucket = cache->current;
     return thinfat_core_callback(cache->client, cache->event, s_param, p_param);
+  case THINFAT_CACHE_EVENT_SYNC_WRITE:
+    //Unless it was dirtied again or dropped meanwhile, the line is now current on the device
+    line = &pool->lines[pool->sync_line];
+    if (line->state == THINFAT_CACHE_STATE_PENDING && THINFAT_IS_SECTOR_VALID(line->si_cached))
+      line->state = THINFAT_CACHE_STATE_CLEAN;
+    return thinfat_cache_sync_next(cache);
+  case THINFAT_CACHE_EVENT_MIRROR_READ:
+    return thinfat_cache_sync_mirror(cache);
+  case THINFAT_CACHE_EVENT_MIRROR_WRITE:
+    if (++pool->copy_sync < ((thinfat_t *)cache->parent)->table_redundancy)
+      return thinfat_cache_sync_mirror(cache);
+    pool->so_sync += pool->sc_sync;
+    return thinfat_cache_sync_next(cache);
+  }
+  return THINFAT_RESULT_OK;
+}
+
+//Records that the mirrors of a sector of the first FAT need rewriting; false if they have to be written now.
+static bool thinfat_cache_defer_mirror(thinfat_cache_pool_t *pool, thinfat_sector_t so_table)
+{
+  thinfat_t *tf = pool->parent;
+  if (pool->mirror_policy != THINFAT_MIRROR_DEFERRED || tf->table_redundancy < 2)
+    return false;
+  if (pool->mirror_dirty == NULL && (pool->mirror_dirty = (uint8_t *)calloc((tf->sc_table_size + 7) / 8, 1)) == NULL)
+    return false;
+  pool->mirror_dirty[so_table / 8] |= 1 << (so_table % 8);
+  return true;
+}
+
+//Posts the mirrors of a FAT sector unless they are deferred.
+static thinfat_result_t thinfat_cache_write_mirrors(thinfat_cache_pool_t *pool, const thinfat_cache_line_t *line)
+{
+  thinfat_t *tf = pool->parent;
+  thinfat_sector_t si_table = tf->si_hidden + tf->sc_reserved, s = line->si_cached;
+  thinfat_result_t res;
+  if (s < si_table || s >= si_table + tf->sc_table_size || thinfat_cache_defer_mirror(pool, s - si_table))
+    return THINFAT_RESULT_OK;
+  for (s += tf->sc_table_size; s < tf->si_root; s += tf->sc_table_size)
+  {
+    if ((res = thinfat_phy_post_single(tf->phy, s, line->data)) != THINFAT_RESULT_OK)
+      return res;
+  }
+  return THINFAT_RESULT_OK;
+}
+
+//Posts a dirty line, and the FAT mirrors of it unless they are deferred, without waiting for the writes to finish.
+static thinfat_result_t thinfat_cache_post_line(thinfat_cache_pool_t *pool, thinfat_cache_line_t *line)
+{
+  thinfat_result_t res;
+  if ((res = thinfat_phy_post_single(pool->parent->phy, line->si_cached, line->data)) != THINFAT_RESULT_OK)
+    return res;
+  if ((res = thinfat_cache_write_mirrors(pool, line)) != THINFAT_RESULT_OK)
+    return res;
+  line->state = THINFAT_CACHE_STATE_CLEAN;
+  pool->nc_dirty[line->owner]--;
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_cache_write_back(thinfat_cache_t *cache, thinfat_cache_line_t *line)
+{
+  thinfat_result_t res = thinfat_cache_post_line(cache->pool, line);
+  if (res == THINFAT_RESULT_OK)
+    cache->stats.nc_write_back++;
+  return res;
+}
+
+static void thinfat_cache_invalidate(thinfat_cache_pool_t *pool)
+{
+  uint8_t *buffer = pool->buffer;
+  for (unsigned int i = 0; i < pool->nc_buckets; i++)
+    pool->buckets[i] = THINFAT_CACHE_NO_LINE;
+  for (unsigned int i = 0; i < pool->budget.nc_lines; i++, buffer += pool->parent->sz_sector)
+  {
+    pool->lines[i].state = THINFAT_CACHE_STATE_INVALID;
+    pool->lines[i].si_cached = THINFAT_INVALID_SECTOR;
+    pool->lines[i].used = 0;
+    pool->lines[i].ms_dirtied = 0;
+    pool->lines[i].next = THINFAT_CACHE_NO_LINE;
+    pool->lines[i].buffer = buffer;
+    pool->lines[i].data = buffer;
+  }
+  for (unsigned int c = 0; c < THINFAT_CACHE_CLASS_MAX; c++)
+  {
+    pool->nc_class[c] = 0;
+    pool->nc_dirty[c] = 0;
+  }
+  pool->clock = 0;
+}
+
+thinfat_result_t thinfat_cache_pool_init(thinfat_cache_pool_t *pool, thinfat_t *parent, const thinfat_cache_budget_t *budget)
+{
+  unsigned int nc_reserved = 0;
+  for (unsigned int c = 0; c < THINFAT_CACHE_CLASS_MAX; c++)
+  {
+    if (budget->nc_min[c] == 0 || budget->nc_min[c] > budget->nc_max[c])
+      return THINFAT_RESULT_UNSUPPORTED;
+    nc_reserved += budget->nc_min[c];
   }
+  if (nc_reserved > budget->nc_lines)
+    return THINFAT_RESULT_UNSUPPORTED;
+
+  pool->parent = parent;
+  pool->budget = *budget;
+  pool->mirror_policy = THINFAT_CONFIG_DEFER_FAT_MIRRORS ? THINFAT_MIRROR_DEFERRED : THINFAT_MIRROR_IMMEDIATE;
+  pool->mirror_dirty = NULL;
+  pool->sync_buffer = NULL;
+  pool->so_sync = 0;
+  pool->sync_line = 0;
+  pool->ms_expire = THINFAT_CONFIG_FLUSH_EXPIRE_MS;
+  pool->ms_idle = THINFAT_CONFIG_FLUSH_IDLE_MS;
+  pool->ms_now = 0;
+  memset(&pool->flush_stats, 0, sizeof(thinfat_cache_flush_stats_t));
+  for (pool->nc_buckets = 1; pool->nc_buckets < budget->nc_lines; pool->nc_buckets <<= 1);
+  pool->buckets = (int *)malloc(sizeof(int) * pool->nc_buckets);
+  pool->lines = (thinfat_cache_line_t *)malloc(sizeof(thinfat_cache_line_t) * budget->nc_lines);
+  pool->buffer = (uint8_t *)malloc(parent->sz_sector * budget->nc_lines);
+  if (pool->buckets == NULL || pool->lines == NULL || pool->buffer == NULL)
+    return THINFAT_RESULT_UNSUPPORTED;
+  thinfat_cache_invalidate(pool);
   return THINFAT_RESULT_OK;
 }
 
-thinfat_result_t thinfat_cache_init(thinfat_cache_t *cache, thinfat_t *parent)
+//Forgets every cached sector and sizes the lines for the parent's current sector size.
+thinfat_result_t thinfat_cache_pool_resize(thinfat_cache_pool_t *pool)
+{
+  uint8_t *buffer = (uint8_t *)realloc(pool->buffer, pool->parent->sz_sector * pool->budget.nc_lines);
+  if (buffer == NULL)
+    return THINFAT_RESULT_UNSUPPORTED;
+  pool->buffer = buffer;
+  thinfat_cache_invalidate(pool);
+  return THINFAT_RESULT_OK;
+}
+
+//Drops the mirror bitmap of the volume going away; thinfat_cache_sync() has to have run first.
+void thinfat_cache_pool_unmount(thinfat_cache_pool_t *pool)
+{
+  free(pool->mirror_dirty);
+  pool->mirror_dirty = NULL;
+  thinfat_cache_invalidate(pool);
+}
+
+void thinfat_cache_pool_finalize(thinfat_cache_pool_t *pool)
 {
+  free(pool->mirror_dirty);
+  free(pool->sync_buffer);
+  pool->mirror_dirty = NULL;
+  pool->sync_buffer = NULL;
+  free(pool->buckets);
+  free(pool->lines);
+  free(pool->buffer);
+  pool->buckets = NULL;
+  pool->lines = NULL;
+  pool->buffer = NULL;
+}
+
+//Whether the worker should write the line back now
+static bool thinfat_cache_is_due(const thinfat_cache_pool_t *pool, const thinfat_cache_line_t *line, bool idle)
+{
+  return line->state == THINFAT_CACHE_STATE_DIRTY && (idle || (pool->ms_expire > 0 && pool->ms_now - line->ms_dirtied >= pool->ms_expire));
+}
+
+/*
+ * Run by the PHY worker under its lock. Lines go out lowest sector first, so
+ * that the elevator merges neighbours into single transfers, and at most
+ * half the queue is taken so that clients still find room for their own
+ * requests. Returns when the oldest line left dirty expires, or the idle
+ * delay if that comes sooner.
+ */
+uint32_t thinfat_cache_pool_tick(void *arg, uint32_t ms_now, uint32_t ms_quiet)
+{
+  thinfat_cache_pool_t *pool = (thinfat_cache_pool_t *)arg;
+  thinfat_t *tf = pool->parent;
+  thinfat_phy_t *phy = tf->phy;
+  bool idle = pool->ms_idle > 0 && ms_quiet >= pool->ms_idle;
+  thinfat_sector_t si_last = THINFAT_INVALID_SECTOR;
+  uint32_t nc_posted = 0, ms_next = pool->ms_idle > 0 ? pool->ms_idle : pool->ms_expire;
+
+  pool->ms_now = ms_now;
+  pool->flush_stats.nc_tick++;
+  while (phy->rq_count + tf->table_redundancy < THINFAT_CONFIG_PHY_QUEUE_DEPTH / 2)
+  {
+    int index = THINFAT_CACHE_NO_LINE;
+    thinfat_cache_line_t *line;
+    for (unsigned int i = 0; i < pool->budget.nc_lines; i++)
+      if (thinfat_cache_is_due(pool, &pool->lines[i], idle) && (index == THINFAT_CACHE_NO_LINE || pool->lines[i].si_cached < pool->lines[index].si_cached))
+        index = (int)i;
+    if (index == THINFAT_CACHE_NO_LINE)
+      break;
+    line = &pool->lines[index];
+    if (thinfat_cache_post_line(pool, line) != THINFAT_RESULT_OK)
+      break;
+    if (pool->ms_expire > 0 && ms_now - line->ms_dirtied >= pool->ms_expire)
+      pool->flush_stats.nc_expired++;
+    else
+      pool->flush_stats.nc_idle++;
+    if (ms_now - line->ms_dirtied > pool->flush_stats.ms_max_age)
+      pool->flush_stats.ms_max_age = ms_now - line->ms_dirtied;
+    if (line->si_cached != si_last + 1)
+      pool->flush_stats.nc_run++;
+    si_last = line->si_cached;
+    nc_posted++;
+  }
+  if (nc_posted > 0)
+    pool->flush_stats.nc_flush++;
+
+  //Whatever is left waits for the queue to drain, its expiry or the idle delay
+  for (unsigned int i = 0; i < pool->budget.nc_lines; i++)
+  {
+    const thinfat_cache_line_t *line = &pool->lines[i];
+    if (line->state != THINFAT_CACHE_STATE_DIRTY)
+      continue;
+    if (thinfat_cache_is_due(pool, line, idle))
+      return 1;
+    if (pool->ms_expire > 0 && line->ms_dirtied + pool->ms_expire - ms_now < ms_next)
+      ms_next = line->ms_dirtied + pool->ms_expire - ms_now;
+    if (pool->ms_idle > 0 && pool->ms_idle - ms_quiet < ms_next)
+      ms_next = pool->ms_idle - ms_quiet;
+  }
+  return ms_next > 0 ? ms_next : 1000;
+}
+
+void thinfat_cache_pool_get_flush_stats(const thinfat_cache_pool_t *pool, thinfat_cache_flush_stats_t *stats)
+{
+  *stats = pool->flush_stats;
+}
+
+void thinfat_cache_init(thinfat_cache_t *cache, thinfat_cache_pool_t *pool, thinfat_cache_class_t owner)
+{
+  cache->parent = pool->parent;
+  cache->pool = pool;
+  cache->owner = owner;
   cache->client = NULL;
-  cache->parent = parent;
-  cache->state = THINFAT_CACHE_STATE_INVALID;
-  cache->si_cached = THINFAT_INVALID_SECTOR;
-  cache->si_replace = THINFAT_INVALID_SECTOR;
+  cache->current = 0;
+  memset(&cache->stats, 0, sizeof(thinfat_cache_stats_t));
+}
+
+void thinfat_cache_get_stats(const thinfat_cache_t *cache, thinfat_cache_stats_t *stats)
+{
+  *stats = cache->stats;
+  stats->nc_lines = cache->pool->nc_class[cache->owner];
+}
+
+//Posts every dirty line of the handle's class; they stay cached as clean copies.
+thinfat_result_t thinfat_cache_flush(thinfat_cache_t *cache)
+{
+  thinfat_cache_pool_t *pool = cache->pool;
+  thinfat_result_t res;
+  for (unsigned int i = 0; i < pool->budget.nc_lines && pool->nc_dirty[cache->owner] > 0; i++)
+  {
+    thinfat_cache_line_t *line = &pool->lines[i];
+    if (line->owner == cache->owner && line->state == THINFAT_CACHE_STATE_DIRTY
+        && (res = thinfat_cache_write_back(cache, line)) != THINFAT_RESULT_OK)
+      return res;
+  }
   return THINFAT_RESULT_OK;
 }
 
-thinfat_result_t thinfat_cached_read_single(void *client, thinfat_cache_t *cache, thinfat_sector_t si_read, thinfat_core_event_t event)
+//Forgets the cached sectors within [si, si + sc), without writing them back.
+void thinfat_cache_discard(thinfat_cache_t *cache, thinfat_sector_t si, thinfat_sector_t sc)
 {
-  thinfat_t *tf = (thinfat_t *)cache->parent;
-  switch(cache->state)
+  thinfat_cache_pool_t *pool = cache->pool;
+  if (sc < pool->budget.nc_lines)
   {
-  case THINFAT_CACHE_STATE_INVALID:
-    if (!THINFAT_IS_SECTOR_VALID(si_read))
-    {
-      return thinfat_core_callback(client, event, THINFAT_INVALID_SECTOR, NULL);
-    }
-    cache->event = event;
-    cache->client = client;
-    return thinfat_phy_read_single(cache, tf->phy, si_read, cache->data, THINFAT_CACHE_EVENT_READ);
-  case THINFAT_CACHE_STATE_CLEAN:
-    if (!THINFAT_IS_SECTOR_VALID(si_read))
+    for (thinfat_sector_t s = si; s < si + sc; s++)
     {
-      cache->state = THINFAT_CACHE_STATE_INVALID;
-      return thinfat_core_callback(client, event, THINFAT_INVALID_SECTOR, NULL);
+      int index = thinfat_cache_find(pool, s);
+      if (index != THINFAT_CACHE_NO_LINE)
+        thinfat_cache_release(pool, index);
     }
-    else if (cache->si_cached == si_read)
-    {
-      void *data = cache->data;
-      return thinfat_core_callback(client, event, si_read, &data);
-    }
-    else
+  }
+  else
+  {
+    for (unsigned int i = 0; i < pool->budget.nc_lines; i++)
+      if (pool->lines[i].state != THINFAT_CACHE_STATE_PENDING && si <= pool->lines[i].si_cached && pool->lines[i].si_cached - si < sc)
+        thinfat_cache_release(pool, (int)i);
+  }
+}
+
+//Picks the line a miss of class `owner` may take, or THINFAT_CACHE_NO_LINE if every candidate is busy.
+static int thinfat_cache_pick(thinfat_cache_pool_t *pool, thinfat_cache_class_t owner)
+{
+  bool growing = pool->nc_class[owner] < pool->budget.nc_max[owner];
+  int victim = THINFAT_CACHE_NO_LINE;
+  for (unsigned int i = 0; i < pool->budget.nc_lines; i++)
+  {
+    thinfat_cache_line_t *line = &pool->lines[i];
+    if (line->state == THINFAT_CACHE_STATE_PENDING)
+      continue;
+    if (line->state == THINFAT_CACHE_STATE_INVALID)
     {
-      cache->event = event;
-      cache->client = client;
-      return thinfat_phy_read_single(cache, tf->phy, si_read, cache->data, THINFAT_CACHE_EVENT_READ);
+      if (growing)
+        return (int)i;
+      continue;
     }
-    break;
-  case THINFAT_CACHE_STATE_DIRTY:
-    if (cache->si_cached == si_read)
+    if (line->owner != owner && !(growing && pool->nc_class[line->owner] > pool->budget.nc_min[line->owner]))
+      continue;
+    if (victim == THINFAT_CACHE_NO_LINE || line->used < pool->lines[victim].used)
+      victim = (int)i;
+  }
+  return victim;
+}
+
+/*
+ * Hands the client a pointer to sector si_read, reading it into a line the
+ * handle's class may take on a miss. An invalid sector posts every dirty line
+ * of the class and calls back with NULL, which clients use to make the device
+ * copy current before reading around the cache.
+ */
+thinfat_result_t thinfat_cached_read_single(void *client, thinfat_cache_t *cache, thinfat_sector_t si_read, thinfat_core_event_t event)
+{
+  thinfat_t *tf = (thinfat_t *)cache->parent;
+  thinfat_cache_pool_t *pool = cache->pool;
+  thinfat_cache_line_t *line;
+  thinfat_result_t res;
+  int index;
+
+  if (!THINFAT_IS_SECTOR_VALID(si_read))
+  {
+    if ((res = thinfat_cache_flush(cache)) != THINFAT_RESULT_OK)
+      return res;
+    return thinfat_core_callback(client, event, THINFAT_INVALID_SECTOR, NULL);
+  }
+
+  if ((index = thinfat_cache_find(pool, si_read)) != THINFAT_CACHE_NO_LINE)
+  {
+    void *data = pool->lines[index].data;
+    pool->lines[index].used = ++pool->clock;
+    cache->current = index;
+    cache->stats.nc_hit++;
+    return thinfat_core_callback(client, event, si_read, &data);
+  }
+
+  cache->stats.nc_miss++;
+  if ((index = thinfat_cache_pick(pool, cache->owner)) == THINFAT_CACHE_NO_LINE)
+    return THINFAT_RESULT_CACHE_BUSY;
+  line = &pool->lines[index];
+  if (line->state != THINFAT_CACHE_STATE_INVALID)
+  {
+    cache->stats.nc_eviction++;
+    if (line->state == THINFAT_CACHE_STATE_DIRTY && (res = thinfat_cache_write_back(cache, line)) != THINFAT_RESULT_OK)
+      return res;
+    thinfat_cache_release(pool, index);
+  }
+  line->state = THINFAT_CACHE_STATE_PENDING;
+  line->owner = cache->owner;
+  line->used = ++pool->clock;
+  pool->nc_class[cache->owner]++;
+  cache->current = index;
+  cache->event = event;
+  cache->client = client;
+  if ((res = thinfat_phy_read_single(cache, tf->phy, si_read, line->buffer, THINFAT_CACHE_EVENT_READ)) != THINFAT_RESULT_OK
+      && line->state == THINFAT_CACHE_STATE_PENDING)
+    thinfat_cache_release(pool, index);
+  return res;
+}
+
+//Writes one run of out-of-date sectors, already read from the first FAT, to the next copy.
+static thinfat_result_t thinfat_cache_sync_mirror(thinfat_cache_t *cache)
+{
+  thinfat_t *tf = (thinfat_t *)cache->parent;
+  thinfat_cache_pool_t *pool = cache->pool;
+  thinfat_segment_t segment;
+  segment.data = pool->sync_buffer;
+  segment.sc_data = pool->sc_sync;
+  return thinfat_phy_write_vector(cache, tf->phy, tf->si_hidden + tf->sc_reserved + pool->copy_sync * tf->sc_table_size + pool->so_sync,
+                                  &segment, 1, THINFAT_CACHE_EVENT_MIRROR_WRITE);
+}
+
+/*
+ * Dirty lines go out first, lowest sector first and one at a time, so that
+ * the queue never fills up. Then every run of FAT sectors marked in the
+ * mirror bitmap is read back from the first FAT and written to the others.
+ */
+static thinfat_result_t thinfat_cache_sync_next(thinfat_cache_t *cache)
+{
+  thinfat_t *tf = (thinfat_t *)cache->parent;
+  thinfat_cache_pool_t *pool = cache->pool;
+  int index = THINFAT_CACHE_NO_LINE;
+  thinfat_result_t res;
+
+  for (unsigned int i = 0; i < pool->budget.nc_lines; i++)
+    if (pool->lines[i].state == THINFAT_CACHE_STATE_DIRTY && (index == THINFAT_CACHE_NO_LINE || pool->lines[i].si_cached < pool->lines[index].si_cached))
+      index = (int)i;
+  if (index != THINFAT_CACHE_NO_LINE)
+  {
+    thinfat_cache_line_t *line = &pool->lines[index];
+    if ((res = thinfat_cache_write_mirrors(pool, line)) != THINFAT_RESULT_OK)
+      return res;
+    //Stays pending, and so out of reach of eviction, until the write completes
+    line->state = THINFAT_CACHE_STATE_PENDING;
+    pool->nc_dirty[line->owner]--;
+    pool->sync_line = index;
+    if ((res = thinfat_phy_write_single(cache, tf->phy, line->si_cached, line->data, THINFAT_CACHE_EVENT_SYNC_WRITE)) != THINFAT_RESULT_OK)
     {
-      void *data = cache->data;
-      return thinfat_core_callback(client, event, si_read, &data);
+      if (line->state == THINFAT_CACHE_STATE_PENDING)
+      {
+        line->state = THINFAT_CACHE_STATE_DIRTY;
+        pool->nc_dirty[line->owner]++;
+      }
+      return res;
     }
-    else
+    cache->stats.nc_write_back++;
+    return THINFAT_RESULT_OK;
+  }
+
+  for (; pool->mirror_dirty != NULL && pool->so_sync < tf->sc_table_size; pool->so_sync++)
+  {
+    thinfat_segment_t segment;
+    if (!(pool->mirror_dirty[pool->so_sync / 8] & (1 << (pool->so_sync % 8))))
+      continue;
+    for (pool->sc_sync = 0; pool->sc_sync < THINFAT_CONFIG_MIRROR_RUN && pool->so_sync + pool->sc_sync < tf->sc_table_size; pool->sc_sync++)
     {
-      cache->event = event;
-      cache->si_replace = si_read;
-      cache->client = client;
-      return thinfat_phy_write_single(cache, tf->phy, cache->si_cached, cache->data, THINFAT_CACHE_EVENT_WRITE);
+      thinfat_sector_t so = pool->so_sync + pool->sc_sync;
+      if (!(pool->mirror_dirty[so / 8] & (1 << (so % 8))))
+        break;
+      pool->mirror_dirty[so / 8] &= ~(1 << (so % 8));
     }
-    break;
+    if (pool->sync_buffer == NULL && (pool->sync_buffer = (uint8_t *)malloc(tf->sz_sector * THINFAT_CONFIG_MIRROR_RUN)) == NULL)
+      return THINFAT_RESULT_UNSUPPORTED;
+    pool->copy_sync = 1;
+    segment.data = pool->sync_buffer;
+    segment.sc_data = pool->sc_sync;
+    return thinfat_phy_read_vector(cache, tf->phy, tf->si_hidden + tf->sc_reserved + pool->so_sync, &segment, 1, THINFAT_CACHE_EVENT_MIRROR_READ);
   }
-  return THINFAT_RESULT_OK;
+
+  free(pool->sync_buffer);
+  pool->sync_buffer = NULL;
+  pool->so_sync = 0;
+  return thinfat_core_callback(cache->client, cache->event, THINFAT_INVALID_SECTOR, NULL);
+}
+
+//Writes every dirty line of the pool and brings the FAT mirrors up to date, then calls back.
+thinfat_result_t thinfat_cache_sync(void *client, thinfat_cache_t *cache, thinfat_core_event_t event)
+{
+  cache->client = client;
+  cache->event = event;
+  cache->pool->so_sync = 0;
+  return thinfat_cache_sync_next(cache);
 }
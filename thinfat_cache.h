@@ -8,45 +8,136 @@
 #ifndef THINFAT_CACHE_H
 #define THINFAT_CACHE_H
 
-#include "thinfat_common.h"
+#include "thinfat.h"
+
+#include <stdbool.h>
 
 typedef enum
 {
   THINFAT_CACHE_STATE_INVALID = 0,
   THINFAT_CACHE_STATE_CLEAN,
-  THINFAT_CACHE_STATE_DIRTY
+  THINFAT_CACHE_STATE_DIRTY,
+  //Being read from the device, so neither indexed nor up for replacement
+  THINFAT_CACHE_STATE_PENDING
 }
 thinfat_cache_state_t;
 
-struct thinfat_tag;
+#define THINFAT_CACHE_NO_LINE (-1)
+
+typedef struct thinfat_cache_line_tag
+{
+  thinfat_cache_state_t state;
+  thinfat_cache_class_t owner;
+  thinfat_sector_t si_cached;
+  //Last use, for LRU replacement
+  uint32_t used;
+  //When it went dirty, as of the last tick of the PHY worker
+  uint32_t ms_dirtied;
+  //Next line in the same hash bucket
+  int next;
+  void *data;
+  uint8_t *buffer;
+}
+thinfat_cache_line_t;
+
+typedef struct thinfat_cache_flush_stats_tag
+{
+  //Ticks of the PHY worker, and those that wrote anything back
+  uint32_t nc_tick, nc_flush;
+  //Lines written back for having been dirty too long, or for the queue being idle
+  uint32_t nc_expired, nc_idle;
+  //Runs of adjacent sectors among them, each of which the elevator can merge into one transfer
+  uint32_t nc_run;
+  //Oldest line written back, in milliseconds since it went dirty
+  uint32_t ms_max_age;
+}
+thinfat_cache_flush_stats_t;
+
+/*
+ * The sector cache shared by every layer. Lines are found through a hash on
+ * the sector number whichever class brought them in, so a sector is cached
+ * once. Each class holds between its minimum and maximum number of lines: a
+ * miss takes a free line or the least recently used one that its owner can
+ * spare, or the class's own once it is at its maximum.
+ */
+typedef struct thinfat_cache_pool_tag
+{
+  struct thinfat_tag *parent;
+  thinfat_cache_budget_t budget;
+  unsigned int nc_buckets;
+  uint32_t clock;
+  unsigned int nc_class[THINFAT_CACHE_CLASS_MAX];
+  unsigned int nc_dirty[THINFAT_CACHE_CLASS_MAX];
+  int *buckets;
+  thinfat_cache_line_t *lines;
+  uint8_t *buffer;
+  thinfat_mirror_policy_t mirror_policy;
+  //One bit per sector of the first FAT whose mirrors are out of date
+  uint8_t *mirror_dirty;
+  //Progress of a sync through the mirror bitmap
+  thinfat_sector_t so_sync, sc_sync;
+  unsigned int copy_sync;
+  //Line whose write-back the sync is waiting for
+  int sync_line;
+  uint8_t *sync_buffer;
+  //Background write-back; ms_now is the time of the last tick
+  uint32_t ms_expire, ms_idle;
+  uint32_t ms_now;
+  thinfat_cache_flush_stats_t flush_stats;
+}
+thinfat_cache_pool_t;
+
+typedef struct thinfat_cache_stats_tag
+{
+  uint32_t nc_hit, nc_miss, nc_eviction, nc_write_back;
+  //Lines the class holds right now
+  unsigned int nc_lines;
+}
+thinfat_cache_stats_t;
 
+//A layer's handle on the pool. The line last handed to its client is the current one, which thinfat_cache_touch() marks dirty.
 typedef struct thinfat_cache_tag
 {
   struct thinfat_tag *parent;
+  thinfat_cache_pool_t *pool;
+  thinfat_cache_class_t owner;
   void *client;
-  thinfat_cache_state_t state;
   thinfat_core_event_t event;
-  thinfat_sector_t si_cached;
-  union
-  {
-    thinfat_sector_t si_replace;
-  };
-  union
-  {
-    thinfat_sector_t sc_read;
-    thinfat_sector_t sc_write;
-  };
-  uint8_t data[THINFAT_SECTOR_SIZE];
+  int current;
+  thinfat_cache_stats_t stats;
 }
 thinfat_cache_t;
 
+thinfat_result_t thinfat_cache_pool_init(thinfat_cache_pool_t *pool, struct thinfat_tag *parent, const thinfat_cache_budget_t *budget);
+thinfat_result_t thinfat_cache_pool_resize(thinfat_cache_pool_t *pool);
+void thinfat_cache_pool_finalize(thinfat_cache_pool_t *pool);
+void thinfat_cache_pool_unmount(thinfat_cache_pool_t *pool);
+uint32_t thinfat_cache_pool_tick(void *arg, uint32_t ms_now, uint32_t ms_quiet);
+void thinfat_cache_pool_get_flush_stats(const thinfat_cache_pool_t *pool, thinfat_cache_flush_stats_t *stats);
+
 thinfat_result_t thinfat_cache_callback(thinfat_cache_t *cache, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param);
-thinfat_result_t thinfat_cache_init(thinfat_cache_t *cache, struct thinfat_tag *parent);
+void thinfat_cache_init(thinfat_cache_t *cache, thinfat_cache_pool_t *pool, thinfat_cache_class_t owner);
 thinfat_result_t thinfat_cached_read_single(void *client, thinfat_cache_t *cache, thinfat_sector_t si_read, thinfat_core_event_t event);
+thinfat_result_t thinfat_cache_flush(thinfat_cache_t *cache);
+thinfat_result_t thinfat_cache_sync(void *client, thinfat_cache_t *cache, thinfat_core_event_t event);
+void thinfat_cache_discard(thinfat_cache_t *cache, thinfat_sector_t si, thinfat_sector_t sc);
+void thinfat_cache_get_stats(const thinfat_cache_t *cache, thinfat_cache_stats_t *stats);
 
 static inline void thinfat_cache_touch(thinfat_cache_t *cache)
 {
-  cache->state = THINFAT_CACHE_STATE_DIRTY;
+  thinfat_cache_line_t *line = &cache->pool->lines[cache->current];
+  if (line->state != THINFAT_CACHE_STATE_DIRTY)
+  {
+    line->state = THINFAT_CACHE_STATE_DIRTY;
+    line->ms_dirtied = cache->pool->ms_now;
+    cache->pool->nc_dirty[line->owner]++;
+  }
+}
+
+//Whether any line of the handle's class awaits write-back
+static inline bool thinfat_cache_is_dirty(const thinfat_cache_t *cache)
+{
+  return cache->pool->nc_dirty[cache->owner] > 0;
 }
 
 #endif
@@ -8,6 +8,8 @@
 #ifndef THINFAT_COMMON_H
 #define THINFAT_COMMON_H
 
+#include "thinfat_config.h"
+
 #include <stdint.h>
 #include <stdio.h>
 
@@ -21,6 +23,7 @@
 #define THINFAT_SECTOR_SIZE (512U)
 #define THINFAT_INVALID_CLUSTER (0x0FFFFFF7U)
 #define THINFAT_INVALID_SECTOR (0xFFFFFFFFU)
+#define THINFAT_UNKNOWN_FREE_COUNT (0xFFFFFFFFU)
 #define THINFAT_FAT32_CLUSTER_MASK (0x0FFFFFFFU)
 #define THINFAT_FAT32_EOC (0x0FFFFFF8)
 #define THINFAT_FAT32_CLUSTER_HIGH_MASK (0xF0000000U)
@@ -31,6 +34,7 @@
 #define THINFAT_SECTOR_SIZE (512UL)
 #define THINFAT_INVALID_CLUSTER (0x0FFFFFF7UL)
 #define THINFAT_INVALID_SECTOR (0xFFFFFFFFUL)
+#define THINFAT_UNKNOWN_FREE_COUNT (0xFFFFFFFFUL)
 #define THINFAT_FAT32_CLUSTER_MASK (0x0FFFFFFFUL)
 #define THINFAT_FAT32_EOC (0x0FFFFFF8UL)
 #define THINFAT_FAT32_CLUSTER_HIGH_MASK (0xF0000000UL)
@@ -41,6 +45,7 @@
 #define THINFAT_SECTOR_SIZE (512ULL)
 #define THINFAT_INVALID_CLUSTER (0x0FFFFFF7ULL)
 #define THINFAT_INVALID_SECTOR (0xFFFFFFFFULL)
+#define THINFAT_UNKNOWN_FREE_COUNT (0xFFFFFFFFULL)
 #define THINFAT_FAT32_CLUSTER_MASK (0x0FFFFFFFULL)
 #define THINFAT_FAT32_EOC (0x0FFFFFF8ULL)
 #define THINFAT_FAT32_CLUSTER_HIGH_MASK (0xF0000000ULL)
@@ -48,7 +53,11 @@
 #error "The compiler does not support 32bit integer."
 #endif
 
+#if THINFAT_CONFIG_ENABLE_INFO
 #define THINFAT_INFO(...) printf(__VA_ARGS__)
+#else
+#define THINFAT_INFO(...) ((void)0)
+#endif
 #define THINFAT_ERROR(...) fprintf(stderr, __VA_ARGS__)
 
 typedef uint32_t thinfat_sector_t;
@@ -56,6 +65,14 @@ typedef uint32_t thinfat_cluster_t;
 typedef uint32_t thinfat_size_t;
 typedef uint32_t thinfat_off_t;
 
+//A run of whole sectors in memory; lists of these describe scattered transfers.
+typedef struct thinfat_segment_tag
+{
+  void *data;
+  thinfat_sector_t sc_data;
+}
+thinfat_segment_t;
+
 typedef enum
 {
   THINFAT_RESULT_OK = 0,
@@ -69,7 +86,11 @@ typedef enum
   THINFAT_RESULT_EOF,
   THINFAT_RESULT_TABLE_BUSY,
   THINFAT_RESULT_UNSUPPORTED,
-  THINFAT_RESULT_POINTER_LEAP
+  THINFAT_RESULT_POINTER_LEAP,
+  THINFAT_RESULT_CACHE_BUSY,  //Every line the caller may take is being read
+  THINFAT_RESULT_FILE_PENDING,//Data written with delayed allocation has to be flushed first
+  THINFAT_RESULT_NO_SPACE,    //Fewer clusters are free than were asked for
+  THINFAT_RESULT_FRAGMENTED   //The free count has room the allocator could not find
 }
 thinfat_result_t;
 
@@ -79,9 +100,16 @@ typedef enum
   THINFAT_CORE_EVENT_READ_MBR,
   THINFAT_CORE_EVENT_READ_BPB,
   THINFAT_CORE_EVENT_READ_FSINFO,
+  THINFAT_CORE_EVENT_UNMOUNT,
+  THINFAT_CORE_EVENT_SCAN_TABLE,
+  THINFAT_CORE_EVENT_WRITE_FSINFO,
+  THINFAT_CORE_EVENT_FLUSH_FILE,
+  THINFAT_CORE_EVENT_SYNCED,
   THINFAT_CORE_EVENT_MAX,
   THINFAT_CACHE_EVENT_READ,
-  THINFAT_CACHE_EVENT_WRITE,
+  THINFAT_CACHE_EVENT_SYNC_WRITE,
+  THINFAT_CACHE_EVENT_MIRROR_READ,
+  THINFAT_CACHE_EVENT_MIRROR_WRITE,
   THINFAT_CACHE_EVENT_MAX,
   THINFAT_BLK_EVENT_SEEK_LOOKUP,
   THINFAT_BLK_EVENT_READ_SINGLE,
@@ -90,6 +118,12 @@ typedef enum
   THINFAT_BLK_EVENT_READ_CLUSTER_LOOKUP,
   THINFAT_BLK_EVENT_WRITE_CLUSTER,
   THINFAT_BLK_EVENT_WRITE_CLUSTER_LOOKUP,
+  THINFAT_BLK_EVENT_EXTENT_LOOKUP,
+  THINFAT_BLK_EVENT_EXTENT_LINK,
+  THINFAT_BLK_EVENT_EXTEND_LOOKUP,
+  THINFAT_BLK_EVENT_EXTEND_ALLOCATED,
+  THINFAT_BLK_EVENT_EXTEND_LINKED,
+  THINFAT_BLK_EVENT_EXTEND_UNDONE,
   THINFAT_BLK_EVENT_MAX,
   THINFAT_TABLE_EVENT_LOOKUP,
   THINFAT_TABLE_EVENT_SEARCH_READ,
@@ -97,12 +131,18 @@ typedef enum
   THINFAT_TABLE_EVENT_CONCATENATE_READ,
   THINFAT_TABLE_EVENT_CREATE_CHAIN_READ,
   THINFAT_TABLE_EVENT_DEALLOCATE_READ,
+  THINFAT_TABLE_EVENT_SCAN_READ,
+  THINFAT_TABLE_EVENT_PIECE_LINKED,
+  THINFAT_TABLE_EVENT_FREE_READ,
+  THINFAT_TABLE_EVENT_FREE_WRITE,
+  THINFAT_TABLE_EVENT_ALLOC_UNDONE,
   THINFAT_TABLE_EVENT_MAX,
   THINFAT_FILE_EVENT_READ,
   THINFAT_FILE_EVENT_READ_PREPARE,
   THINFAT_FILE_EVENT_WRITE,
   THINFAT_FILE_EVENT_WRITE_PREPARE,
-  THINFAT_FILE_EVENT_WRITE_FINISH,
+  THINFAT_FILE_EVENT_FLUSH_EXTENDED,
+  THINFAT_FILE_EVENT_FLUSH_WRITTEN,
   THINFAT_FILE_EVENT_MAX,
   THINFAT_DIR_EVENT_DUMP,
   THINFAT_DIR_EVENT_FIND,
@@ -116,6 +156,7 @@ typedef enum
   THINFAT_EVENT_READ_FILE,
   THINFAT_EVENT_WRITE_FILE,
   THINFAT_EVENT_ALLOCATE,
+  THINFAT_EVENT_SYNC,
   THINFAT_EVENT_MAX,
   THINFAT_USER_EVENT
 }
@@ -123,4 +164,17 @@ thinfat_core_event_t;
 
 typedef thinfat_core_event_t thinfat_event_t;
 
+//Layer an event belongs to, as far as the I/O it causes is concerned
+typedef enum
+{
+  THINFAT_CLASS_CORE = 0,
+  THINFAT_CLASS_CACHE,
+  THINFAT_CLASS_TABLE,
+  THINFAT_CLASS_FILE,
+  THINFAT_CLASS_DIR,
+  THINFAT_CLASS_USER,
+  THINFAT_CLASS_MAX
+}
+thinfat_event_class_t;
+
 #endif
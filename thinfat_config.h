@@ -9,6 +9,70 @@
 
 #define THINFAT_CONFIG_ENABLE_LFN (1)
 
+#ifndef THINFAT_CONFIG_ENABLE_INFO
+#define THINFAT_CONFIG_ENABLE_INFO (1)
+#endif
+
+#define THINFAT_CONFIG_MAX_SECTOR_SIZE (4096)
+#define THINFAT_CONFIG_PHY_QUEUE_DEPTH (32)
+#define THINFAT_CONFIG_PHY_MERGE_LIMIT (64)
+#define THINFAT_CONFIG_MAX_SEGMENTS (4)
+#define THINFAT_CONFIG_FLASH_MAX_OPEN_UNITS (8)
+//Runs of contiguous clusters each open chain remembers, the latest ones first
+#define THINFAT_CONFIG_BLK_EXTENTS (16)
+//Largest transfer, in bytes, BLK makes of a contiguous run of clusters; a bigger cluster still goes in one
+#define THINFAT_CONFIG_BLK_MAX_TRANSFER (262144)
+
+//One bit per cluster telling which are free, built by scanning the FAT at mount; 0 leaves allocation to read the FAT
+#ifndef THINFAT_CONFIG_ENABLE_FREE_BITMAP
+#define THINFAT_CONFIG_ENABLE_FREE_BITMAP (1)
+#endif
+//Bytes of FAT the mount-time scan reads at a time, and slices of the FAT it reads side by side
+#define THINFAT_CONFIG_TABLE_SCAN_SIZE (16384)
+#define THINFAT_CONFIG_TABLE_SCAN_STREAMS (4)
+//Free extents the allocator indexes at most, the longest ones when there are more, and pieces one allocation may be split into
+#define THINFAT_CONFIG_FREE_EXTENTS (4096)
+#define THINFAT_CONFIG_ALLOC_PIECES (8)
+//Clusters of a chain being freed that are gathered and sorted without the free-cluster bitmap. Each batch rewrites
+//the FAT sectors it touches in order, so a fragmented chain longer than this takes several passes over them
+#define THINFAT_CONFIG_FREE_BATCH (4096)
+#ifndef THINFAT_CONFIG_ALLOC_BEST_FIT
+#define THINFAT_CONFIG_ALLOC_BEST_FIT (1)
+#endif
+//FAT entries are scanned with SSE2 or AVX2 when the compiler targets x86 and the CPU has them
+#ifndef THINFAT_CONFIG_ENABLE_SIMD
+#define THINFAT_CONFIG_ENABLE_SIMD (1)
+#endif
+
+//Default budget of the shared sector cache: total lines, then the minimum and maximum of each class
+#define THINFAT_CONFIG_CACHE_LINES (48)
+#define THINFAT_CONFIG_TABLE_CACHE_MIN (8)
+#define THINFAT_CONFIG_TABLE_CACHE_MAX (40)
+#define THINFAT_CONFIG_DIR_CACHE_MIN (2)
+#define THINFAT_CONFIG_DIR_CACHE_MAX (16)
+#define THINFAT_CONFIG_FILE_CACHE_MIN (2)
+#define THINFAT_CONFIG_FILE_CACHE_MAX (8)
+
+//Whether FAT copies other than the first wait for sync, rather than being written with the first; see thinfat_set_mirror_policy()
+#ifndef THINFAT_CONFIG_DEFER_FAT_MIRRORS
+#define THINFAT_CONFIG_DEFER_FAT_MIRRORS (0)
+#endif
+//Deferred mirrors are brought up to date this many sectors at a time
+#define THINFAT_CONFIG_MIRROR_RUN (16)
+
+//The PHY worker writes back cache lines dirty for this long, or all of them once its queue has been empty this long; 0 turns either off
+#define THINFAT_CONFIG_FLUSH_EXPIRE_MS (500)
+#define THINFAT_CONFIG_FLUSH_IDLE_MS (50)
+
+#ifndef THINFAT_CONFIG_ENABLE_PHY_STATS
+#define THINFAT_CONFIG_ENABLE_PHY_STATS (1)
+#endif
+#define THINFAT_CONFIG_PHY_LATENCY_BUCKETS (24)
+
+#ifndef THINFAT_CONFIG_ENABLE_URING
+#define THINFAT_CONFIG_ENABLE_URING (0)
+#endif
+
 #if THINFAT_CONFIG_ENABLE_LFN
 #include "wchar.h"
 #if __SIZEOF_WCHAR_T__ != 2
@@ -45,7 +45,7 @@ static size_t thinfat_wstrlen(const wchar_t *str)
 
 static inline thinfat_sector_t thinfat_root_sector_count(thinfat_t *tf)
 {
-  return (tf->root_entry_count * 32 + THINFAT_SECTOR_SIZE - 1) / THINFAT_SECTOR_SIZE;
+  return thinfat_btos(tf, tf->root_entry_count * 32 + tf->sz_sector - 1);
 }
 
 static thinfat_dir_entry_t *thinfat_decode_dir_entry(uint8_t *src, thinfat_dir_entry_t *dest)
@@ -116,7 +116,7 @@ static thinfat_result_t thinfat_dir_dump_callback(thinfat_dir_t *dir, void *entr
   }
   else
   {
-    for (unsigned int i = 0; i < THINFAT_SECTOR_SIZE / 32; i++)
+    for (unsigned int i = 0; i < dir->parent->sz_sector / 32; i++)
     {
       thinfat_dir_entry_t entry;
       thinfat_decode_dir_entry((uint8_t *)entries + i * 32, &entry);
@@ -151,7 +151,7 @@ static thinfat_result_t thinfat_dir_find_callback(thinfat_dir_t *dir, void *entr
   }
   else
   {
-    for (unsigned int i = 0; i < THINFAT_SECTOR_SIZE / 32; i++)
+    for (unsigned int i = 0; i < dir->parent->sz_sector / 32; i++)
     {
       thinfat_dir_entry_t entry;
       thinfat_decode_dir_entry((uint8_t *)entries + i * 32, &entry);
@@ -184,7 +184,7 @@ static thinfat_result_t thinfat_dir_find_by_longname_callback(thinfat_dir_t *dir
   }
   else
   {
-    for (unsigned int i = 0; i < THINFAT_SECTOR_SIZE / 32; i++)
+    for (unsigned int i = 0; i < dir->parent->sz_sector / 32; i++)
     {
       thinfat_dir_entry_t entry;
       thinfat_decode_dir_entry((uint8_t *)entries + i * 32, &entry);
@@ -2,13 +2,17 @@
 #include "thinfat_file.h"
 #include "thinfat_cache.h"
 
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 static thinfat_result_t thinfat_file_read_prepare_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param);
 static thinfat_result_t thinfat_file_read_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param);
 static thinfat_result_t thinfat_file_write_prepare_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param);
 static thinfat_result_t thinfat_file_write_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param);
-static thinfat_result_t thinfat_file_write_finish_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param);
+static thinfat_result_t thinfat_file_flush_extended_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param);
+static thinfat_result_t thinfat_file_flush_written_callback(thinfat_file_t *file);
+static thinfat_result_t thinfat_file_write_delayed(thinfat_file_t *file);
 
 thinfat_result_t thinfat_file_callback(thinfat_file_t *file, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param)
 {
@@ -22,143 +26,264 @@ thinfat_result_t thinfat_file_callback(thinfat_file_t *file, thinfat_core_event_
     return thinfat_file_write_prepare_callback(file, s_param, p_param);
   case THINFAT_FILE_EVENT_WRITE:
     return thinfat_file_write_callback(file, s_param, p_param);
-  case THINFAT_FILE_EVENT_WRITE_FINISH:
-    return thinfat_file_write_finish_callback(file, s_param, p_param);
+  case THINFAT_FILE_EVENT_FLUSH_EXTENDED:
+    return thinfat_file_flush_extended_callback(file, s_param, p_param);
+  case THINFAT_FILE_EVENT_FLUSH_WRITTEN:
+    return thinfat_file_flush_written_callback(file);
   }
   return THINFAT_RESULT_OK;
 }
 
+static inline bool thinfat_file_has_head_edge(thinfat_file_t *file)
+{
+  return thinfat_sector_offset(file->parent, file->position) > 0 || file->advance < file->parent->sz_sector;
+}
+
+static inline bool thinfat_file_has_tail_edge(thinfat_file_t *file)
+{
+  thinfat_size_t end = thinfat_sector_offset(file->parent, file->position) + file->advance;
+  return end > file->parent->sz_sector && thinfat_sector_offset(file->parent, end) > 0;
+}
+
+static void thinfat_file_advance(thinfat_file_t *file, thinfat_size_t advance)
+{
+  file->buffer = (uint8_t *)file->buffer + advance;
+  file->advance -= advance;
+  file->position += advance;
+  file->counter += advance;
+  //Writes past the end grow the file
+  if (file->position > file->size)
+    file->size = file->position;
+}
+
+/*
+ * The whole request is read in one go: whole sectors land in the client's
+ * buffer, and partial sectors at either edge go through the file's two edge
+ * buffers.
+ */
 static thinfat_result_t thinfat_file_read_prepare_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param)
 {
-  thinfat_sector_t sc_read = ((file->position % THINFAT_SECTOR_SIZE) + file->advance + THINFAT_SECTOR_SIZE - 1) / THINFAT_SECTOR_SIZE;
+  thinfat_t *tf = file->parent;
+  thinfat_segment_t segments[3];
+  unsigned int nc_segments = 0;
+  thinfat_size_t so_head = thinfat_sector_offset(tf, file->position);
+  thinfat_sector_t sc_read = thinfat_btos(tf, so_head + file->advance + tf->sz_sector - 1);
+  uint8_t *middle = (uint8_t *)file->buffer;
+  (void)s_param;
+  (void)p_param;
 
-  return thinfat_blk_read_each_cluster(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, sc_read, THINFAT_FILE_EVENT_READ);
+  if (thinfat_file_has_head_edge(file))
+  {
+    segments[nc_segments].data = file->edge;
+    segments[nc_segments++].sc_data = 1;
+    middle += tf->sz_sector - so_head;
+    sc_read--;
+  }
+  if (thinfat_file_has_tail_edge(file))
+    sc_read--;
+  if (sc_read > 0)
+  {
+    segments[nc_segments].data = middle;
+    segments[nc_segments++].sc_data = sc_read;
+  }
+  if (thinfat_file_has_tail_edge(file))
+  {
+    segments[nc_segments].data = file->edge + tf->sz_sector;
+    segments[nc_segments++].sc_data = 1;
+  }
+
+  return thinfat_blk_read_each_cluster(file, &file->blk, thinfat_btos(tf, file->position), segments, nc_segments, THINFAT_FILE_EVENT_READ);
 }
 
+//s_param holds the number of sectors read, which falls short at the end of the chain.
 static thinfat_result_t thinfat_file_read_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param)
 {
-  if (p_param == NULL)
+  thinfat_t *tf = file->parent;
+  thinfat_size_t so_head = thinfat_sector_offset(tf, file->position);
+  thinfat_size_t advance = thinfat_stob(tf, s_param) > so_head ? thinfat_stob(tf, s_param) - so_head : 0;
+  (void)p_param;
+
+  if (advance > file->advance)
+    advance = file->advance;
+  if (advance > 0 && thinfat_file_has_head_edge(file))
+  {
+    thinfat_size_t sz_head = tf->sz_sector - so_head < advance ? tf->sz_sector - so_head : advance;
+    memcpy(file->buffer, file->edge + so_head, sz_head);
+  }
+  if (advance == file->advance && thinfat_file_has_tail_edge(file))
+  {
+    thinfat_size_t sz_tail = thinfat_sector_offset(tf, so_head + advance);
+    memcpy((uint8_t *)file->buffer + advance - sz_tail, file->edge + tf->sz_sector, sz_tail);
+  }
+  thinfat_file_advance(file, advance);
+  THINFAT_INFO("Read callback: " TFF_U32 " bytes\n", advance);
+  return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
+}
+
+/*
+ * Writes proceed edge by edge: a partial sector is patched in the cache and
+ * left dirty, and every run of whole sectors is written straight from the
+ * client's buffer.
+ */
+static thinfat_result_t thinfat_file_write_next(thinfat_file_t *file)
+{
+  thinfat_t *tf = file->parent;
+  if (file->advance == 0)
   {
     return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
   }
-  else if (*(void **)p_param == NULL)
+  else if (thinfat_file_has_head_edge(file))
   {
-    if (file->position % THINFAT_SECTOR_SIZE == 0)
-    {
-      *(void **)p_param = file->buffer;
-    }
-    else
-    {
-      *(void **)p_param = file->blk.cache->data;
-    }
+    return thinfat_blk_read_each_sector(file, &file->blk, thinfat_btos(tf, file->position), 1, THINFAT_FILE_EVENT_WRITE_PREPARE);
   }
   else
   {
-    size_t advance;
-    if (file->position % THINFAT_SECTOR_SIZE > 0)
-    {
-      advance = THINFAT_SECTOR_SIZE - (file->position % THINFAT_SECTOR_SIZE);
-      if (advance > file->advance)
-      {
-        advance = file->advance;
-      }
-      memcpy(file->buffer, (uint8_t *)*(void **)p_param + (file->position % THINFAT_SECTOR_SIZE), advance);
-    }
-    else
-    {
-      advance = THINFAT_SECTOR_SIZE;
-      if (advance > file->advance)
-      {
-        advance = file->advance;
-        memcpy(file->buffer, *(void **)p_param, advance);
-      }
-    }
-    file->buffer = (uint8_t *)file->buffer + advance;
-    file->advance -= advance;
-    file->position += advance;
-    file->counter += advance;
-    if (file->advance >= THINFAT_SECTOR_SIZE)
-    {
-      *(void **)p_param = file->buffer;
-    }
-    else
-    {
-      *(void **)p_param = file->blk.cache->data;
-    }
+    thinfat_segment_t segment;
+    segment.data = file->buffer;
+    segment.sc_data = thinfat_btos(tf, file->advance);
+    return thinfat_blk_write_each_cluster(file, &file->blk, thinfat_btos(tf, file->position), &segment, 1, THINFAT_FILE_EVENT_WRITE);
   }
-  THINFAT_INFO("Read callback @ " TFF_X32 " = %p\n", s_param, *(void **)p_param);
-  return THINFAT_RESULT_OK;
 }
 
 static thinfat_result_t thinfat_file_write_prepare_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param)
 {
-  thinfat_sector_t sc_write = ((file->position % THINFAT_SECTOR_SIZE) + file->advance) / THINFAT_SECTOR_SIZE;
-  size_t advance = THINFAT_SECTOR_SIZE - (file->position % THINFAT_SECTOR_SIZE);
-  /*if (advance > tf->cur_file->byte_advance)
-    {
-    advance = tf->cur_file->byte_advance;
-    }*/
-  memcpy(*(uint8_t **)p_param + (file->position % THINFAT_SECTOR_SIZE), file->buffer, advance);
-  //thinfat_cache_touch(tf->cur_file->cache);
-  return thinfat_blk_write_each_cluster(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, sc_write, THINFAT_FILE_EVENT_WRITE);
+  thinfat_result_t res;
+  thinfat_size_t so_head = thinfat_sector_offset(file->parent, file->position);
+  thinfat_size_t advance = file->parent->sz_sector - so_head;
+  (void)s_param;
+
+  //The chain ended before the sector could be read
+  if (p_param == NULL)
+  {
+    return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
+  }
+
+  if (advance > file->advance)
+  {
+    advance = file->advance;
+  }
+  memcpy((uint8_t *)p_param + so_head, file->buffer, advance);
+  thinfat_cache_touch(file->blk.cache);
+  thinfat_file_advance(file, advance);
+
+  //The BLK layer is done with this sector, so it may take the next request right away
+  res = thinfat_file_write_next(file);
+  return res == THINFAT_RESULT_OK ? THINFAT_RESULT_ABORT : res;
 }
 
+//s_param holds the number of sectors written, which falls short at the end of the chain.
 static thinfat_result_t thinfat_file_write_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param)
 {
-  if (p_param == NULL)
+  thinfat_sector_t sc_write = thinfat_btos(file->parent, file->advance);
+  (void)p_param;
+
+  thinfat_file_advance(file, thinfat_stob(file->parent, s_param));
+  if (s_param < sc_write)
   {
-    size_t advance = THINFAT_SECTOR_SIZE - (file->position % THINFAT_SECTOR_SIZE);
-    file->position += advance;
-    file->advance -= advance;
-    file->counter += advance;
-    file->buffer = (uint8_t *)file->buffer + advance;
-    if (file->advance > 0)
-    {
-      return thinfat_blk_read_each_sector(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, 1, THINFAT_FILE_EVENT_WRITE_FINISH);
-    }
     return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
   }
-  else if (*(void **)p_param == NULL)
+  return thinfat_file_write_next(file);
+}
+
+static thinfat_result_t thinfat_file_read_start(thinfat_file_t *file)
+{
+  if (file->advance == 0)
   {
-    if (file->position % THINFAT_SECTOR_SIZE == 0)
-    {
-      *(void **)p_param = file->buffer;
-    }
-    else
-    {
-      *(void **)p_param = file->blk.cache->data;
-    }
+    return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
+  }
+  //Dirty sectors have to reach the device before they are read back around the cache
+  else if (thinfat_cache_is_dirty(file->blk.cache))
+  {
+    return thinfat_cached_read_single(file, file->blk.cache, THINFAT_INVALID_SECTOR, THINFAT_FILE_EVENT_READ_PREPARE);
   }
   else
   {
-    size_t advance = THINFAT_SECTOR_SIZE - (file->position % THINFAT_SECTOR_SIZE);
-    file->position += advance;
-    file->advance -= advance;
-    file->counter += advance;
-    file->buffer = (uint8_t *)file->buffer + advance;
-    *(void **)p_param = file->buffer;
+    return thinfat_file_read_prepare_callback(file, THINFAT_INVALID_SECTOR, NULL);
   }
-  THINFAT_INFO("Write callback @ " TFF_X32 " = %p\n", s_param, *(void **)p_param);
-  return THINFAT_RESULT_OK;
 }
 
-static thinfat_result_t thinfat_file_write_finish_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param)
+static void thinfat_file_save(thinfat_file_t *file, thinfat_file_request_t *request)
 {
-  size_t advance = THINFAT_SECTOR_SIZE - (file->position % THINFAT_SECTOR_SIZE);
-  if (advance > file->advance)
+  request->client = file->client;
+  request->event = file->event;
+  request->buffer = file->buffer;
+  request->advance = file->advance;
+  request->counter = file->counter;
+  request->position = file->position;
+}
+
+static void thinfat_file_restore(thinfat_file_t *file, const thinfat_file_request_t *request)
+{
+  file->client = request->client;
+  file->event = request->event;
+  file->buffer = request->buffer;
+  file->advance = request->advance;
+  file->counter = request->counter;
+  //Puts the BLK layer back too, if the flush has left it past the position
+  thinfat_file_seek(file, request->position);
+}
+
+/*
+ * Gives the pending data its clusters, now that its extent is known, and
+ * writes it out; then goes on with the request in progress as `kind` says.
+ */
+static thinfat_result_t thinfat_file_flush_pending(thinfat_file_t *file, thinfat_file_resume_t kind)
+{
+  thinfat_file_save(file, &file->resume);
+  file->resume_kind = kind;
+  return thinfat_file_preallocate(file, file, file->so_pending + file->sz_pending, THINFAT_FILE_EVENT_FLUSH_EXTENDED);
+}
+
+/*
+ * Carries on with the request the flush interrupted, or fails it if the
+ * pending data could not be written out; a flush on its own calls back as
+ * thinfat_file_flush() says.
+ */
+static thinfat_result_t thinfat_file_resume(thinfat_file_t *file, thinfat_result_t result)
+{
+  thinfat_file_restore(file, &file->resume);
+  if (result != THINFAT_RESULT_OK)
   {
-    advance = file->advance;
+    if (file->resume_kind == THINFAT_FILE_RESUME_NONE)
+      return thinfat_core_callback(file->client, file->event, result, NULL);
+    return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
+  }
+  switch (file->resume_kind)
+  {
+  case THINFAT_FILE_RESUME_READ:
+    return thinfat_file_read_start(file);
+  case THINFAT_FILE_RESUME_WRITE:
+    return thinfat_file_write_delayed(file);
+  default:
+    return thinfat_core_callback(file->client, file->event, file->cc_flushed, &file->blk.ci_head);
   }
-  memcpy(*(uint8_t **)p_param + (file->position % THINFAT_SECTOR_SIZE), file->buffer, advance);
-  file->position += advance;
-  file->counter += advance;
-  thinfat_cache_touch(file->blk.cache);
-  return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
+}
+
+static thinfat_result_t thinfat_file_flush_extended_callback(thinfat_file_t *file, thinfat_sector_t s_param, void *p_param)
+{
+  //No room for the pending data; it stays pending, with why for s_param
+  if (p_param == NULL)
+    return thinfat_file_resume(file, (thinfat_result_t)s_param);
+  file->cc_flushed = s_param;
+  thinfat_file_seek(file, file->so_pending);
+  file->client = file;
+  file->event = THINFAT_FILE_EVENT_FLUSH_WRITTEN;
+  file->buffer = file->pending;
+  file->advance = file->sz_pending;
+  file->counter = 0;
+  return thinfat_file_write_next(file);
+}
+
+static thinfat_result_t thinfat_file_flush_written_callback(thinfat_file_t *file)
+{
+  if (file->counter != file->sz_pending)
+    return thinfat_file_resume(file, THINFAT_RESULT_PHY_ERROR);
+  file->sz_pending = 0;
+  return thinfat_file_resume(file, THINFAT_RESULT_OK);
 }
 
 thinfat_result_t thinfat_file_read(void *client, thinfat_file_t *file, void *buf, thinfat_size_t size, thinfat_core_event_t event)
 {
-  thinfat_sector_t sc_read = ((file->position % THINFAT_SECTOR_SIZE) + size + THINFAT_SECTOR_SIZE - 1) / THINFAT_SECTOR_SIZE;
   if (size > file->size - file->position)
     size = file->size - file->position;
 
@@ -168,55 +293,140 @@ thinfat_result_t thinfat_file_read(void *client, thinfat_file_t *file, void *buf
   file->event = event;
   file->client = client;
 
-  if (file->position % THINFAT_SECTOR_SIZE > 0 || (file->position + size) % THINFAT_SECTOR_SIZE > 0)
-  {
-    return thinfat_cached_read_single(file, file->blk.cache, THINFAT_INVALID_SECTOR, THINFAT_FILE_EVENT_READ_PREPARE);
-  }
-  else
+  //What is still pending has to reach the device before anything is read
+  if (file->sz_pending > 0 && size > 0)
+    return thinfat_file_flush_pending(file, THINFAT_FILE_RESUME_READ);
+  return thinfat_file_read_start(file);
+}
+
+/*
+ * With delayed allocation, writes only gather in the pending buffer, as
+ * long as each carries on where the last left off. It is flushed when it
+ * is full, or when a write goes elsewhere, so that the clusters for it are
+ * picked all at once, in as few runs as its whole size takes.
+ */
+static thinfat_result_t thinfat_file_write_delayed(thinfat_file_t *file)
+{
+  while (file->advance > 0)
   {
-    return thinfat_blk_read_each_cluster(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, sc_read, THINFAT_FILE_EVENT_READ);
+    thinfat_size_t advance = file->sz_pending_max - file->sz_pending;
+    if (file->sz_pending > 0 && (advance == 0 || file->position != file->so_pending + file->sz_pending))
+      return thinfat_file_flush_pending(file, THINFAT_FILE_RESUME_WRITE);
+    if (file->sz_pending == 0)
+    {
+      file->so_pending = file->position;
+      file->size_flushed = file->size;
+    }
+    if (advance > file->advance)
+      advance = file->advance;
+    memcpy(file->pending + file->sz_pending, file->buffer, advance);
+    file->sz_pending += advance;
+    thinfat_file_advance(file, advance);
   }
+  return thinfat_core_callback(file->client, file->event, THINFAT_INVALID_SECTOR, &file->counter);
 }
 
 thinfat_result_t thinfat_file_write(void *client, thinfat_file_t *file, const void *buf, thinfat_size_t size, thinfat_core_event_t event)
 {
-  thinfat_sector_t sc_write = ((file->position % THINFAT_SECTOR_SIZE) + size + THINFAT_SECTOR_SIZE - 1) / THINFAT_SECTOR_SIZE;
-
   file->advance = size;
   file->counter = 0;
   file->buffer = (void *)buf;
   file->event = event;
   file->client = client;
 
-  if ((file->position + size) % THINFAT_SECTOR_SIZE > 0)
-  {
-    sc_write--;
-  }
-  if (sc_write > 0)
+  if (file->sz_pending_max > 0)
+    return thinfat_file_write_delayed(file);
+  return thinfat_file_write_next(file);
+}
+
+/*
+ * Turns delayed allocation on with a pending buffer of sz_buffer bytes, or
+ * off with 0. Whatever is pending has to be flushed or discarded first.
+ */
+thinfat_result_t thinfat_file_set_delayed(thinfat_file_t *file, thinfat_size_t sz_buffer)
+{
+  uint8_t *pending;
+  if (file->sz_pending > 0)
+    return THINFAT_RESULT_FILE_PENDING;
+  if (sz_buffer == 0)
   {
-    if (file->position % THINFAT_SECTOR_SIZE == 0)
-    {
-      return thinfat_blk_write_each_cluster(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, sc_write, THINFAT_FILE_EVENT_WRITE);
-    }
-    else
-    {
-      return thinfat_blk_read_each_sector(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, 1, THINFAT_FILE_EVENT_WRITE_PREPARE);
-    }
+    free(file->pending);
+    file->pending = NULL;
   }
+  else if ((pending = (uint8_t *)realloc(file->pending, sz_buffer)) != NULL)
+    file->pending = pending;
   else
-  {
-    return thinfat_blk_read_each_sector(file, &file->blk, file->position / THINFAT_SECTOR_SIZE, 1, THINFAT_FILE_EVENT_WRITE_FINISH);
-  }
+    return THINFAT_RESULT_UNSUPPORTED;
+  file->sz_pending_max = sz_buffer;
+  return THINFAT_RESULT_OK;
+}
+
+/*
+ * Writes out what delayed allocation holds back. Calls back as
+ * thinfat_file_preallocate() does, with the number of clusters added and a
+ * pointer to the head of the chain, new if the file was empty, for the
+ * caller to record. On failure the callback gets NULL, and why for s_param;
+ * the data stays pending until flushed again or discarded.
+ */
+thinfat_result_t thinfat_file_flush(void *client, thinfat_file_t *file, thinfat_core_event_t event)
+{
+  file->client = client;
+  file->event = event;
+  file->counter = 0;
+  file->advance = 0;
+  file->cc_flushed = 0;
+  if (file->sz_pending == 0)
+    return thinfat_core_callback(client, event, 0, &file->blk.ci_head);
+  return thinfat_file_flush_pending(file, THINFAT_FILE_RESUME_NONE);
+}
+
+//Drops the pending data unwritten, and the size it had grown the file by, so that the file can be opened or written again.
+thinfat_result_t thinfat_file_discard(thinfat_file_t *file)
+{
+  if (file->sz_pending == 0)
+    return THINFAT_RESULT_OK;
+  file->sz_pending = 0;
+  file->size = file->size_flushed;
+  if (file->position > file->size)
+    return thinfat_file_seek(file, file->size);
+  return THINFAT_RESULT_OK;
 }
 
 thinfat_result_t thinfat_file_init(thinfat_file_t *file, thinfat_t *parent, thinfat_cache_t *cache)
 {
   file->parent = parent;
+  //Head and tail edges of a read, one sector each
+  if ((file->edge = (uint8_t *)malloc(2 * parent->sz_sector)) == NULL)
+    return THINFAT_RESULT_UNSUPPORTED;
+  file->pending = NULL;
+  file->sz_pending = 0;
+  file->sz_pending_max = 0;
   return thinfat_blk_init(&file->blk, parent, cache);
 }
 
+//Sizes the edge buffers for the parent's current sector size.
+thinfat_result_t thinfat_file_resize(thinfat_file_t *file)
+{
+  uint8_t *edge = (uint8_t *)realloc(file->edge, 2 * file->parent->sz_sector);
+  if (edge == NULL)
+    return THINFAT_RESULT_UNSUPPORTED;
+  file->edge = edge;
+  return THINFAT_RESULT_OK;
+}
+
+void thinfat_file_finalize(thinfat_file_t *file)
+{
+  free(file->edge);
+  file->edge = NULL;
+  free(file->pending);
+  file->pending = NULL;
+  file->sz_pending_max = 0;
+}
+
 thinfat_result_t thinfat_file_open(thinfat_file_t *file, const thinfat_dir_entry_t *entry)
 {
+  if (file->sz_pending > 0)
+    return THINFAT_RESULT_FILE_PENDING;
   file->counter = 0;
   file->advance = 0;
   file->position = 0;
@@ -224,3 +434,32 @@ thinfat_result_t thinfat_file_open(thinfat_file_t *file, const thinfat_dir_entry
   file->buffer = NULL;
   return thinfat_blk_open(&file->blk, entry->ci_head);
 }
+
+/*
+ * Reserves room for the file to reach `size` bytes, so that writes up to
+ * there find their clusters already linked and mapped. The directory entry
+ * is left alone: an empty file gets a new head, passed to the callback as
+ * with thinfat_blk_extend(), for the caller to record there.
+ */
+thinfat_result_t thinfat_file_preallocate(void *client, thinfat_file_t *file, thinfat_size_t size, thinfat_core_event_t event)
+{
+  thinfat_t *tf = file->parent;
+  thinfat_sector_t sc_size = thinfat_btos(tf, size) + (thinfat_sector_offset(tf, size) > 0);
+  return thinfat_blk_extend(client, &file->blk, (sc_size + (1 << tf->ctos_shift) - 1) >> tf->ctos_shift, event);
+}
+
+/*
+ * Moves the position the next read or write starts at. Going forward, that
+ * call walks the chain on from where the last one left it; going back, from
+ * the head, with the clusters already walked coming from the extent map.
+ */
+thinfat_result_t thinfat_file_seek(thinfat_file_t *file, thinfat_off_t position)
+{
+  thinfat_t *tf = file->parent;
+  if (position > file->size)
+    return THINFAT_RESULT_EOF;
+  if (thinfat_btos(tf, position) >> tf->ctos_shift < file->blk.so_current >> tf->ctos_shift)
+    thinfat_blk_rewind(&file->blk);
+  file->position = position;
+  return THINFAT_RESULT_OK;
+}
@@ -13,6 +13,26 @@
 struct thinfat_tag;
 struct thinfat_dir_entry_tag;
 
+//What a flush of pending data goes on with once it is done
+typedef enum
+{
+  THINFAT_FILE_RESUME_NONE = 0,
+  THINFAT_FILE_RESUME_READ,
+  THINFAT_FILE_RESUME_WRITE
+}
+thinfat_file_resume_t;
+
+//A read or write request as far as it has got
+typedef struct thinfat_file_request_tag
+{
+  void *client;
+  thinfat_core_event_t event;
+  void *buffer;
+  thinfat_size_t advance, counter;
+  thinfat_off_t position;
+}
+thinfat_file_request_t;
+
 typedef struct thinfat_file_tag
 {
   void *client;
@@ -23,14 +43,32 @@ typedef struct thinfat_file_tag
   void *buffer;
   thinfat_core_event_t event;
   thinfat_blk_t blk;
+  uint8_t *edge;
+  //Delayed allocation: sz_pending bytes written from so_pending on that have no clusters yet, up to sz_pending_max
+  uint8_t *pending;
+  thinfat_off_t so_pending;
+  thinfat_size_t sz_pending, sz_pending_max;
+  //The file's size before the pending data, and the clusters the last flush added
+  thinfat_size_t size_flushed;
+  thinfat_cluster_t cc_flushed;
+  //The request a flush of the pending data interrupted
+  thinfat_file_request_t resume;
+  thinfat_file_resume_t resume_kind;
 }
 thinfat_file_t;
 
 thinfat_result_t thinfat_file_callback(thinfat_file_t *file, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param);
 
 thinfat_result_t thinfat_file_init(thinfat_file_t *file, struct thinfat_tag *parent, struct thinfat_cache_tag *cache);
+thinfat_result_t thinfat_file_resize(thinfat_file_t *file);
+void thinfat_file_finalize(thinfat_file_t *file);
 thinfat_result_t thinfat_file_open(thinfat_file_t *file, const struct thinfat_dir_entry_tag *entry);
+thinfat_result_t thinfat_file_preallocate(void *client, thinfat_file_t *file, thinfat_size_t size, thinfat_core_event_t event);
+thinfat_result_t thinfat_file_seek(thinfat_file_t *file, thinfat_off_t position);
 thinfat_result_t thinfat_file_read(void *client, thinfat_file_t *file, void *buf, thinfat_size_t size, thinfat_core_event_t event);
 thinfat_result_t thinfat_file_write(void *client, thinfat_file_t *file, const void *buf, thinfat_size_t size, thinfat_core_event_t event);
+thinfat_result_t thinfat_file_set_delayed(thinfat_file_t *file, thinfat_size_t sz_buffer);
+thinfat_result_t thinfat_file_flush(void *client, thinfat_file_t *file, thinfat_core_event_t event);
+thinfat_result_t thinfat_file_discard(thinfat_file_t *file);
 
 #endif
@@ -18,30 +18,200 @@ typedef enum
   THINFAT_PHY_STATE_SINGLE_READ,
   THINFAT_PHY_STATE_SINGLE_WRITE,
   THINFAT_PHY_STATE_MULTIPLE_READ,
-  THINFAT_PHY_STATE_MULTIPLE_WRITE
+  THINFAT_PHY_STATE_MULTIPLE_WRITE,
+  THINFAT_PHY_STATE_VECTOR_READ,
+  THINFAT_PHY_STATE_VECTOR_WRITE,
+  THINFAT_PHY_STATE_MAX
 }
 thinfat_phy_state_t;
 
-typedef struct thinfat_phy_tag
+typedef struct thinfat_phy_request_tag
 {
   thinfat_phy_state_t state;
-  int fd;
-  void *mapped_block;
-  thinfat_sector_t si_mapped, sc_mapped;
+  void *client;
+  thinfat_core_event_t event;
   thinfat_sector_t si_req, sc_req;
   thinfat_sector_t sc_current;
+  thinfat_sector_t si_xfer, sc_xfer;
   void *block;
-  void *client;
-  thinfat_core_event_t event;
+  void *data;
+  void *buffer;
+  thinfat_sector_t sc_buffer;
+  void *copy;
+  thinfat_segment_t segments[THINFAT_CONFIG_MAX_SEGMENTS];
+  unsigned int nc_segments;
+  struct thinfat_phy_request_tag *leader;
+  unsigned int nc_members;
+  bool posted;
+  bool started;
+  bool pending;
+  thinfat_result_t result;
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  thinfat_event_class_t origin;
+  uint64_t ns_enqueued;
+#endif
+}
+thinfat_phy_request_t;
+
+typedef struct thinfat_phy_queue_stats_tag
+{
+  uint32_t nc_request;
+  uint32_t nc_transfer;
+  uint32_t nc_merged;
+  uint32_t depth_max;
+  uint64_t depth_sum;
+}
+thinfat_phy_queue_stats_t;
+
+/*!
+ * Requests of one type, timed from the moment they are queued until their
+ * client has been answered. latency[b] counts the requests that took
+ * [2^b, 2^(b+1)) microseconds; the first bucket also takes anything shorter
+ * and the last anything longer.
+ */
+typedef struct thinfat_phy_type_stats_tag
+{
+  uint32_t nc_request;
+  uint64_t sz_transferred;
+  uint64_t ns_total;
+  uint64_t ns_max;
+  uint32_t latency[THINFAT_CONFIG_PHY_LATENCY_BUCKETS];
+}
+thinfat_phy_type_stats_t;
+
+typedef struct thinfat_phy_stats_tag
+{
+  //Indexed by thinfat_phy_state_t; the IDLE entry stays empty
+  thinfat_phy_type_stats_t types[THINFAT_PHY_STATE_MAX];
+  uint32_t nc_class[THINFAT_CLASS_MAX];
+  uint64_t sz_class[THINFAT_CLASS_MAX];
+}
+thinfat_phy_stats_t;
+
+struct thinfat_phy_tag;
+struct thinfat_phy_flash_tag;
+
+/*!
+ * Housekeeping the worker thread runs under the lock between requests, such
+ * as writing back aged cache lines. It gets the time in milliseconds and how
+ * long the queue has been empty (0 while there is work), and returns how many
+ * milliseconds may pass before it is run again.
+ */
+typedef uint32_t (*thinfat_phy_tick_t)(void *arg, uint32_t ms_now, uint32_t ms_quiet);
+
+/*!
+ * Backend of the PHY layer. The common part in thinfat_phy_posix.c owns the
+ * request queue and the worker thread, and calls the driver to move sectors.
+ * map() returns the buffer the transfer (si_xfer, sc_xfer) is served through,
+ * read() and write() transfer it. A transfer may cover several adjacent
+ * requests merged by the elevator. Synchronous drivers complete the transfer
+ * before returning; asynchronous ones set req->pending and clear it from poll().
+ * A zero_copy driver hands single-sector reads to the client as a pointer
+ * into its own storage instead of copying them into the client's block.
+ */
+typedef struct thinfat_phy_driver_tag
+{
+  const char *name;
+  bool zero_copy;
+  thinfat_result_t (*open)(struct thinfat_phy_tag *phy, const char *devpath);
+  thinfat_result_t (*close)(struct thinfat_phy_tag *phy);
+  void *(*map)(struct thinfat_phy_tag *phy, thinfat_phy_request_t *req);
+  thinfat_result_t (*read)(struct thinfat_phy_tag *phy, thinfat_phy_request_t *req);
+  thinfat_result_t (*write)(struct thinfat_phy_tag *phy, thinfat_phy_request_t *req);
+  thinfat_result_t (*poll)(struct thinfat_phy_tag *phy);
+}
+thinfat_phy_driver_t;
+
+typedef struct thinfat_phy_tag
+{
+  const thinfat_phy_driver_t *driver;
+  thinfat_size_t sz_sector;
+  int fd;
+  //State private to the driver, set up by its open() and torn down by its close()
+  void *context;
+  thinfat_phy_request_t queue[THINFAT_CONFIG_PHY_QUEUE_DEPTH];
+  unsigned int rq_head, rq_count;
+  unsigned int rq_pending;
+  thinfat_sector_t si_elevator;
+  thinfat_phy_queue_stats_t queue_stats;
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  thinfat_phy_stats_t stats;
+#endif
+  struct thinfat_phy_flash_tag *flash;
+  thinfat_phy_tick_t tick;
+  void *tick_arg;
+  uint32_t ms_tick;
   pthread_t thread;
   pthread_mutex_t lock;
   pthread_cond_t cond;
+  pthread_cond_t wake;
   bool exit_flag;
   bool cb_flag;
   void *arg, *arg2;
 }
 thinfat_phy_t;
 
+extern const thinfat_phy_driver_t thinfat_phy_mmap_driver;
+extern const thinfat_phy_driver_t thinfat_phy_zerocopy_driver;
+extern const thinfat_phy_driver_t thinfat_phy_direct_driver;
+extern const thinfat_phy_driver_t thinfat_phy_ram_driver;
+#if THINFAT_CONFIG_ENABLE_URING
+extern const thinfat_phy_driver_t thinfat_phy_uring_driver;
+#endif
+
+/*!
+ * Cost model of an SD/eMMC card. The card writes whole pages, erases whole
+ * allocation units (AU) and keeps only a few AUs open for appending. Writing
+ * elsewhere closes an open AU, which copies its unwritten pages out of the old
+ * block and erases it, and opening an AU in the middle copies the pages before
+ * the write pointer. Pages and units are counted in sectors of
+ * THINFAT_SECTOR_SIZE bytes whatever the sector size of the volume.
+ */
+typedef struct thinfat_phy_flash_config_tag
+{
+  thinfat_sector_t sc_page;
+  thinfat_sector_t sc_unit;
+  unsigned int nc_open_units;
+  uint32_t us_command;
+  uint32_t us_transfer;
+  uint32_t us_page_read;
+  uint32_t us_page_program;
+  uint32_t us_erase;
+  //Sleeps for the simulated time, so that the queue sees the card's latency
+  bool throttle;
+}
+thinfat_phy_flash_config_t;
+
+//Sector counts are in THINFAT_SECTOR_SIZE units, as in the configuration
+typedef struct thinfat_phy_flash_stats_tag
+{
+  uint32_t nc_read, nc_write;
+  uint64_t sc_read, sc_written;
+  uint64_t nc_page_read;
+  uint64_t nc_page_programmed;
+  uint64_t nc_page_copied;
+  uint32_t nc_unit_opened;
+  uint32_t nc_erase;
+  uint64_t us_busy;
+  uint32_t us_max;
+}
+thinfat_phy_flash_stats_t;
+
+typedef struct thinfat_phy_flash_tag
+{
+  thinfat_phy_driver_t driver;
+  const thinfat_phy_driver_t *backing;
+  thinfat_phy_flash_config_t config;
+  thinfat_phy_flash_stats_t stats;
+  thinfat_sector_t si_unit[THINFAT_CONFIG_FLASH_MAX_OPEN_UNITS];
+  thinfat_sector_t sc_filled[THINFAT_CONFIG_FLASH_MAX_OPEN_UNITS];
+  uint32_t used[THINFAT_CONFIG_FLASH_MAX_OPEN_UNITS];
+  uint32_t clock;
+}
+thinfat_phy_flash_t;
+
+extern const thinfat_phy_flash_config_t thinfat_phy_flash_default_config;
+
 typedef struct thinfat_time_tag
 {
   union
@@ -68,8 +238,12 @@ typedef struct thinfat_time_tag
 thinfat_time_t;
 
 thinfat_result_t thinfat_core_callback(void *client, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param);
+thinfat_event_class_t thinfat_core_classify(void *client, thinfat_core_event_t event);
 
-thinfat_result_t thinfat_phy_initialize(thinfat_phy_t *phy, const char *devpath);
+thinfat_result_t thinfat_phy_initialize(thinfat_phy_t *phy, const thinfat_phy_driver_t *driver, const char *devpath);
+thinfat_result_t thinfat_phy_initialize_ram(thinfat_phy_t *phy, void *image, size_t size);
+void thinfat_phy_setup(thinfat_phy_t *phy, const thinfat_phy_driver_t *driver);
+thinfat_result_t thinfat_phy_set_sector_size(thinfat_phy_t *phy, thinfat_size_t sz_sector);
 thinfat_result_t thinfat_phy_schedule(thinfat_phy_t *phy);
 thinfat_result_t thinfat_phy_finalize(thinfat_phy_t *phy);
 bool thinfat_phy_is_idle(thinfat_phy_t *phy);
@@ -77,7 +251,17 @@ thinfat_result_t thinfat_phy_read_single(void *client, thinfat_phy_t *phy, thinf
 thinfat_result_t thinfat_phy_write_single(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, void *block, thinfat_core_event_t event);
 thinfat_result_t thinfat_phy_read_multiple(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, thinfat_sector_t count, thinfat_core_event_t event);
 thinfat_result_t thinfat_phy_write_multiple(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, thinfat_sector_t count, thinfat_core_event_t event);
+thinfat_result_t thinfat_phy_read_vector(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event);
+thinfat_result_t thinfat_phy_write_vector(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event);
+thinfat_result_t thinfat_phy_post_single(thinfat_phy_t *phy, thinfat_sector_t sector, const void *block);
+void thinfat_phy_get_queue_stats(thinfat_phy_t *phy, thinfat_phy_queue_stats_t *stats);
+void thinfat_phy_get_stats(thinfat_phy_t *phy, thinfat_phy_stats_t *stats);
+void thinfat_phy_reset_stats(thinfat_phy_t *phy);
+uint64_t thinfat_phy_latency_percentile(const thinfat_phy_type_stats_t *stats, unsigned int percent);
+thinfat_result_t thinfat_phy_attach_flash(thinfat_phy_t *phy, thinfat_phy_flash_t *flash, const thinfat_phy_flash_config_t *config);
+void thinfat_phy_get_flash_stats(thinfat_phy_t *phy, thinfat_phy_flash_stats_t *stats);
 thinfat_result_t thinfat_phy_get_time(thinfat_phy_t *phy, thinfat_time_t *data);
+void thinfat_phy_set_tick(thinfat_phy_t *phy, thinfat_phy_tick_t tick, void *arg);
 
 thinfat_result_t thinfat_phy_start(thinfat_phy_t *phy);
 thinfat_result_t thinfat_phy_stop(thinfat_phy_t *phy);
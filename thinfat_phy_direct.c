@@ -0,0 +1,90 @@
+/*!
+ * @file thinfat_phy_direct.c
+ * @brief O_DIRECT PHY driver for thinFAT <br>
+ *        Bypasses the page cache with one aligned pread/pwrite per request.
+ * @date 2017/02/06
+ * @author Hiroka IHARA
+ */
+#define _GNU_SOURCE
+#include "thinfat_phy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <unistd.h>
+
+#define THINFAT_PHY_DIRECT_ALIGNMENT (4096)
+
+static thinfat_result_t thinfat_phy_direct_open(thinfat_phy_t *phy, const char *devpath)
+{
+  phy->fd = open(devpath, O_RDWR | O_DIRECT);
+  if (phy->fd < 0)
+  {
+    THINFAT_ERROR("Failed to open %s with O_DIRECT.\n", devpath);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_phy_direct_close(thinfat_phy_t *phy)
+{
+  for (unsigned int i = 0; i < THINFAT_CONFIG_PHY_QUEUE_DEPTH; i++)
+  {
+    free(phy->queue[i].buffer);
+    phy->queue[i].buffer = NULL;
+    phy->queue[i].sc_buffer = 0;
+  }
+  return close(phy->fd) ? THINFAT_RESULT_PHY_ERROR : THINFAT_RESULT_OK;
+}
+
+//Every queue slot owns an aligned bounce buffer, grown to the largest transfer it has served.
+static void *thinfat_phy_direct_map(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  if (req->nc_segments == 1 && (uintptr_t)req->segments[0].data % THINFAT_PHY_DIRECT_ALIGNMENT == 0)
+    return req->segments[0].data;
+  if (req->sc_buffer < req->sc_xfer)
+  {
+    void *buffer;
+    thinfat_sector_t sc_buffer = (req->sc_xfer * phy->sz_sector + THINFAT_PHY_DIRECT_ALIGNMENT - 1) / THINFAT_PHY_DIRECT_ALIGNMENT * THINFAT_PHY_DIRECT_ALIGNMENT / phy->sz_sector;
+    if (posix_memalign(&buffer, THINFAT_PHY_DIRECT_ALIGNMENT, phy->sz_sector * sc_buffer) != 0)
+      return NULL;
+    free(req->buffer);
+    req->buffer = buffer;
+    req->sc_buffer = sc_buffer;
+  }
+  return req->buffer;
+}
+
+static thinfat_result_t thinfat_phy_direct_read(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  size_t size = phy->sz_sector * (size_t)req->sc_xfer;
+  if (pread(phy->fd, req->data, size, (off_t)phy->sz_sector * req->si_xfer) != (ssize_t)size)
+  {
+    THINFAT_ERROR("pread @ " TFF_X32 " * " TFF_U32 " failed.\n", req->si_xfer, req->sc_xfer);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_phy_direct_write(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  size_t size = phy->sz_sector * (size_t)req->sc_xfer;
+  if (pwrite(phy->fd, req->data, size, (off_t)phy->sz_sector * req->si_xfer) != (ssize_t)size)
+  {
+    THINFAT_ERROR("pwrite @ " TFF_X32 " * " TFF_U32 " failed.\n", req->si_xfer, req->sc_xfer);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  return THINFAT_RESULT_OK;
+}
+
+const thinfat_phy_driver_t thinfat_phy_direct_driver =
+{
+  "direct",
+  false,
+  thinfat_phy_direct_open,
+  thinfat_phy_direct_close,
+  thinfat_phy_direct_map,
+  thinfat_phy_direct_read,
+  thinfat_phy_direct_write,
+  NULL
+};
@@ -0,0 +1,217 @@
+/*!
+ * @file thinfat_phy_flash.c
+ * @brief Flash-latency simulation PHY for thinFAT <br>
+ *        Wraps another PHY driver and charges every transfer what it would
+ *        cost on an SD/eMMC card, so that allocator and cache changes can be
+ *        judged against flash behaviour without the hardware.
+ * @date 2017/02/09
+ * @author Hiroka IHARA
+ */
+#define _POSIX_C_SOURCE 199309L
+#include "thinfat_phy.h"
+
+#include <string.h>
+#include <time.h>
+
+//Roughly a class 10 SD card: 16KiB pages and 4MiB allocation units
+const thinfat_phy_flash_config_t thinfat_phy_flash_default_config =
+{
+  32,
+  8192,
+  2,
+  100,
+  20,
+  50,
+  800,
+  3000,
+  false
+};
+
+static thinfat_sector_t thinfat_phy_flash_pages(thinfat_phy_flash_t *flash, thinfat_sector_t sc)
+{
+  return (sc + flash->config.sc_page - 1) / flash->config.sc_page;
+}
+
+//Copies the pages of an open unit that were never written and erases its old block.
+static uint64_t thinfat_phy_flash_close_unit(thinfat_phy_flash_t *flash, unsigned int slot)
+{
+  thinfat_sector_t nc_pages = thinfat_phy_flash_pages(flash, flash->config.sc_unit);
+  thinfat_sector_t nc_copied = nc_pages - thinfat_phy_flash_pages(flash, flash->sc_filled[slot]);
+  flash->stats.nc_page_copied += nc_copied;
+  flash->stats.nc_page_programmed += nc_copied;
+  flash->stats.nc_erase++;
+  flash->used[slot] = 0;
+  return (uint64_t)nc_copied * (flash->config.us_page_read + flash->config.us_page_program) + flash->config.us_erase;
+}
+
+static unsigned int thinfat_phy_flash_find_unit(thinfat_phy_flash_t *flash, thinfat_sector_t si_unit)
+{
+  for (unsigned int i = 0; i < flash->config.nc_open_units; i++)
+    if (flash->used[i] != 0 && flash->si_unit[i] == si_unit)
+      return i;
+  return flash->config.nc_open_units;
+}
+
+//Cost of writing [si, si + sc) within a single allocation unit.
+static uint64_t thinfat_phy_flash_program(thinfat_phy_flash_t *flash, thinfat_sector_t si, thinfat_sector_t sc)
+{
+  const thinfat_phy_flash_config_t *config = &flash->config;
+  thinfat_sector_t si_unit = si - si % config->sc_unit, so = si - si_unit;
+  thinfat_sector_t pi_first = so / config->sc_page, pi_end = thinfat_phy_flash_pages(flash, so + sc);
+  thinfat_sector_t nc_copied = 0;
+  unsigned int slot = thinfat_phy_flash_find_unit(flash, si_unit);
+  uint64_t us = 0;
+
+  if (slot < config->nc_open_units && so >= flash->sc_filled[slot])
+  {
+    //Appending: the page holding the write pointer is still in the card's buffer
+    thinfat_sector_t pi_filled = thinfat_phy_flash_pages(flash, flash->sc_filled[slot]);
+    if (pi_first > pi_filled)
+      nc_copied = pi_first - pi_filled;
+    else
+      pi_first = pi_filled;
+  }
+  else
+  {
+    if (slot < config->nc_open_units)
+    {
+      //Rewriting behind the write pointer starts the unit over
+      us += thinfat_phy_flash_close_unit(flash, slot);
+    }
+    else
+    {
+      slot = 0;
+      for (unsigned int i = 1; i < config->nc_open_units; i++)
+        if (flash->used[i] < flash->used[slot])
+          slot = i;
+      if (flash->used[slot] != 0)
+        us += thinfat_phy_flash_close_unit(flash, slot);
+    }
+    flash->si_unit[slot] = si_unit;
+    flash->stats.nc_unit_opened++;
+    nc_copied = pi_first;
+    if (so % config->sc_page != 0)
+    {
+      //The head of the first page is read back from the old block
+      flash->stats.nc_page_read++;
+      us += config->us_page_read;
+    }
+  }
+  flash->sc_filled[slot] = so + sc;
+  flash->used[slot] = ++flash->clock;
+
+  flash->stats.nc_page_copied += nc_copied;
+  flash->stats.nc_page_programmed += nc_copied + (pi_end > pi_first ? pi_end - pi_first : 0);
+  us += (uint64_t)nc_copied * (config->us_page_read + config->us_page_program);
+  us += (uint64_t)(pi_end > pi_first ? pi_end - pi_first : 0) * config->us_page_program;
+  return us;
+}
+
+static void thinfat_phy_flash_charge(thinfat_phy_flash_t *flash, uint64_t us)
+{
+  flash->stats.us_busy += us;
+  if (us > flash->stats.us_max)
+    flash->stats.us_max = (uint32_t)us;
+  if (flash->config.throttle)
+  {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(us / 1000000);
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static thinfat_result_t thinfat_phy_flash_open(thinfat_phy_t *phy, const char *devpath)
+{
+  return phy->flash->backing->open(phy, devpath);
+}
+
+static thinfat_result_t thinfat_phy_flash_close(thinfat_phy_t *phy)
+{
+  return phy->flash->backing->close(phy);
+}
+
+static void *thinfat_phy_flash_map(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  return phy->flash->backing->map(phy, req);
+}
+
+static thinfat_result_t thinfat_phy_flash_read(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  thinfat_phy_flash_t *flash = phy->flash;
+  const thinfat_phy_flash_config_t *config = &flash->config;
+  thinfat_sector_t scale = phy->sz_sector / THINFAT_SECTOR_SIZE;
+  thinfat_sector_t si = req->si_xfer * scale, sc = req->sc_xfer * scale;
+  thinfat_sector_t nc_pages = (si + sc + config->sc_page - 1) / config->sc_page - si / config->sc_page;
+
+  flash->stats.nc_read++;
+  flash->stats.sc_read += sc;
+  flash->stats.nc_page_read += nc_pages;
+  thinfat_phy_flash_charge(flash, config->us_command + (uint64_t)sc * config->us_transfer + (uint64_t)nc_pages * config->us_page_read);
+  return flash->backing->read(phy, req);
+}
+
+static thinfat_result_t thinfat_phy_flash_write(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  thinfat_phy_flash_t *flash = phy->flash;
+  const thinfat_phy_flash_config_t *config = &flash->config;
+  thinfat_sector_t scale = phy->sz_sector / THINFAT_SECTOR_SIZE;
+  thinfat_sector_t si = req->si_xfer * scale, sc = req->sc_xfer * scale;
+  uint64_t us = config->us_command + (uint64_t)sc * config->us_transfer;
+
+  flash->stats.nc_write++;
+  flash->stats.sc_written += sc;
+  while (sc > 0)
+  {
+    thinfat_sector_t sc_unit = config->sc_unit - si % config->sc_unit;
+    if (sc_unit > sc)
+      sc_unit = sc;
+    us += thinfat_phy_flash_program(flash, si, sc_unit);
+    si += sc_unit;
+    sc -= sc_unit;
+  }
+  thinfat_phy_flash_charge(flash, us);
+  return flash->backing->write(phy, req);
+}
+
+static thinfat_result_t thinfat_phy_flash_poll(thinfat_phy_t *phy)
+{
+  return phy->flash->backing->poll(phy);
+}
+
+/*!
+ * Puts the cost model in front of the driver the PHY was initialized with.
+ * Call it after thinfat_phy_initialize() or thinfat_phy_initialize_ram() and
+ * before thinfat_phy_start(); `flash` must outlive the PHY.
+ */
+thinfat_result_t thinfat_phy_attach_flash(thinfat_phy_t *phy, thinfat_phy_flash_t *flash, const thinfat_phy_flash_config_t *config)
+{
+  if (config == NULL)
+    config = &thinfat_phy_flash_default_config;
+  if (config->sc_page == 0 || config->sc_unit % config->sc_page != 0
+      || config->nc_open_units == 0 || config->nc_open_units > THINFAT_CONFIG_FLASH_MAX_OPEN_UNITS)
+    return THINFAT_RESULT_UNSUPPORTED;
+
+  memset(flash, 0, sizeof(thinfat_phy_flash_t));
+  flash->backing = phy->driver;
+  flash->config = *config;
+  flash->driver.name = "flash";
+  flash->driver.zero_copy = phy->driver->zero_copy;
+  flash->driver.open = thinfat_phy_flash_open;
+  flash->driver.close = thinfat_phy_flash_close;
+  flash->driver.map = thinfat_phy_flash_map;
+  flash->driver.read = thinfat_phy_flash_read;
+  flash->driver.write = thinfat_phy_flash_write;
+  flash->driver.poll = phy->driver->poll != NULL ? thinfat_phy_flash_poll : NULL;
+  phy->flash = flash;
+  phy->driver = &flash->driver;
+  return THINFAT_RESULT_OK;
+}
+
+void thinfat_phy_get_flash_stats(thinfat_phy_t *phy, thinfat_phy_flash_stats_t *stats)
+{
+  if (phy->flash != NULL)
+    *stats = phy->flash->stats;
+  else
+    memset(stats, 0, sizeof(thinfat_phy_flash_stats_t));
+}
@@ -5,6 +5,7 @@
  * @date 2017/01/07
  * @author Hiroka IHARA
  */
+#define _GNU_SOURCE
 #include "thinfat_phy.h"
 
 #include <stdio.h>
@@ -12,6 +13,7 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/fcntl.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -25,21 +27,68 @@ void thinfat_phy_unlock(thinfat_phy_t *phy)
   pthread_mutex_unlock(&phy->lock);
 }
 
+static uint32_t thinfat_phy_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+//Sleeps until a request is queued or, when a tick is installed, until it is due.
+static void thinfat_phy_idle(thinfat_phy_t *phy, uint32_t ms_now)
+{
+  struct timespec ts;
+  uint32_t ms_wait;
+  if (phy->tick == NULL)
+  {
+    pthread_cond_wait(&phy->wake, &phy->lock);
+    return;
+  }
+  if ((int32_t)(phy->ms_tick - ms_now) <= 0)
+    return;
+  ms_wait = phy->ms_tick - ms_now;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += ms_wait / 1000;
+  ts.tv_nsec += (long)(ms_wait % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+  {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&phy->wake, &phy->lock, &ts);
+}
+
 static void *thinfat_phy_execute(void *arg)
 {
   thinfat_phy_t *phy = (thinfat_phy_t *)arg;
-  while(!phy->exit_flag)
+  uint32_t ms_now = thinfat_phy_ms(), ms_emptied = ms_now;
+  bool empty = true;
+  pthread_mutex_lock(&phy->lock);
+  //Posted writes have no other owner, so the queue is drained before exiting
+  while(!phy->exit_flag || phy->rq_count > 0)
   {
     thinfat_result_t res;
-    pthread_mutex_lock(&phy->lock);
+    if (phy->tick != NULL)
+    {
+      ms_now = thinfat_phy_ms();
+      if (phy->rq_count == 0 && !empty)
+        ms_emptied = ms_now;
+      empty = phy->rq_count == 0;
+      if ((int32_t)(ms_now - phy->ms_tick) >= 0)
+        phy->ms_tick = ms_now + phy->tick(phy->tick_arg, ms_now, empty ? ms_now - ms_emptied : 0);
+    }
+    if (phy->rq_count == 0)
+    {
+      thinfat_phy_idle(phy, ms_now);
+      continue;
+    }
     if ((res = thinfat_phy_schedule(phy)) != THINFAT_RESULT_OK)
     {
       fprintf(stderr, "Error %d detected.\n", res);
       exit(-1);
     }
-    pthread_mutex_unlock(&phy->lock);
-    sleep(0);
   }
+  pthread_mutex_unlock(&phy->lock);
   return NULL;
 }
 
@@ -51,25 +100,221 @@ void thinfat_phy_enter(thinfat_phy_t *phy)
 
 thinfat_result_t thinfat_phy_leave(thinfat_phy_t *phy, thinfat_result_t res)
 {
-  if (res != THINFAT_RESULT_OK) return res;
+  //Nothing was started, so there is no callback to wait for
+  if (res != THINFAT_RESULT_OK)
+  {
+    pthread_mutex_unlock(&phy->lock);
+    return res;
+  }
   while (!phy->cb_flag)
     pthread_cond_wait(&phy->cond, &phy->lock);
   pthread_mutex_unlock(&phy->lock);
   return THINFAT_RESULT_OK;
 }
 
-static thinfat_sector_t sc_pagesize = 0;
+static size_t sz_pagesize = 0;
+
+//Window of the image the mmap drivers serve transfers through, kept in bytes so that it survives a change of sector size
+typedef struct thinfat_phy_mmap_tag
+{
+  void *mapped_block;
+  uint64_t so_mapped, sz_mapped;
+}
+thinfat_phy_mmap_t;
+
+static thinfat_result_t thinfat_phy_mmap_open(thinfat_phy_t *phy, const char *devpath)
+{
+  thinfat_phy_mmap_t *map;
+  sz_pagesize = sysconf(_SC_PAGESIZE);
+  phy->context = NULL;
+  if ((phy->fd = open(devpath, O_RDWR)) < 0)
+    return THINFAT_RESULT_PHY_ERROR;
+  if ((map = (thinfat_phy_mmap_t *)calloc(1, sizeof(thinfat_phy_mmap_t))) == NULL)
+  {
+    close(phy->fd);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  phy->context = map;
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_phy_mmap_close(thinfat_phy_t *phy)
+{
+  thinfat_phy_mmap_t *map = (thinfat_phy_mmap_t *)phy->context;
+  if (map != NULL && map->mapped_block != NULL)
+    munmap(map->mapped_block, map->sz_mapped);
+  free(map);
+  phy->context = NULL;
+  return close(phy->fd) ? THINFAT_RESULT_PHY_ERROR : THINFAT_RESULT_OK;
+}
+
+static void *thinfat_phy_mmap_map(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  thinfat_phy_mmap_t *map = (thinfat_phy_mmap_t *)phy->context;
+  uint64_t so_xfer = (uint64_t)phy->sz_sector * req->si_xfer, sz_xfer = (uint64_t)phy->sz_sector * req->sc_xfer;
+  if (map->mapped_block == NULL || so_xfer < map->so_mapped || map->so_mapped + map->sz_mapped < so_xfer + sz_xfer)
+  {
+    if (map->mapped_block != NULL)
+      munmap(map->mapped_block, map->sz_mapped);
+    map->so_mapped = so_xfer / sz_pagesize * sz_pagesize;
+    map->sz_mapped = (so_xfer % sz_pagesize + sz_xfer + sz_pagesize - 1) / sz_pagesize * sz_pagesize;
+    map->mapped_block = mmap(NULL, map->sz_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, phy->fd, (off_t)map->so_mapped);
+    if (map->mapped_block == (void *)-1)
+    {
+      map->mapped_block = NULL;
+      return NULL;
+    }
+  }
+  return (uint8_t *)map->mapped_block + (so_xfer - map->so_mapped);
+}
+
+static thinfat_result_t thinfat_phy_mmap_transfer(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  //The mapping is shared with the device, so map() has done all the work.
+  (void)phy;
+  (void)req;
+  return THINFAT_RESULT_OK;
+}
+
+const thinfat_phy_driver_t thinfat_phy_mmap_driver =
+{
+  "mmap",
+  false,
+  thinfat_phy_mmap_open,
+  thinfat_phy_mmap_close,
+  thinfat_phy_mmap_map,
+  thinfat_phy_mmap_transfer,
+  thinfat_phy_mmap_transfer,
+  NULL
+};
+
+/*
+ * The zero-copy variant maps the whole image once. Pointers lent to the
+ * caches stay valid until the PHY is finalized, so it never remaps.
+ */
+static thinfat_result_t thinfat_phy_zerocopy_open(thinfat_phy_t *phy, const char *devpath)
+{
+  thinfat_phy_mmap_t *map;
+  off_t size;
+
+  phy->context = NULL;
+  if ((phy->fd = open(devpath, O_RDWR)) < 0)
+    return THINFAT_RESULT_PHY_ERROR;
+  if ((size = lseek(phy->fd, 0, SEEK_END)) < THINFAT_SECTOR_SIZE
+      || (map = (thinfat_phy_mmap_t *)calloc(1, sizeof(thinfat_phy_mmap_t))) == NULL)
+  {
+    close(phy->fd);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+
+  map->so_mapped = 0;
+  map->sz_mapped = (uint64_t)size;
+  map->mapped_block = mmap(NULL, map->sz_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, phy->fd, 0);
+  if (map->mapped_block == (void *)-1)
+  {
+    THINFAT_ERROR("Failed to map the whole image.\n");
+    free(map);
+    close(phy->fd);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  phy->context = map;
+  return THINFAT_RESULT_OK;
+}
+
+static void *thinfat_phy_zerocopy_map(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  thinfat_phy_mmap_t *map = (thinfat_phy_mmap_t *)phy->context;
+  uint64_t so_xfer = (uint64_t)phy->sz_sector * req->si_xfer, sz_xfer = (uint64_t)phy->sz_sector * req->sc_xfer;
+  if (so_xfer >= map->sz_mapped || map->sz_mapped - so_xfer < sz_xfer)
+    return NULL;
+  return (uint8_t *)map->mapped_block + so_xfer;
+}
+
+const thinfat_phy_driver_t thinfat_phy_zerocopy_driver =
+{
+  "zerocopy",
+  true,
+  thinfat_phy_zerocopy_open,
+  thinfat_phy_mmap_close,
+  thinfat_phy_zerocopy_map,
+  thinfat_phy_mmap_transfer,
+  thinfat_phy_mmap_transfer,
+  NULL
+};
 
-thinfat_result_t thinfat_phy_initialize(thinfat_phy_t *phy, const char *devpath)
+//Resets the common state of the PHY; the driver sets up its own in open().
+void thinfat_phy_setup(thinfat_phy_t *phy, const thinfat_phy_driver_t *driver)
 {
-  phy->state = THINFAT_PHY_STATE_IDLE;
-  phy->fd = open(devpath, O_RDWR);
-  phy->mapped_block = NULL;
-  sc_pagesize = sysconf(_SC_PAGESIZE) / THINFAT_SECTOR_SIZE;
+  pthread_condattr_t attr;
+  phy->driver = driver != NULL ? driver : &thinfat_phy_mmap_driver;
+  phy->context = NULL;
+  phy->sz_sector = THINFAT_SECTOR_SIZE;
+  phy->rq_head = 0;
+  phy->rq_count = 0;
+  phy->rq_pending = 0;
+  phy->si_elevator = 0;
+  memset(&phy->queue_stats, 0, sizeof(phy->queue_stats));
+  thinfat_phy_reset_stats(phy);
+  phy->flash = NULL;
+  for (unsigned int i = 0; i < THINFAT_CONFIG_PHY_QUEUE_DEPTH; i++)
+  {
+    phy->queue[i].state = THINFAT_PHY_STATE_IDLE;
+    phy->queue[i].buffer = NULL;
+    phy->queue[i].sc_buffer = 0;
+    phy->queue[i].copy = NULL;
+  }
+  phy->tick = NULL;
+  phy->tick_arg = NULL;
+  phy->ms_tick = 0;
   pthread_mutex_init(&phy->lock, NULL);
   pthread_cond_init(&phy->cond, NULL);
+  //Ticks are timed against the monotonic clock, which the worker sleeps on
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&phy->wake, &attr);
+  pthread_condattr_destroy(&attr);
   srand((unsigned int)time(NULL));
-  return phy->fd < 0 ? THINFAT_RESULT_PHY_ERROR : THINFAT_RESULT_OK;
+}
+
+thinfat_result_t thinfat_phy_initialize(thinfat_phy_t *phy, const thinfat_phy_driver_t *driver, const char *devpath)
+{
+  thinfat_phy_setup(phy, driver);
+  return phy->driver->open(phy, devpath);
+}
+
+/*
+ * Switches the unit every sector number and count is given in. Called with the
+ * PHY lock held and nothing queued but the request being completed, as the core
+ * does once it has read the BPB. Buffers the slots own keep their bytes.
+ */
+thinfat_result_t thinfat_phy_set_sector_size(thinfat_phy_t *phy, thinfat_size_t sz_sector)
+{
+  if (sz_sector < THINFAT_SECTOR_SIZE || sz_sector > THINFAT_CONFIG_MAX_SECTOR_SIZE || (sz_sector & (sz_sector - 1)) != 0)
+    return THINFAT_RESULT_UNSUPPORTED;
+  for (unsigned int i = 0; i < phy->rq_count; i++)
+    if (phy->queue[(phy->rq_head + i) % THINFAT_CONFIG_PHY_QUEUE_DEPTH].state != THINFAT_PHY_STATE_IDLE)
+      return THINFAT_RESULT_PHY_BUSY;
+
+  for (unsigned int i = 0; i < THINFAT_CONFIG_PHY_QUEUE_DEPTH; i++)
+  {
+    phy->queue[i].sc_buffer = (thinfat_sector_t)((uint64_t)phy->queue[i].sc_buffer * phy->sz_sector / sz_sector);
+    free(phy->queue[i].copy);
+    phy->queue[i].copy = NULL;
+  }
+  phy->si_elevator = (thinfat_sector_t)((uint64_t)phy->si_elevator * phy->sz_sector / sz_sector);
+  phy->sz_sector = sz_sector;
+  return THINFAT_RESULT_OK;
+}
+
+//Installs the worker's housekeeping, or removes it with NULL. The first tick is due right away.
+void thinfat_phy_set_tick(thinfat_phy_t *phy, thinfat_phy_tick_t tick, void *arg)
+{
+  pthread_mutex_lock(&phy->lock);
+  phy->tick = tick;
+  phy->tick_arg = arg;
+  phy->ms_tick = thinfat_phy_ms();
+  pthread_cond_signal(&phy->wake);
+  pthread_mutex_unlock(&phy->lock);
 }
 
 thinfat_result_t thinfat_phy_start(thinfat_phy_t *phy)
@@ -83,6 +328,7 @@ thinfat_result_t thinfat_phy_stop(thinfat_phy_t *phy)
 {
   pthread_mutex_lock(&phy->lock);
   phy->exit_flag = true;
+  pthread_cond_signal(&phy->wake);
   pthread_mutex_unlock(&phy->lock);
   pthread_join(phy->thread, NULL);
   return THINFAT_RESULT_OK;
@@ -100,190 +346,546 @@ void thinfat_phy_signal(thinfat_phy_t *phy)
 
 bool thinfat_phy_is_idle(thinfat_phy_t *phy)
 {
-  return phy->state == THINFAT_PHY_STATE_IDLE;
+  return phy->rq_count == 0;
+}
+
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+static uint64_t thinfat_phy_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
-static thinfat_result_t thinfat_phy_remap(thinfat_phy_t *phy)
+static void thinfat_phy_account(thinfat_phy_t *phy, const thinfat_phy_request_t *req)
 {
-  if (phy->mapped_block == NULL || phy->si_req < phy->si_mapped || phy->si_mapped + phy->sc_mapped < phy->si_req + phy->sc_req)
+  thinfat_phy_type_stats_t *type = &phy->stats.types[req->state];
+  uint64_t ns = thinfat_phy_clock() - req->ns_enqueued, us = ns / 1000;
+  unsigned int bucket = 0;
+  uint64_t sz = phy->sz_sector * (uint64_t)req->sc_req;
+
+  while (us > 1 && bucket < THINFAT_CONFIG_PHY_LATENCY_BUCKETS - 1)
   {
-    if (phy->mapped_block != NULL)
-      munmap(phy->mapped_block, THINFAT_SECTOR_SIZE * phy->sc_mapped);
-    phy->si_mapped = phy->si_req / sc_pagesize * sc_pagesize;
-    phy->sc_mapped = ((phy->si_req % sc_pagesize) + phy->sc_req + sc_pagesize - 1) / sc_pagesize * sc_pagesize;
-    phy->mapped_block = mmap(NULL, THINFAT_SECTOR_SIZE * phy->sc_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, phy->fd, THINFAT_SECTOR_SIZE * phy->si_mapped);
-    if (phy->mapped_block == (void *)-1)
-      return THINFAT_RESULT_PHY_ERROR;
+    us >>= 1;
+    bucket++;
   }
-  return THINFAT_RESULT_OK;
+  type->nc_request++;
+  type->sz_transferred += sz;
+  type->ns_total += ns;
+  if (type->ns_max < ns)
+    type->ns_max = ns;
+  type->latency[bucket]++;
+  phy->stats.nc_class[req->origin]++;
+  phy->stats.sz_class[req->origin] += sz;
 }
+#endif
 
-thinfat_result_t thinfat_phy_schedule(thinfat_phy_t *phy)
+static thinfat_phy_request_t *thinfat_phy_enqueue(thinfat_phy_t *phy, void *client, thinfat_phy_state_t state, thinfat_sector_t sector, thinfat_sector_t count, void *block, thinfat_core_event_t event)
 {
-  thinfat_result_t res;
+  if (phy->rq_count == THINFAT_CONFIG_PHY_QUEUE_DEPTH)
+    return NULL;
+
+  thinfat_phy_request_t *req = &phy->queue[(phy->rq_head + phy->rq_count++) % THINFAT_CONFIG_PHY_QUEUE_DEPTH];
+  req->state = state;
+  req->client = client;
+  req->event = event;
+  req->si_req = sector;
+  req->sc_req = count;
+  req->sc_current = 0;
+  req->block = block;
+  req->data = NULL;
+  req->nc_segments = 0;
+  req->leader = NULL;
+  req->nc_members = 0;
+  req->posted = false;
+  req->started = false;
+  req->pending = false;
+  req->result = THINFAT_RESULT_OK;
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  req->origin = thinfat_core_classify(client, event);
+  req->ns_enqueued = thinfat_phy_clock();
+#endif
+
+  phy->queue_stats.nc_request++;
+  phy->queue_stats.depth_sum += phy->rq_count;
+  if (phy->queue_stats.depth_max < phy->rq_count)
+    phy->queue_stats.depth_max = phy->rq_count;
 
-  /*if (!thinfat_phy_is_idle(phy))
-    THINFAT_INFO("PHY scheduler called: state = %d.\n", (int)phy->state);*/
+  pthread_cond_signal(&phy->wake);
+  return req;
+}
 
-  switch(phy->state)
+static void thinfat_phy_retire(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  thinfat_phy_account(phy, req);
+#endif
+  req->state = THINFAT_PHY_STATE_IDLE;
+  while (phy->rq_count > 0 && phy->queue[phy->rq_head].state == THINFAT_PHY_STATE_IDLE)
   {
-  case THINFAT_PHY_STATE_IDLE:
-    break;
-  case THINFAT_PHY_STATE_SINGLE_READ:
-    if ((res = thinfat_phy_remap(phy)) == THINFAT_RESULT_OK)
+    phy->rq_head = (phy->rq_head + 1) % THINFAT_CONFIG_PHY_QUEUE_DEPTH;
+    phy->rq_count--;
+  }
+}
+
+static inline thinfat_phy_request_t *thinfat_phy_queued(thinfat_phy_t *phy, unsigned int index)
+{
+  return &phy->queue[(phy->rq_head + index) % THINFAT_CONFIG_PHY_QUEUE_DEPTH];
+}
+
+static inline bool thinfat_phy_is_write(const thinfat_phy_request_t *req)
+{
+  return req->state == THINFAT_PHY_STATE_SINGLE_WRITE || req->state == THINFAT_PHY_STATE_MULTIPLE_WRITE || req->state == THINFAT_PHY_STATE_VECTOR_WRITE;
+}
+
+//A request may not overtake an earlier live one touching the same sectors unless both of them are reads.
+static bool thinfat_phy_is_blocked(thinfat_phy_t *phy, unsigned int index)
+{
+  thinfat_phy_request_t *req = thinfat_phy_queued(phy, index);
+  for (unsigned int i = 0; i < index; i++)
+  {
+    thinfat_phy_request_t *prev = thinfat_phy_queued(phy, i);
+    if (prev->state == THINFAT_PHY_STATE_IDLE || (!thinfat_phy_is_write(prev) && !thinfat_phy_is_write(req)))
+      continue;
+    if (prev->si_req < req->si_req + req->sc_req && req->si_req < prev->si_req + prev->sc_req)
+      return true;
+  }
+  return false;
+}
+
+static bool thinfat_phy_is_ready(const thinfat_phy_request_t *req)
+{
+  if (req->state == THINFAT_PHY_STATE_IDLE || !req->started)
+    return false;
+  if (req->leader != NULL)
+    return !req->leader->pending;
+  return !req->pending && req->nc_members == 0;
+}
+
+/*
+ * C-SCAN: the lowest startable sector at or above the last transfer, wrapping
+ * around to the lowest one. Posted writes have nobody waiting on them, so they
+ * give way to other requests. A request passed over keeps its slot and the
+ * ones behind it from being recycled, so once the queue is half full the
+ * oldest startable request goes first.
+ */
+static int thinfat_phy_elevator_pick(thinfat_phy_t *phy)
+{
+  bool fifo = phy->rq_count >= THINFAT_CONFIG_PHY_QUEUE_DEPTH / 2;
+  unsigned int rank_pick = 0;
+  thinfat_sector_t si_pick = 0;
+  int pick = -1;
+
+  for (unsigned int i = 0; i < phy->rq_count; i++)
+  {
+    thinfat_phy_request_t *req = thinfat_phy_queued(phy, i);
+    if (req->state == THINFAT_PHY_STATE_IDLE || req->started || thinfat_phy_is_blocked(phy, i))
+      continue;
+    if (fifo)
+      return (int)i;
+    unsigned int rank = (req->posted ? 2 : 0) + (req->si_req < phy->si_elevator ? 1 : 0);
+    if (pick < 0 || rank < rank_pick || (rank == rank_pick && req->si_req < si_pick))
     {
-      void *src = (uint8_t *)phy->mapped_block + THINFAT_SECTOR_SIZE * (phy->si_req % sc_pagesize);
-      memcpy(phy->block, src, THINFAT_SECTOR_SIZE);
-      phy->state = THINFAT_PHY_STATE_IDLE;
-      return thinfat_core_callback(phy->client, phy->event, phy->si_req, &phy->block);
+      pick = (int)i;
+      rank_pick = rank;
+      si_pick = req->si_req;
     }
-    else
+  }
+  return pick;
+}
+
+//Folds queued single-sector requests of the same direction that continue the transfer into it.
+static void thinfat_phy_merge(thinfat_phy_t *phy, thinfat_phy_request_t *leader)
+{
+  unsigned int i = 0;
+  while (i < phy->rq_count && leader->sc_xfer < THINFAT_CONFIG_PHY_MERGE_LIMIT)
+  {
+    thinfat_phy_request_t *req = thinfat_phy_queued(phy, i);
+    if (req->state != leader->state || req->started || req->si_req != leader->si_xfer + leader->sc_xfer || thinfat_phy_is_blocked(phy, i))
     {
-      return res;
+      i++;
+      continue;
     }
-    break;
+    req->started = true;
+    req->leader = leader;
+    leader->nc_members++;
+    leader->sc_xfer++;
+    phy->queue_stats.nc_merged++;
+    i = 0;
+  }
+}
+
+//Moves a vector request between its segments and the transfer buffer, one copy per segment.
+static void thinfat_phy_copy_segments(thinfat_phy_t *phy, thinfat_phy_request_t *req, bool scatter)
+{
+  uint8_t *data = (uint8_t *)req->data;
+  for (unsigned int i = 0; i < req->nc_segments; i++)
+  {
+    size_t size = phy->sz_sector * (size_t)req->segments[i].sc_data;
+    if (data != req->segments[i].data)
+    {
+      if (scatter)
+        memcpy(req->segments[i].data, data, size);
+      else
+        memcpy(data, req->segments[i].data, size);
+    }
+    data += size;
+  }
+}
+
+static thinfat_result_t thinfat_phy_start_request(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  req->started = true;
+  req->si_xfer = req->si_req;
+  req->sc_xfer = req->sc_req;
+  if (req->state == THINFAT_PHY_STATE_SINGLE_READ || req->state == THINFAT_PHY_STATE_SINGLE_WRITE)
+    thinfat_phy_merge(phy, req);
+  phy->si_elevator = req->si_xfer + req->sc_xfer;
+  phy->queue_stats.nc_transfer++;
+
+  if ((req->data = phy->driver->map(phy, req)) == NULL)
+    return THINFAT_RESULT_PHY_ERROR;
+
+  switch(req->state)
+  {
+  case THINFAT_PHY_STATE_SINGLE_READ:
+  case THINFAT_PHY_STATE_MULTIPLE_READ:
+  case THINFAT_PHY_STATE_VECTOR_READ:
+    return phy->driver->read(phy, req);
+  case THINFAT_PHY_STATE_VECTOR_WRITE:
+    thinfat_phy_copy_segments(phy, req, false);
+    return phy->driver->write(phy, req);
   case THINFAT_PHY_STATE_SINGLE_WRITE:
-    if ((res = thinfat_phy_remap(phy)) == THINFAT_RESULT_OK)
+    for (unsigned int i = 0; i < phy->rq_count; i++)
     {
-      void *dest = (uint8_t *)phy->mapped_block + THINFAT_SECTOR_SIZE * (phy->si_req % sc_pagesize);
-      memcpy(dest, phy->block, THINFAT_SECTOR_SIZE);
-      phy->state = THINFAT_PHY_STATE_IDLE;
-      return thinfat_core_callback(phy->client, phy->event, phy->si_req, &phy->block);
+      thinfat_phy_request_t *member = thinfat_phy_queued(phy, i);
+      if (member == req || (member->leader == req && member->state != THINFAT_PHY_STATE_IDLE))
+      {
+        void *dest = (uint8_t *)req->data + phy->sz_sector * (member->si_req - req->si_xfer);
+        if (dest != member->block)
+          memcpy(dest, member->block, phy->sz_sector);
+      }
     }
+    return phy->driver->write(phy, req);
+  case THINFAT_PHY_STATE_MULTIPLE_WRITE:
+    //Written out once the client has filled every sector
+    break;
+  }
+  return THINFAT_RESULT_OK;
+}
+
+//Members of a merged transfer are answered from the leader's buffer, before the leader itself.
+static thinfat_result_t thinfat_phy_complete_member(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  thinfat_phy_request_t *leader = req->leader;
+  void *client = req->client, *block = req->block;
+  void *src = (uint8_t *)leader->data + phy->sz_sector * (req->si_req - leader->si_xfer);
+  thinfat_core_event_t event = req->event;
+  thinfat_sector_t si_req = req->si_req;
+  bool posted = req->posted;
+
+  if (leader->result != THINFAT_RESULT_OK)
+    return leader->result;
+
+  if (req->state == THINFAT_PHY_STATE_SINGLE_READ)
+  {
+    if (phy->driver->zero_copy)
+      block = src;
     else
+      memcpy(req->block, src, phy->sz_sector);
+  }
+  leader->nc_members--;
+  thinfat_phy_retire(phy, req);
+  if (posted)
+    return THINFAT_RESULT_OK;
+  return thinfat_core_callback(client, event, si_req, &block);
+}
+
+static thinfat_result_t thinfat_phy_complete_request(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  void *client = req->client, *block = req->block;
+  thinfat_core_event_t event = req->event;
+  thinfat_sector_t si_req = req->si_req, sc_req = req->sc_req;
+
+  if (req->leader != NULL)
+    return thinfat_phy_complete_member(phy, req);
+  if (req->result != THINFAT_RESULT_OK)
+    return req->result;
+
+  switch(req->state)
+  {
+  case THINFAT_PHY_STATE_SINGLE_READ:
+    if (phy->driver->zero_copy)
+      block = req->data;
+    else if (req->data != req->block)
+      memcpy(req->block, req->data, phy->sz_sector);
+    thinfat_phy_retire(phy, req);
+    return thinfat_core_callback(client, event, si_req, &block);
+  case THINFAT_PHY_STATE_SINGLE_WRITE:
+    if (req->posted)
     {
-      return res;
+      thinfat_phy_retire(phy, req);
+      return THINFAT_RESULT_OK;
     }
-    break;
+    thinfat_phy_retire(phy, req);
+    return thinfat_core_callback(client, event, si_req, &block);
   case THINFAT_PHY_STATE_MULTIPLE_READ:
-    if (phy->block == NULL)
+    if (req->block == NULL)
     {
-      if ((res = thinfat_phy_remap(phy)) == THINFAT_RESULT_OK)
-      {
-        return thinfat_core_callback(phy->client, phy->event, phy->si_req, &phy->block);
-      }
-      else
-      {
-        return res;
-      }
+      return thinfat_core_callback(client, event, si_req, &req->block);
     }
-    else if (phy->sc_current < phy->sc_req)
+    else if (req->sc_current < req->sc_req)
     {
-      void *src = (uint8_t *)phy->mapped_block + THINFAT_SECTOR_SIZE * (phy->si_req - phy->si_mapped + phy->sc_current);
-      memcpy(phy->block, src, THINFAT_SECTOR_SIZE);
-      return thinfat_core_callback(phy->client, phy->event, phy->si_req + phy->sc_current++, &phy->block);
+      void *src = (uint8_t *)req->data + phy->sz_sector * req->sc_current;
+      memcpy(req->block, src, phy->sz_sector);
+      return thinfat_core_callback(client, event, si_req + req->sc_current++, &req->block);
     }
     else
     {
-      phy->state = THINFAT_PHY_STATE_IDLE;
-      return thinfat_core_callback(phy->client, phy->event, phy->si_req + phy->sc_current, NULL);
+      thinfat_sector_t sc_current = req->sc_current;
+      thinfat_phy_retire(phy, req);
+      return thinfat_core_callback(client, event, si_req + sc_current, NULL);
     }
     break;
   case THINFAT_PHY_STATE_MULTIPLE_WRITE:
-    if (phy->block == NULL)
+    if (req->block == NULL)
     {
-      if ((res = thinfat_phy_remap(phy)) == THINFAT_RESULT_OK)
-      {
-        return thinfat_core_callback(phy->client, phy->event, phy->si_req, &phy->block);
-      }
-      else
-      {
-        return res;
-      }
+      return thinfat_core_callback(client, event, si_req, &req->block);
     }
-    else if (phy->sc_current < phy->sc_req)
+    else if (req->sc_current < req->sc_req)
     {
-      void *dest = (uint8_t *)phy->mapped_block + THINFAT_SECTOR_SIZE * (phy->si_req - phy->si_mapped + phy->sc_current);
-      memcpy(dest, phy->block, THINFAT_SECTOR_SIZE);
-      phy->sc_current++;
-      if (phy->sc_current < phy->sc_req)
-        return thinfat_core_callback(phy->client, phy->event, phy->si_req + phy->sc_current - 1, &phy->block);
+      void *dest = (uint8_t *)req->data + phy->sz_sector * req->sc_current;
+      if (dest != req->block)
+        memcpy(dest, req->block, phy->sz_sector);
+      req->sc_current++;
+      if (req->sc_current < req->sc_req)
+        return thinfat_core_callback(client, event, si_req + req->sc_current - 1, &req->block);
+      return phy->driver->write(phy, req);
     }
     else
     {
-      phy->state = THINFAT_PHY_STATE_IDLE;
-      return thinfat_core_callback(phy->client, phy->event, phy->si_req + phy->sc_current, NULL);
+      thinfat_sector_t sc_current = req->sc_current;
+      thinfat_phy_retire(phy, req);
+      return thinfat_core_callback(client, event, si_req + sc_current, NULL);
     }
     break;
+  case THINFAT_PHY_STATE_VECTOR_READ:
+    thinfat_phy_copy_segments(phy, req, true);
+    //Fall through
+  case THINFAT_PHY_STATE_VECTOR_WRITE:
+    thinfat_phy_retire(phy, req);
+    return thinfat_core_callback(client, event, si_req + sc_req, NULL);
+  }
+  return THINFAT_RESULT_OK;
+}
+
+static bool thinfat_phy_is_busy(thinfat_phy_t *phy)
+{
+  for (unsigned int i = 0; i < phy->rq_count; i++)
+  {
+    thinfat_phy_request_t *req = thinfat_phy_queued(phy, i);
+    if (req->state != THINFAT_PHY_STATE_IDLE && req->started)
+      return true;
+  }
+  return false;
+}
+
+thinfat_result_t thinfat_phy_schedule(thinfat_phy_t *phy)
+{
+  thinfat_result_t res;
+  int index;
+
+  //Synchronous drivers take one transfer at a time, in elevator order.
+  //Asynchronous drivers get every transfer that may start submitted at once.
+  if (phy->driver->poll != NULL || !thinfat_phy_is_busy(phy))
+  {
+    while ((index = thinfat_phy_elevator_pick(phy)) >= 0)
+    {
+      if ((res = thinfat_phy_start_request(phy, thinfat_phy_queued(phy, (unsigned int)index))) != THINFAT_RESULT_OK)
+        return res;
+      if (phy->driver->poll == NULL)
+        break;
+    }
+  }
+
+  for (unsigned int i = 0; i < phy->rq_count; i++)
+  {
+    thinfat_phy_request_t *req = thinfat_phy_queued(phy, i);
+    if (thinfat_phy_is_ready(req))
+      return thinfat_phy_complete_request(phy, req);
+  }
+
+  if (phy->rq_pending > 0)
+  {
+    pthread_mutex_unlock(&phy->lock);
+    res = phy->driver->poll(phy);
+    pthread_mutex_lock(&phy->lock);
+    return res;
   }
   return THINFAT_RESULT_OK;
 }
 
 thinfat_result_t thinfat_phy_finalize(thinfat_phy_t *phy)
 {
-  if (phy->mapped_block != NULL)
-    munmap(phy->mapped_block, THINFAT_SECTOR_SIZE * phy->sc_mapped);
-  return close(phy->fd) ? THINFAT_RESULT_PHY_ERROR : THINFAT_RESULT_OK;
+  for (unsigned int i = 0; i < THINFAT_CONFIG_PHY_QUEUE_DEPTH; i++)
+  {
+    free(phy->queue[i].copy);
+    phy->queue[i].copy = NULL;
+  }
+  return phy->driver->close(phy);
 }
 
 thinfat_result_t thinfat_phy_read_single(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, void *block, thinfat_core_event_t event)
 {
-  if (phy->state != THINFAT_PHY_STATE_IDLE)
+  if (thinfat_phy_enqueue(phy, client, THINFAT_PHY_STATE_SINGLE_READ, sector, 1, block, event) == NULL)
   {
     return THINFAT_RESULT_PHY_BUSY;
   }
-  phy->client = client;
-  phy->state = THINFAT_PHY_STATE_SINGLE_READ;
-  phy->si_req = sector;
-  phy->sc_req = 1;
-  phy->sc_current = 0;
-  phy->block = block;
-  phy->event = event;
   THINFAT_INFO("Single READ request @ " TFF_X32 "\n", sector);
   return THINFAT_RESULT_OK;
 }
 
 thinfat_result_t thinfat_phy_write_single(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, void *block, thinfat_core_event_t event)
 {
-  if (phy->state != THINFAT_PHY_STATE_IDLE)
+  if (thinfat_phy_enqueue(phy, client, THINFAT_PHY_STATE_SINGLE_WRITE, sector, 1, block, event) == NULL)
   {
     return THINFAT_RESULT_PHY_BUSY;
   }
-  phy->client = client;
-  phy->state = THINFAT_PHY_STATE_SINGLE_WRITE;
-  phy->si_req = sector;
-  phy->sc_req = 1;
-  phy->sc_current = 0;
-  phy->block = block;
-  phy->event = event;
   THINFAT_INFO("Single WRITE request @ " TFF_X32 "\n", sector);
   return THINFAT_RESULT_OK;
 }
 
 thinfat_result_t thinfat_phy_read_multiple(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, thinfat_sector_t count, thinfat_core_event_t event)
 {
-  if (phy->state != THINFAT_PHY_STATE_IDLE)
+  if (thinfat_phy_enqueue(phy, client, THINFAT_PHY_STATE_MULTIPLE_READ, sector, count, NULL, event) == NULL)
   {
     return THINFAT_RESULT_PHY_BUSY;
   }
-  phy->client = client;
-  phy->state = THINFAT_PHY_STATE_MULTIPLE_READ;
-  phy->si_req = sector;
-  phy->sc_req = count;
-  phy->sc_current = 0;
-  phy->block = NULL;
-  phy->event = event;
   THINFAT_INFO("Multiple READ request @ " TFF_X32 " * " TFF_U32 "\n", sector, count);
   return THINFAT_RESULT_OK;
 }
 
 thinfat_result_t thinfat_phy_write_multiple(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, thinfat_sector_t count, thinfat_core_event_t event)
 {
-  if (phy->state != THINFAT_PHY_STATE_IDLE)
+  if (thinfat_phy_enqueue(phy, client, THINFAT_PHY_STATE_MULTIPLE_WRITE, sector, count, NULL, event) == NULL)
   {
     return THINFAT_RESULT_PHY_BUSY;
   }
-  phy->client = client;
-  phy->state = THINFAT_PHY_STATE_MULTIPLE_WRITE;
-  phy->si_req = sector;
-  phy->sc_req = count;
-  phy->sc_current = 0;
-  phy->block = NULL;
-  phy->event = event;
   THINFAT_INFO("Multiple WRITE request @ " TFF_X32 " * " TFF_U32 "\n", sector, count);
   return THINFAT_RESULT_OK;
 }
 
+static thinfat_result_t thinfat_phy_enqueue_vector(void *client, thinfat_phy_t *phy, thinfat_phy_state_t state, thinfat_sector_t sector, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event)
+{
+  thinfat_phy_request_t *req;
+  thinfat_sector_t count = 0;
+  if (nc_segments == 0 || nc_segments > THINFAT_CONFIG_MAX_SEGMENTS)
+  {
+    return THINFAT_RESULT_UNSUPPORTED;
+  }
+  for (unsigned int i = 0; i < nc_segments; i++)
+  {
+    count += segments[i].sc_data;
+  }
+  if ((req = thinfat_phy_enqueue(phy, client, state, sector, count, NULL, event)) == NULL)
+  {
+    return THINFAT_RESULT_PHY_BUSY;
+  }
+  memcpy(req->segments, segments, sizeof(thinfat_segment_t) * nc_segments);
+  req->nc_segments = nc_segments;
+  return THINFAT_RESULT_OK;
+}
+
+/*!
+ * Scattered transfers move the whole run in one go and call the client back
+ * only once, with p_param == NULL, instead of once per sector.
+ */
+thinfat_result_t thinfat_phy_read_vector(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event)
+{
+  thinfat_result_t res = thinfat_phy_enqueue_vector(client, phy, THINFAT_PHY_STATE_VECTOR_READ, sector, segments, nc_segments, event);
+  if (res == THINFAT_RESULT_OK)
+  {
+    THINFAT_INFO("Vector READ request @ " TFF_X32 " in %u segments\n", sector, nc_segments);
+  }
+  return res;
+}
+
+thinfat_result_t thinfat_phy_write_vector(void *client, thinfat_phy_t *phy, thinfat_sector_t sector, const thinfat_segment_t *segments, unsigned int nc_segments, thinfat_core_event_t event)
+{
+  thinfat_result_t res = thinfat_phy_enqueue_vector(client, phy, THINFAT_PHY_STATE_VECTOR_WRITE, sector, segments, nc_segments, event);
+  if (res == THINFAT_RESULT_OK)
+  {
+    THINFAT_INFO("Vector WRITE request @ " TFF_X32 " in %u segments\n", sector, nc_segments);
+  }
+  return res;
+}
+
+/*!
+ * Queues a single-sector write nobody waits for. The block is copied into
+ * the queue slot, so the caller may reuse it right away.
+ */
+thinfat_result_t thinfat_phy_post_single(thinfat_phy_t *phy, thinfat_sector_t sector, const void *block)
+{
+  thinfat_phy_request_t *req;
+  if (phy->rq_count == THINFAT_CONFIG_PHY_QUEUE_DEPTH)
+  {
+    return THINFAT_RESULT_PHY_BUSY;
+  }
+  req = &phy->queue[(phy->rq_head + phy->rq_count) % THINFAT_CONFIG_PHY_QUEUE_DEPTH];
+  if (req->copy == NULL && (req->copy = malloc(phy->sz_sector)) == NULL)
+  {
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  memcpy(req->copy, block, phy->sz_sector);
+  thinfat_phy_enqueue(phy, NULL, THINFAT_PHY_STATE_SINGLE_WRITE, sector, 1, req->copy, THINFAT_CORE_EVENT_NONE);
+  req->posted = true;
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  //Only caches post writes, when they write back a dirty sector
+  req->origin = THINFAT_CLASS_CACHE;
+#endif
+  THINFAT_INFO("Posted WRITE request @ " TFF_X32 "\n", sector);
+  return THINFAT_RESULT_OK;
+}
+
+//Called with the PHY lock held, or once the worker has been stopped.
+void thinfat_phy_get_queue_stats(thinfat_phy_t *phy, thinfat_phy_queue_stats_t *stats)
+{
+  *stats = phy->queue_stats;
+}
+
+//Called with the PHY lock held, or once the worker has been stopped. Reads all zeros when the statistics are compiled out.
+void thinfat_phy_get_stats(thinfat_phy_t *phy, thinfat_phy_stats_t *stats)
+{
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  *stats = phy->stats;
+#else
+  (void)phy;
+  memset(stats, 0, sizeof(thinfat_phy_stats_t));
+#endif
+}
+
+void thinfat_phy_reset_stats(thinfat_phy_t *phy)
+{
+#if THINFAT_CONFIG_ENABLE_PHY_STATS
+  memset(&phy->stats, 0, sizeof(thinfat_phy_stats_t));
+#else
+  (void)phy;
+#endif
+}
+
+//Upper bound in microseconds of the bucket holding the given percentile
+uint64_t thinfat_phy_latency_percentile(const thinfat_phy_type_stats_t *stats, unsigned int percent)
+{
+  uint64_t nc_seen = 0, nc_wanted = ((uint64_t)stats->nc_request * percent + 99) / 100;
+  for (unsigned int b = 0; b < THINFAT_CONFIG_PHY_LATENCY_BUCKETS; b++)
+  {
+    nc_seen += stats->latency[b];
+    if (nc_seen >= nc_wanted && nc_seen > 0)
+      return (uint64_t)2 << b;
+  }
+  return 0;
+}
+
 thinfat_result_t thinfat_phy_get_time(thinfat_phy_t *phy, thinfat_time_t *data)
 {
   (void)phy;
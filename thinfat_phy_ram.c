@@ -0,0 +1,104 @@
+/*!
+ * @file thinfat_phy_ram.c
+ * @brief RAM-disk PHY driver for thinFAT <br>
+ *        Serves the volume from a heap buffer, so that the cost of the
+ *        driver itself can be measured without any I/O underneath.
+ * @date 2017/02/08
+ * @author Hiroka IHARA
+ */
+#include "thinfat_phy.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct thinfat_phy_ram_tag
+{
+  uint8_t *image;
+  size_t sz_image;
+  //Whether the image was loaded by the driver, rather than lent by the caller
+  bool owned;
+}
+thinfat_phy_ram_t;
+
+//Loads an image file into memory. Nothing is written back to it.
+static thinfat_result_t thinfat_phy_ram_open(thinfat_phy_t *phy, const char *devpath)
+{
+  FILE *fp = fopen(devpath, "rb");
+  thinfat_phy_ram_t *ram;
+  long size;
+
+  phy->context = NULL;
+  if (fp == NULL)
+    return THINFAT_RESULT_PHY_ERROR;
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < (long)phy->sz_sector || fseek(fp, 0, SEEK_SET) != 0
+      || (ram = (thinfat_phy_ram_t *)malloc(sizeof(thinfat_phy_ram_t))) == NULL)
+  {
+    fclose(fp);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  ram->sz_image = (size_t)size;
+  ram->owned = true;
+  if ((ram->image = (uint8_t *)malloc(ram->sz_image)) == NULL || fread(ram->image, 1, ram->sz_image, fp) != ram->sz_image)
+  {
+    THINFAT_ERROR("Failed to load %s into memory.\n", devpath);
+    free(ram->image);
+    free(ram);
+    fclose(fp);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+  fclose(fp);
+  phy->context = ram;
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_phy_ram_close(thinfat_phy_t *phy)
+{
+  thinfat_phy_ram_t *ram = (thinfat_phy_ram_t *)phy->context;
+  if (ram != NULL && ram->owned)
+    free(ram->image);
+  free(ram);
+  phy->context = NULL;
+  return THINFAT_RESULT_OK;
+}
+
+static void *thinfat_phy_ram_map(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  thinfat_phy_ram_t *ram = (thinfat_phy_ram_t *)phy->context;
+  size_t so_xfer = phy->sz_sector * (size_t)req->si_xfer, sz_xfer = phy->sz_sector * (size_t)req->sc_xfer;
+  if (so_xfer >= ram->sz_image || ram->sz_image - so_xfer < sz_xfer)
+    return NULL;
+  return ram->image + so_xfer;
+}
+
+static thinfat_result_t thinfat_phy_ram_transfer(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  (void)phy;
+  (void)req;
+  return THINFAT_RESULT_OK;
+}
+
+const thinfat_phy_driver_t thinfat_phy_ram_driver =
+{
+  "ram",
+  true,
+  thinfat_phy_ram_open,
+  thinfat_phy_ram_close,
+  thinfat_phy_ram_map,
+  thinfat_phy_ram_transfer,
+  thinfat_phy_ram_transfer,
+  NULL
+};
+
+//Serves an image the caller already holds in memory; it stays owned by the caller.
+thinfat_result_t thinfat_phy_initialize_ram(thinfat_phy_t *phy, void *image, size_t size)
+{
+  thinfat_phy_ram_t *ram;
+  thinfat_phy_setup(phy, &thinfat_phy_ram_driver);
+  if ((ram = (thinfat_phy_ram_t *)malloc(sizeof(thinfat_phy_ram_t))) == NULL)
+    return THINFAT_RESULT_PHY_ERROR;
+  ram->image = (uint8_t *)image;
+  ram->sz_image = size;
+  ram->owned = false;
+  phy->context = ram;
+  return THINFAT_RESULT_OK;
+}
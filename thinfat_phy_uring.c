@@ -0,0 +1,241 @@
+/*!
+ * @file thinfat_phy_uring.c
+ * @brief io_uring PHY driver for thinFAT <br>
+ *        Keeps every queued request in flight at once, so that
+ *        independent clients overlap on fast devices.
+ * @date 2017/02/03
+ * @author Hiroka IHARA
+ */
+#define _GNU_SOURCE
+#include "thinfat_phy.h"
+
+#if THINFAT_CONFIG_ENABLE_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+static int thinfat_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int thinfat_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+//The rings shared with the kernel, and how much of the submission ring has not been handed over yet
+typedef struct thinfat_phy_uring_tag
+{
+  int ring_fd;
+  void *sq_ring, *cq_ring;
+  size_t sz_sq_ring, sz_cq_ring, sz_sqes;
+  struct io_uring_sqe *sqes;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int sc_unsubmitted;
+}
+thinfat_phy_uring_t;
+
+//Unmaps whatever rings are mapped and closes the ring, in the reverse order of thinfat_phy_uring_open().
+static void thinfat_phy_uring_teardown(thinfat_phy_uring_t *ring)
+{
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sz_sqes);
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->sz_cq_ring);
+  if (ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sz_sq_ring);
+  close(ring->ring_fd);
+  free(ring);
+}
+
+static thinfat_result_t thinfat_phy_uring_open(thinfat_phy_t *phy, const char *devpath)
+{
+  struct io_uring_params p;
+  thinfat_phy_uring_t *ring;
+
+  phy->context = NULL;
+  phy->fd = open(devpath, O_RDWR);
+  if (phy->fd < 0)
+    return THINFAT_RESULT_PHY_ERROR;
+  if ((ring = (thinfat_phy_uring_t *)malloc(sizeof(thinfat_phy_uring_t))) == NULL)
+  {
+    close(phy->fd);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+
+  memset(&p, 0, sizeof(p));
+  ring->ring_fd = thinfat_uring_setup(THINFAT_CONFIG_PHY_QUEUE_DEPTH, &p);
+  if (ring->ring_fd < 0)
+  {
+    THINFAT_ERROR("io_uring is not available on this system.\n");
+    free(ring);
+    close(phy->fd);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+
+  ring->sz_sq_ring = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->sz_cq_ring = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sz_sqes = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->sz_cq_ring > ring->sz_sq_ring)
+      ring->sz_sq_ring = ring->sz_cq_ring;
+    ring->sz_cq_ring = 0;
+  }
+
+  ring->cq_ring = ring->sqes = MAP_FAILED;
+  ring->sq_ring = mmap(NULL, ring->sz_sq_ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring != MAP_FAILED)
+    ring->cq_ring = ring->sz_cq_ring == 0 ? ring->sq_ring
+                  : mmap(NULL, ring->sz_cq_ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ring != MAP_FAILED)
+    ring->sqes = mmap(NULL, ring->sz_sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    THINFAT_ERROR("Failed to map the io_uring rings.\n");
+    thinfat_phy_uring_teardown(ring);
+    close(phy->fd);
+    return THINFAT_RESULT_PHY_ERROR;
+  }
+
+  ring->sq_head = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.array);
+  ring->cq_head = (unsigned int *)((uint8_t *)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)((uint8_t *)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)((uint8_t *)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + p.cq_off.cqes);
+  ring->sc_unsubmitted = 0;
+  phy->context = ring;
+
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_phy_uring_close(thinfat_phy_t *phy)
+{
+  for (unsigned int i = 0; i < THINFAT_CONFIG_PHY_QUEUE_DEPTH; i++)
+  {
+    free(phy->queue[i].buffer);
+    phy->queue[i].buffer = NULL;
+    phy->queue[i].sc_buffer = 0;
+  }
+  if (phy->context != NULL)
+    thinfat_phy_uring_teardown((thinfat_phy_uring_t *)phy->context);
+  phy->context = NULL;
+  return close(phy->fd) ? THINFAT_RESULT_PHY_ERROR : THINFAT_RESULT_OK;
+}
+
+static void *thinfat_phy_uring_map(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  //Single sectors that were not merged, and unscattered vectors, go straight to the client's buffer
+  if ((req->state == THINFAT_PHY_STATE_SINGLE_READ || req->state == THINFAT_PHY_STATE_SINGLE_WRITE) && req->sc_xfer == 1)
+    return req->block;
+  if (req->nc_segments == 1)
+    return req->segments[0].data;
+
+  if (req->sc_buffer < req->sc_xfer)
+  {
+    void *buffer = realloc(req->buffer, phy->sz_sector * req->sc_xfer);
+    if (buffer == NULL)
+      return NULL;
+    req->buffer = buffer;
+    req->sc_buffer = req->sc_xfer;
+  }
+  return req->buffer;
+}
+
+static thinfat_result_t thinfat_phy_uring_push(thinfat_phy_t *phy, thinfat_phy_request_t *req, uint8_t opcode)
+{
+  thinfat_phy_uring_t *ring = (thinfat_phy_uring_t *)phy->context;
+  unsigned int tail = *ring->sq_tail;
+  unsigned int index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = phy->fd;
+  sqe->addr = (uint64_t)(uintptr_t)req->data;
+  sqe->len = phy->sz_sector * req->sc_xfer;
+  sqe->off = (uint64_t)phy->sz_sector * req->si_xfer;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  req->pending = true;
+  phy->rq_pending++;
+  ring->sc_unsubmitted++;
+  return THINFAT_RESULT_OK;
+}
+
+static thinfat_result_t thinfat_phy_uring_read(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  return thinfat_phy_uring_push(phy, req, IORING_OP_READ);
+}
+
+static thinfat_result_t thinfat_phy_uring_write(thinfat_phy_t *phy, thinfat_phy_request_t *req)
+{
+  return thinfat_phy_uring_push(phy, req, IORING_OP_WRITE);
+}
+
+/*
+ * Called without the PHY lock held: submits what has been pushed and waits for
+ * at least one completion. Once the queue is half full it waits for everything
+ * in flight instead, so that slots held by slow posted writes are recycled.
+ */
+static thinfat_result_t thinfat_phy_uring_poll(thinfat_phy_t *phy)
+{
+  thinfat_phy_uring_t *ring = (thinfat_phy_uring_t *)phy->context;
+  unsigned int to_submit, min_complete;
+
+  thinfat_phy_lock(phy);
+  to_submit = ring->sc_unsubmitted;
+  ring->sc_unsubmitted = 0;
+  min_complete = phy->rq_count >= THINFAT_CONFIG_PHY_QUEUE_DEPTH / 2 ? phy->rq_pending : 1;
+  thinfat_phy_unlock(phy);
+
+  if (thinfat_uring_enter(ring->ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS) < 0)
+    return THINFAT_RESULT_PHY_ERROR;
+
+  thinfat_phy_lock(phy);
+  unsigned int head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    thinfat_phy_request_t *req = (thinfat_phy_request_t *)(uintptr_t)cqe->user_data;
+    if (cqe->res != (int)(phy->sz_sector * req->sc_xfer))
+    {
+      THINFAT_ERROR("io_uring transfer @ " TFF_X32 " failed: %d\n", req->si_xfer, cqe->res);
+      req->result = THINFAT_RESULT_PHY_ERROR;
+    }
+    req->pending = false;
+    phy->rq_pending--;
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  thinfat_phy_unlock(phy);
+
+  return THINFAT_RESULT_OK;
+}
+
+const thinfat_phy_driver_t thinfat_phy_uring_driver =
+{
+  "uring",
+  false,
+  thinfat_phy_uring_open,
+  thinfat_phy_uring_close,
+  thinfat_phy_uring_map,
+  thinfat_phy_uring_read,
+  thinfat_phy_uring_write,
+  thinfat_phy_uring_poll
+};
+
+#endif
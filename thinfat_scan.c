@@ -0,0 +1,256 @@
+/*!
+ * @file thinfat_scan.c
+ * @brief thinFAT FAT entry scanning kernels <br>
+ *        Turns FAT sectors into masks of free clusters, 32 entries to a
+ *        word, with SSE2 or AVX2 where the CPU has them.
+ * @date 2017/02/06
+ * @author Hiroka IHARA
+ */
+#include "thinfat_scan.h"
+
+#if THINFAT_CONFIG_ENABLE_SIMD && defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define THINFAT_SCAN_X86 (1)
+#include <immintrin.h>
+#else
+#define THINFAT_SCAN_X86 (0)
+#endif
+
+static thinfat_scan_kernel_t thinfat_scan_kernel = THINFAT_SCAN_KERNEL_MAX;
+
+static inline thinfat_cluster_t thinfat_scan_ctz(uint32_t x)
+{
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  thinfat_cluster_t n = 0;
+  for (; !(x & 1); x >>= 1)
+    n++;
+  return n;
+#endif
+}
+
+static void thinfat_scan_zero_mask_portable(thinfat_type_t type, const void *entries, thinfat_cluster_t nc_entries, uint32_t *mask)
+{
+  const uint8_t *p = (const uint8_t *)entries;
+  for (thinfat_cluster_t w = 0; w < nc_entries / 32; w++)
+  {
+    uint32_t bits = 0;
+    if (type == THINFAT_TYPE_FAT32)
+    {
+      for (unsigned int b = 0; b < 32; b++, p += 4)
+        bits |= (uint32_t)((p[0] | p[1] | p[2] | (p[3] & 0x0F)) == 0) << b;
+    }
+    else
+    {
+      for (unsigned int b = 0; b < 32; b++, p += 2)
+        bits |= (uint32_t)((p[0] | p[1]) == 0) << b;
+    }
+    mask[w] = bits;
+  }
+}
+
+#if THINFAT_SCAN_X86
+//x86 is little endian, so the entries compare as they lie in the buffer
+static void thinfat_scan_zero_mask_sse2(thinfat_type_t type, const void *entries, thinfat_cluster_t nc_entries, uint32_t *mask)
+{
+  const __m128i *p = (const __m128i *)entries;
+  const __m128i zero = _mm_setzero_si128();
+
+  if (type == THINFAT_TYPE_FAT32)
+  {
+    const __m128i low = _mm_set1_epi32(THINFAT_FAT32_CLUSTER_MASK);
+    for (thinfat_cluster_t w = 0; w < nc_entries / 32; w++)
+    {
+      uint32_t bits = 0;
+      for (unsigned int b = 0; b < 32; b += 4)
+      {
+        __m128i v = _mm_and_si128(_mm_loadu_si128(p++), low);
+        bits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << b;
+      }
+      mask[w] = bits;
+    }
+  }
+  else
+  {
+    for (thinfat_cluster_t w = 0; w < nc_entries / 32; w++)
+    {
+      uint32_t bits = 0;
+      for (unsigned int b = 0; b < 32; b += 16, p += 2)
+      {
+        //Packing the two comparisons leaves one byte per entry
+        __m128i c0 = _mm_cmpeq_epi16(_mm_loadu_si128(p), zero);
+        __m128i c1 = _mm_cmpeq_epi16(_mm_loadu_si128(p + 1), zero);
+        bits |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(c0, c1)) << b;
+      }
+      mask[w] = bits;
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void thinfat_scan_zero_mask_avx2(thinfat_type_t type, const void *entries, thinfat_cluster_t nc_entries, uint32_t *mask)
+{
+  const __m256i *p = (const __m256i *)entries;
+  const __m256i zero = _mm256_setzero_si256();
+
+  if (type == THINFAT_TYPE_FAT32)
+  {
+    const __m256i low = _mm256_set1_epi32(THINFAT_FAT32_CLUSTER_MASK);
+    for (thinfat_cluster_t w = 0; w < nc_entries / 32; w++)
+    {
+      uint32_t bits = 0;
+      for (unsigned int b = 0; b < 32; b += 8)
+      {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256(p++), low);
+        bits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << b;
+      }
+      mask[w] = bits;
+    }
+  }
+  else
+  {
+    for (thinfat_cluster_t w = 0; w < nc_entries / 32; w++, p += 2)
+    {
+      //The pack works within 128-bit lanes, so its quarters come out as 0, 2, 1, 3
+      __m256i c0 = _mm256_cmpeq_epi16(_mm256_loadu_si256(p), zero);
+      __m256i c1 = _mm256_cmpeq_epi16(_mm256_loadu_si256(p + 1), zero);
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(c0, c1), 0xD8);
+      mask[w] = (uint32_t)_mm256_movemask_epi8(packed);
+    }
+  }
+}
+#endif
+
+static int thinfat_scan_supported(thinfat_scan_kernel_t kernel)
+{
+  switch (kernel)
+  {
+  case THINFAT_SCAN_KERNEL_PORTABLE:
+    return 1;
+#if THINFAT_SCAN_X86
+  case THINFAT_SCAN_KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case THINFAT_SCAN_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+thinfat_scan_kernel_t thinfat_scan_get_kernel(void)
+{
+  if (thinfat_scan_kernel == THINFAT_SCAN_KERNEL_MAX)
+  {
+    thinfat_scan_kernel_t kernel = THINFAT_SCAN_KERNEL_MAX;
+    while (!thinfat_scan_supported(--kernel))
+      ;
+    thinfat_scan_kernel = kernel;
+  }
+  return thinfat_scan_kernel;
+}
+
+thinfat_result_t thinfat_scan_set_kernel(thinfat_scan_kernel_t kernel)
+{
+  if (kernel >= THINFAT_SCAN_KERNEL_MAX || !thinfat_scan_supported(kernel))
+    return THINFAT_RESULT_UNSUPPORTED;
+  thinfat_scan_kernel = kernel;
+  return THINFAT_RESULT_OK;
+}
+
+const char *thinfat_scan_kernel_name(thinfat_scan_kernel_t kernel)
+{
+  static const char *names[THINFAT_SCAN_KERNEL_MAX] = {"portable", "sse2", "avx2"};
+  return kernel < THINFAT_SCAN_KERNEL_MAX ? names[kernel] : "none";
+}
+
+void thinfat_scan_zero_mask(thinfat_type_t type, const void *entries, thinfat_cluster_t nc_entries, uint32_t *mask)
+{
+  switch (thinfat_scan_get_kernel())
+  {
+#if THINFAT_SCAN_X86
+  case THINFAT_SCAN_KERNEL_AVX2:
+    thinfat_scan_zero_mask_avx2(type, entries, nc_entries, mask);
+    break;
+  case THINFAT_SCAN_KERNEL_SSE2:
+    thinfat_scan_zero_mask_sse2(type, entries, nc_entries, mask);
+    break;
+#endif
+  default:
+    thinfat_scan_zero_mask_portable(type, entries, nc_entries, mask);
+    break;
+  }
+}
+
+thinfat_cluster_t thinfat_scan_find_run(const uint32_t *mask, thinfat_cluster_t bi_from, thinfat_cluster_t bi_to, thinfat_cluster_t cc_search, thinfat_cluster_t *cc_run)
+{
+  thinfat_cluster_t bi = bi_from, cc = *cc_run;
+  while (bi < bi_to)
+  {
+    //Bits past the end of the word shift in as zeros, ending any run of ones there
+    uint32_t word = mask[bi / 32] >> (bi % 32);
+    thinfat_cluster_t nc_left = 32 - bi % 32, nc_same;
+    if (nc_left > bi_to - bi)
+      nc_left = bi_to - bi;
+    if (word & 1)
+    {
+      nc_same = ~word == 0 ? 32 : thinfat_scan_ctz(~word);
+      if (nc_same > nc_left)
+        nc_same = nc_left;
+      if (cc + nc_same >= cc_search)
+      {
+        *cc_run = cc_search;
+        return bi + (cc_search - cc) - 1;
+      }
+      cc += nc_same;
+    }
+    else
+    {
+      nc_same = word == 0 ? nc_left : thinfat_scan_ctz(word);
+      if (nc_same > nc_left)
+        nc_same = nc_left;
+      cc = 0;
+    }
+    bi += nc_same;
+  }
+  *cc_run = cc;
+  return bi_to;
+}
+
+thinfat_cluster_t thinfat_scan_next_run(const uint32_t *mask, thinfat_cluster_t bi_from, thinfat_cluster_t bi_to, thinfat_cluster_t *bi_start)
+{
+  thinfat_cluster_t bi = bi_from;
+  uint32_t word;
+  for (; bi < bi_to; bi += 32 - bi % 32)
+    if ((word = mask[bi / 32] >> (bi % 32)) != 0)
+    {
+      bi += thinfat_scan_ctz(word);
+      break;
+    }
+  if (bi >= bi_to)
+    return 0;
+  *bi_start = bi;
+  //A word set from bi to its end leaves nothing after the shift
+  for (; bi < bi_to; bi += 32 - bi % 32)
+    if ((word = ~mask[bi / 32] >> (bi % 32)) != 0)
+    {
+      bi += thinfat_scan_ctz(word);
+      break;
+    }
+  return (bi < bi_to ? bi : bi_to) - *bi_start;
+}
+
+thinfat_cluster_t thinfat_scan_count(const uint32_t *mask, thinfat_cluster_t nc_words)
+{
+  thinfat_cluster_t count = 0;
+  for (thinfat_cluster_t w = 0; w < nc_words; w++)
+  {
+#if defined(__GNUC__)
+    count += __builtin_popcount(mask[w]);
+#else
+    for (uint32_t word = mask[w]; word != 0; word &= word - 1)
+      count++;
+#endif
+  }
+  return count;
+}
@@ -0,0 +1,51 @@
+/*!
+ * @file thinfat_scan.h
+ * @brief thinFAT FAT entry scanning kernels
+ * @date 2017/02/06
+ * @author Hiroka IHARA
+ */
+#ifndef THINFAT_SCAN_H
+#define THINFAT_SCAN_H
+
+#include "thinfat.h"
+
+//Implementations of thinfat_scan_zero_mask(), in the order they are preferred
+typedef enum
+{
+  THINFAT_SCAN_KERNEL_PORTABLE = 0,
+  THINFAT_SCAN_KERNEL_SSE2,
+  THINFAT_SCAN_KERNEL_AVX2,
+  THINFAT_SCAN_KERNEL_MAX
+}
+thinfat_scan_kernel_t;
+
+/*
+ * Sets bit i of mask[i / 32] if FAT entry i of `entries` is zero, that is
+ * the cluster is free, and clears it otherwise. FAT32 entries are compared
+ * without their reserved high nibble. nc_entries must be a multiple of 32.
+ */
+void thinfat_scan_zero_mask(thinfat_type_t type, const void *entries, thinfat_cluster_t nc_entries, uint32_t *mask);
+
+/*
+ * Looks among bits [bi_from, bi_to) of `mask` for the bit completing a run
+ * of cc_search set bits, counting the *cc_run set bits that ran up to bi_from.
+ * Returns that bit, or bi_to with *cc_run set to the run left open at bi_to.
+ */
+thinfat_cluster_t thinfat_scan_find_run(const uint32_t *mask, thinfat_cluster_t bi_from, thinfat_cluster_t bi_to, thinfat_cluster_t cc_search, thinfat_cluster_t *cc_run);
+
+/*
+ * Finds the first run of set bits at or after bi_from, stopping at bi_to.
+ * Returns its length, 0 if there is none, and where it starts in *bi_start.
+ */
+thinfat_cluster_t thinfat_scan_next_run(const uint32_t *mask, thinfat_cluster_t bi_from, thinfat_cluster_t bi_to, thinfat_cluster_t *bi_start);
+
+//Set bits in nc_words words of `mask`
+thinfat_cluster_t thinfat_scan_count(const uint32_t *mask, thinfat_cluster_t nc_words);
+
+//Selects the kernel, failing if this CPU or build lacks it; the best available one is used until then.
+//The choice is one for the whole process and unlocked: make it before mounting, not while a volume on another PHY may be scanning.
+thinfat_result_t thinfat_scan_set_kernel(thinfat_scan_kernel_t kernel);
+thinfat_scan_kernel_t thinfat_scan_get_kernel(void);
+const char *thinfat_scan_kernel_name(thinfat_scan_kernel_t kernel);
+
+#endif
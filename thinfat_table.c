@@ -7,24 +7,43 @@
 #include "thinfat.h"
 #include "thinfat_table.h"
 #include "thinfat_cache.h"
+#include "thinfat_phy.h"
+#include "thinfat_scan.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+static thinfat_result_t thinfat_table_lookup_read(thinfat_table_t *table)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  table->nc_sectors++;
+  return thinfat_cached_read_single(table, table->cache, tf->si_hidden + tf->sc_reserved + table->ci_current / (tf->sz_sector >> tf->type), THINFAT_TABLE_EVENT_LOOKUP);
+}
 
 thinfat_result_t thinfat_table_lookup(void *client, thinfat_table_t *table, thinfat_cluster_t ci_current, thinfat_sector_t so_current, thinfat_sector_t so_seek, thinfat_core_event_t event)
+{
+  return thinfat_table_walk(client, table, ci_current, so_current, so_seek, THINFAT_CORE_EVENT_NONE, event);
+}
+
+thinfat_result_t thinfat_table_walk(void *client, thinfat_table_t *table, thinfat_cluster_t ci_current, thinfat_sector_t so_current, thinfat_sector_t so_seek, thinfat_core_event_t link_event, thinfat_core_event_t event)
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
   if (ci_current == 0 || (so_current >> tf->ctos_shift) == (so_seek >> tf->ctos_shift))
   {
-    return thinfat_core_callback(client, event, so_seek, &ci_current);
+    thinfat_table_run_t run = {ci_current, 1, 0, 0};
+    return thinfat_core_callback(client, event, so_seek, &run);
   }
   else
   {
-    thinfat_sector_t si_read = tf->si_hidden + tf->sc_reserved + ci_current / (THINFAT_SECTOR_SIZE >> tf->type);
     table->ci_current = ci_current;
+    table->co_current = so_current >> tf->ctos_shift;
     table->so_seek = so_seek;
+    table->cc_hops = 0;
+    table->nc_sectors = 0;
+    table->link_event = link_event;
     table->client = client;
     table->event = event;
-    return thinfat_cached_read_single(table, table->cache, si_read, THINFAT_TABLE_EVENT_LOOKUP);
+    return thinfat_table_lookup_read(table);
   }
 }
 
@@ -58,7 +77,7 @@ thinfat_result_t thinfat_table_lookup(void *client, thinfat_table_t *table, thin
         blk->so_current = 0;
         blk->ci_current = blk->ci_head;
       }
-      thinfat_sector_t si_lookup = tf->si_hidden + tf->sc_reserved + blk->ci_current / (THINFAT_SECTOR_SIZE >> tf->type);
+      thinfat_sector_t si_lookup = tf->si_hidden + tf->sc_reserved + blk->ci_current / (tf->sz_sector >> tf->type);
       table->so_seek = so_seek;
       table->client = client;
       table->event = event;
@@ -68,60 +87,422 @@ thinfat_result_t thinfat_table_lookup(void *client, thinfat_table_t *table, thin
   return THINFAT_RESULT_OK;
 }*/
 
+//Entry ci of the FAT sector at `block`, with FAT16 end-of-chain marks widened to the FAT32 ones
+static thinfat_cluster_t thinfat_table_entry(thinfat_t *tf, const void *block, thinfat_cluster_t ci)
+{
+  if (tf->type == THINFAT_TYPE_FAT32)
+    return thinfat_read_u32(block, thinfat_sector_offset(tf, ci * 4)) & THINFAT_FAT32_CLUSTER_MASK;
+  ci = thinfat_read_u16(block, thinfat_sector_offset(tf, ci * 2));
+  return ci >= 0xFFF7 ? THINFAT_INVALID_CLUSTER : ci;
+}
+
+//Follows the chain from run->ci_next while it stays contiguous and within the FAT sector holding entry ci_sector.
+static void thinfat_table_measure_run(thinfat_t *tf, const void *block, thinfat_cluster_t ci_sector, thinfat_table_run_t *run)
+{
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type, ci = run->ci_next;
+  run->cc_run = 1;
+  if (ci < 2 || !THINFAT_IS_CLUSTER_VALID(ci))
+    return;
+  while (ci / nc_entries == ci_sector / nc_entries && thinfat_table_entry(tf, block, ci) == ci + 1)
+  {
+    ci++;
+    run->cc_run++;
+  }
+}
+
+//Follows the links the FAT sector at `block` holds, until the walk reaches its target or leaves the sector.
+static thinfat_result_t thinfat_table_lookup_callback(thinfat_table_t *table, const void *block)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type, ci_sector = table->ci_current;
+  thinfat_cluster_t co_seek = table->so_seek >> tf->ctos_shift;
+  thinfat_table_run_t run;
+
+  for (;;)
+  {
+    run.ci_next = thinfat_table_entry(tf, block, table->ci_current);
+    table->cc_hops++;
+    if (++table->co_current >= co_seek || run.ci_next < 2 || !THINFAT_IS_CLUSTER_VALID(run.ci_next))
+      break;
+    table->ci_current = run.ci_next;
+    if (table->link_event != THINFAT_CORE_EVENT_NONE)
+    {
+      //The client may answer its lookup early and end the walk
+      thinfat_result_t res = thinfat_core_callback(table->client, table->link_event, table->co_current << tf->ctos_shift, &table->ci_current);
+      if (res != THINFAT_RESULT_OK)
+        return res == THINFAT_RESULT_ABORT ? THINFAT_RESULT_OK : res;
+    }
+    if (run.ci_next / nc_entries != ci_sector / nc_entries)
+      return thinfat_table_lookup_read(table);
+  }
+  THINFAT_INFO("Next cluster = " TFF_X32 " after " TFF_U32 " links\n", run.ci_next, table->cc_hops);
+  thinfat_table_measure_run(tf, block, ci_sector, &run);
+  run.cc_hops = table->cc_hops;
+  run.nc_sectors = table->nc_sectors;
+  return thinfat_core_callback(table->client, table->event, table->so_seek, &run);
+}
+
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+static inline int thinfat_table_is_free(const thinfat_table_t *table, thinfat_cluster_t ci)
+{
+  return (table->free_map[ci / 32] >> (ci % 32)) & 1;
+}
+
+//Index of the first extent ending after ci
+static unsigned int thinfat_table_extent_at(const thinfat_table_t *table, thinfat_cluster_t ci)
+{
+  unsigned int i_low = 0, i_high = table->nc_extents;
+  while (i_low < i_high)
+  {
+    unsigned int i = (i_low + i_high) / 2;
+    if (table->extents[i].ci_start + table->extents[i].cc_length <= ci)
+      i_low = i + 1;
+    else
+      i_high = i;
+  }
+  return i_low;
+}
+
+//Adds a free run to the index, in place of the shortest one if it cannot grow and the run is longer
+static void thinfat_table_index_insert(thinfat_table_t *table, thinfat_cluster_t ci_start, thinfat_cluster_t cc_length)
+{
+  unsigned int i;
+  if (table->nc_extents == table->nc_extents_max && table->nc_extents_max < THINFAT_CONFIG_FREE_EXTENTS)
+  {
+    unsigned int nc_max = table->nc_extents_max > 0 ? table->nc_extents_max * 2 : 64;
+    thinfat_table_extent_t *extents;
+    if (nc_max > THINFAT_CONFIG_FREE_EXTENTS)
+      nc_max = THINFAT_CONFIG_FREE_EXTENTS;
+    if ((extents = (thinfat_table_extent_t *)realloc(table->extents, nc_max * sizeof(thinfat_table_extent_t))) != NULL)
+    {
+      table->extents = extents;
+      table->nc_extents_max = nc_max;
+    }
+  }
+  if (table->nc_extents == table->nc_extents_max)
+  {
+    unsigned int i_short = 0;
+    table->extents_complete = 0;
+    if (table->nc_extents == 0)
+      return;
+    for (i = 1; i < table->nc_extents; i++)
+      if (table->extents[i].cc_length < table->extents[i_short].cc_length)
+        i_short = i;
+    if (table->extents[i_short].cc_length >= cc_length)
+      return;
+    table->nc_extents--;
+    memmove(&table->extents[i_short], &table->extents[i_short + 1], (table->nc_extents - i_short) * sizeof(thinfat_table_extent_t));
+  }
+  i = thinfat_table_extent_at(table, ci_start);
+  memmove(&table->extents[i + 1], &table->extents[i], (table->nc_extents - i) * sizeof(thinfat_table_extent_t));
+  table->extents[i].ci_start = ci_start;
+  table->extents[i].cc_length = cc_length;
+  table->nc_extents++;
+}
+
+//Takes [ci_from, ci_to) out of the indexed runs, keeping what is left of them on either side
+static void thinfat_table_index_remove(thinfat_table_t *table, thinfat_cluster_t ci_from, thinfat_cluster_t ci_to)
+{
+  unsigned int i = thinfat_table_extent_at(table, ci_from), j;
+  thinfat_table_extent_t left = {0, 0}, right = {0, 0};
+  for (j = i; j < table->nc_extents && table->extents[j].ci_start < ci_to; j++)
+  {
+    thinfat_cluster_t ci_end = table->extents[j].ci_start + table->extents[j].cc_length;
+    if (table->extents[j].ci_start < ci_from)
+    {
+      left.ci_start = table->extents[j].ci_start;
+      left.cc_length = ci_from - left.ci_start;
+    }
+    if (ci_end > ci_to)
+    {
+      right.ci_start = ci_to;
+      right.cc_length = ci_end - ci_to;
+    }
+  }
+  memmove(&table->extents[i], &table->extents[j], (table->nc_extents - j) * sizeof(thinfat_table_extent_t));
+  table->nc_extents -= j - i;
+  if (left.cc_length > 0)
+    thinfat_table_index_insert(table, left.ci_start, left.cc_length);
+  if (right.cc_length > 0)
+    thinfat_table_index_insert(table, right.ci_start, right.cc_length);
+}
+
+//Indexes the whole free run [ci, ci_end) has become part of
+static void thinfat_table_index_free(thinfat_table_t *table, thinfat_cluster_t ci, thinfat_cluster_t ci_end)
+{
+  thinfat_cluster_t ci_start = ci, ci_next, cc_next;
+  while (ci_start > 2)
+  {
+    if (ci_start % 32 == 0 && table->free_map[ci_start / 32 - 1] == 0xFFFFFFFF)
+      ci_start -= 32;
+    else if (thinfat_table_is_free(table, ci_start - 1))
+      ci_start--;
+    else
+      break;
+  }
+  if ((cc_next = thinfat_scan_next_run(table->free_map, ci_end, table->cc_map, &ci_next)) > 0 && ci_next == ci_end)
+    ci_end += cc_next;
+  thinfat_table_index_remove(table, ci_start, ci_end);
+  thinfat_table_index_insert(table, ci_start, ci_end - ci_start);
+}
+
+//Indexes the longest free runs of the bitmap afresh
+static void thinfat_table_index_rebuild(thinfat_table_t *table)
+{
+  thinfat_cluster_t ci = 2, ci_run, cc_run;
+  table->nc_extents = 0;
+  table->extents_complete = 1;
+  while ((cc_run = thinfat_scan_next_run(table->free_map, ci, table->cc_map, &ci_run)) > 0)
+  {
+    thinfat_table_index_insert(table, ci_run, cc_run);
+    ci = ci_run + cc_run;
+  }
+}
+
+//Marks clusters [ci, ci + cc) free or used, keeping the volume's free count and the extent index in step
+static void thinfat_table_mark(thinfat_table_t *table, thinfat_cluster_t ci, thinfat_cluster_t cc, int free)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t ci_end = ci + cc < table->cc_map ? ci + cc : table->cc_map;
+  if (table->free_map == NULL)
+    return;
+  if (ci < 2)
+    ci = 2;
+  for (thinfat_cluster_t i = ci; i < ci_end; i++)
+  {
+    if (thinfat_table_is_free(table, i) == free)
+      continue;
+    table->free_map[i / 32] ^= (uint32_t)1 << (i % 32);
+    tf->fsinfo_dirty = 1;
+    if (free)
+      tf->cc_free++;
+    else
+      tf->cc_free--;
+  }
+  if (ci >= ci_end)
+    return;
+  if (free)
+    thinfat_table_index_free(table, ci, ci_end);
+  else
+    thinfat_table_index_remove(table, ci, ci_end);
+}
+
+/*
+ * Plans where cc clusters go: into the shortest indexed run that holds them,
+ * or else across the fewest runs, longest first and the last one fitted to
+ * what is left. Returns how many pieces it took, 0 if there is no room, and
+ * leaves what did not fit in THINFAT_CONFIG_ALLOC_PIECES of them in
+ * cc_unplanned for the next batch.
+ */
+static unsigned int thinfat_table_plan(thinfat_table_t *table, thinfat_cluster_t cc)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  unsigned int nc_pieces = 0, i, i_pick;
+  int rebuilt = 0;
+
+  table->cc_unplanned = 0;
+  if (cc > tf->cc_free)
+    return 0;
+
+  for (unsigned int attempt = 0; attempt < 2; attempt++)
+  {
+    if (attempt > 0)
+    {
+      //An incomplete index may have left out the run that fits
+      if (table->extents_complete)
+        break;
+      thinfat_table_index_rebuild(table);
+    }
+    for (i = 0, i_pick = table->nc_extents; i < table->nc_extents; i++)
+      if (table->extents[i].cc_length >= cc && (i_pick == table->nc_extents || table->extents[i].cc_length < table->extents[i_pick].cc_length))
+        i_pick = i;
+    if (i_pick < table->nc_extents)
+    {
+      table->pieces[0].ci_start = table->extents[i_pick].ci_start;
+      table->pieces[0].cc_length = cc;
+      return 1;
+    }
+  }
+
+  while (cc > 0 && nc_pieces < THINFAT_CONFIG_ALLOC_PIECES)
+  {
+    unsigned int i_fit = table->nc_extents, i_long = table->nc_extents, j;
+    for (i = 0; i < table->nc_extents; i++)
+    {
+      for (j = 0; j < nc_pieces && table->pieces[j].ci_start != table->extents[i].ci_start; j++)
+        ;
+      if (j < nc_pieces)
+        continue;
+      if (table->extents[i].cc_length >= cc && (i_fit == table->nc_extents || table->extents[i].cc_length < table->extents[i_fit].cc_length))
+        i_fit = i;
+      if (i_long == table->nc_extents || table->extents[i].cc_length > table->extents[i_long].cc_length)
+        i_long = i;
+    }
+    i_pick = i_fit < table->nc_extents ? i_fit : i_long;
+    if (i_pick == table->nc_extents)
+    {
+      //The runs an incomplete index left out make up the rest
+      if (table->extents_complete || rebuilt++)
+        return 0;
+      thinfat_table_index_rebuild(table);
+      continue;
+    }
+    table->pieces[nc_pieces].ci_start = table->extents[i_pick].ci_start;
+    table->pieces[nc_pieces].cc_length = table->extents[i_pick].cc_length < cc ? table->extents[i_pick].cc_length : cc;
+    cc -= table->pieces[nc_pieces++].cc_length;
+  }
+  table->cc_unplanned = cc;
+
+  //Linked in the order they lie on the volume
+  for (i = 1; i < nc_pieces; i++)
+  {
+    thinfat_table_extent_t piece = table->pieces[i];
+    unsigned int j = i;
+    for (; j > 0 && table->pieces[j - 1].ci_start > piece.ci_start; j--)
+      table->pieces[j] = table->pieces[j - 1];
+    table->pieces[j] = piece;
+  }
+  return nc_pieces;
+}
+
+//First run of cc free clusters within [ci_from, ci_end), or THINFAT_INVALID_CLUSTER
+static thinfat_cluster_t thinfat_table_find_run(const thinfat_table_t *table, thinfat_cluster_t ci_from, thinfat_cluster_t ci_end, thinfat_cluster_t cc)
+{
+  thinfat_cluster_t cc_run = 0;
+  thinfat_cluster_t ci = thinfat_scan_find_run(table->free_map, ci_from, ci_end, cc, &cc_run);
+  return ci < ci_end ? ci - cc + 1 : THINFAT_INVALID_CLUSTER;
+}
+#endif
+
+//Keeps the free count in step with clusters [ci, ci + cc) turning free or used; without the bitmap it trusts the caller
+static void thinfat_table_account(thinfat_table_t *table, thinfat_cluster_t ci, thinfat_cluster_t cc, int free)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  tf->fsinfo_dirty = 1;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  if (table->free_map != NULL)
+  {
+    thinfat_table_mark(table, ci, cc, free);
+    return;
+  }
+#else
+  (void)ci;
+#endif
+  if (tf->cc_free == THINFAT_UNKNOWN_FREE_COUNT)
+    return;
+  if (free)
+    tf->cc_free += cc;
+  else
+    tf->cc_free = tf->cc_free > cc ? tf->cc_free - cc : 0;
+}
+
 static thinfat_result_t thinfat_table_search_read_callback(thinfat_table_t *table, thinfat_sector_t s_param, void *p_param);
+static thinfat_result_t thinfat_table_search_fat(thinfat_table_t *table, thinfat_cluster_t cc_search, uint8_t gather);
+static thinfat_result_t thinfat_table_create_chain(thinfat_table_t *table);
+static thinfat_result_t thinfat_table_next_piece(thinfat_table_t *table);
 static thinfat_result_t thinfat_table_create_chain_callback(thinfat_table_t *table, thinfat_sector_t s_param, void *p_param);
 static thinfat_result_t thinfat_table_deallocate_callback(thinfat_table_t *table, thinfat_sector_t s_param, void *p_param);
+static thinfat_result_t thinfat_table_free_read_callback(thinfat_table_t *table, const void *block);
+static thinfat_result_t thinfat_table_free_write_callback(thinfat_table_t *table, void *block);
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+static thinfat_result_t thinfat_table_scan_read_callback(thinfat_table_t *table, thinfat_sector_t si_end);
+#endif
 
 thinfat_result_t thinfat_table_callback(thinfat_table_t *table, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param)
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
-  thinfat_cluster_t ci_next;
   switch(event)
   {
   case THINFAT_TABLE_EVENT_LOOKUP:
-    if (tf->type == THINFAT_TYPE_FAT32)
-    {
-      ci_next = thinfat_read_u32(*(void **)p_param, (table->ci_current * 4) % THINFAT_SECTOR_SIZE);
-      printf("Next cluster = 0x%08X\n", ci_next);
-    }
-    else
-    {
-      ci_next = thinfat_read_u16(*(void **)p_param, (table->ci_current * 2) % THINFAT_SECTOR_SIZE);
-      if (ci_next >= 0xFFF7)
-      {
-        ci_next = THINFAT_INVALID_CLUSTER;
-      }
-    }
-    return thinfat_core_callback(table->client, table->event, table->so_seek, &ci_next);
+    return thinfat_table_lookup_callback(table, *(void **)p_param);
   case THINFAT_TABLE_EVENT_SEARCH_READ:
     return thinfat_table_search_read_callback(table, s_param, p_param);
   case THINFAT_TABLE_EVENT_SEARCH_FOUND:
     THINFAT_INFO("Cluster found @ " TFF_X32 " * " TFF_U32 "\n", *(thinfat_cluster_t *)p_param, table->cc_search);
-    table->ci_to = *(thinfat_cluster_t *)p_param + table->cc_search;
-    table->ci_from = *(thinfat_cluster_t *)p_param;
-    return thinfat_cached_read_single(table, table->cache, tf->si_hidden + tf->sc_reserved + *(thinfat_cluster_t *)p_param / (THINFAT_SECTOR_SIZE >> tf->type), THINFAT_TABLE_EVENT_CREATE_CHAIN_READ);
-    //return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
+    table->pieces[0].ci_start = *(thinfat_cluster_t *)p_param;
+    table->pieces[0].cc_length = table->cc_search;
+    table->nc_pieces = 1;
+    table->cc_unplanned = 0;
+    return thinfat_table_create_chain(table);
+  case THINFAT_TABLE_EVENT_PIECE_LINKED:
+    return thinfat_table_next_piece(table);
+  case THINFAT_TABLE_EVENT_ALLOC_UNDONE:
+    return thinfat_core_callback(table->alloc_client, table->alloc_event, THINFAT_INVALID_SECTOR, NULL);
+  case THINFAT_TABLE_EVENT_FREE_READ:
+    return thinfat_table_free_read_callback(table, *(void **)p_param);
+  case THINFAT_TABLE_EVENT_FREE_WRITE:
+    return thinfat_table_free_write_callback(table, *(void **)p_param);
   case THINFAT_TABLE_EVENT_CONCATENATE_READ:
     if (tf->type == THINFAT_TYPE_FAT32)
-      thinfat_write_u32(*(void **)p_param, (table->ci_from % (THINFAT_SECTOR_SIZE / 4)) * 4, table->ci_to);
+      thinfat_write_u32(*(void **)p_param, thinfat_sector_offset(tf, table->ci_from * 4), table->ci_to);
     else
-      thinfat_write_u16(*(void **)p_param, (table->ci_from % (THINFAT_SECTOR_SIZE / 2)) * 2, table->ci_to);
+      thinfat_write_u16(*(void **)p_param, thinfat_sector_offset(tf, table->ci_from * 2), table->ci_to);
     thinfat_cache_touch(table->cache);
     return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
   case THINFAT_TABLE_EVENT_CREATE_CHAIN_READ:
     return thinfat_table_create_chain_callback(table, s_param, p_param);
   case THINFAT_TABLE_EVENT_DEALLOCATE_READ:
     return thinfat_table_deallocate_callback(table, s_param, p_param);
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  case THINFAT_TABLE_EVENT_SCAN_READ:
+    return thinfat_table_scan_read_callback(table, s_param);
+#endif
   }
   return THINFAT_RESULT_OK;
 }
 
+//Writes the chain of pieces[i_piece], starting with pieces[0] of the first batch
+static thinfat_result_t thinfat_table_create_chain(thinfat_table_t *table)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  const thinfat_table_extent_t *piece = &table->pieces[table->i_piece];
+
+  if (table->i_piece == 0 && !THINFAT_IS_CLUSTER_VALID(table->ci_tail))
+    table->ci_chain = piece->ci_start;
+  table->nc_runs++;
+  table->ci_from = piece->ci_start;
+  table->ci_to = piece->ci_start + piece->cc_length;
+  tf->ci_next_free = table->ci_to;
+  thinfat_table_account(table, table->ci_from, piece->cc_length, 0);
+  return thinfat_cached_read_single(table, table->cache, tf->si_hidden + tf->sc_reserved + table->ci_from / (tf->sz_sector >> tf->type), THINFAT_TABLE_EVENT_CREATE_CHAIN_READ);
+}
+
+//Gives up an allocation, freeing the batches already linked, and calls back with NULL
+static thinfat_result_t thinfat_table_abandon(thinfat_table_t *table)
+{
+  if (THINFAT_IS_CLUSTER_VALID(table->ci_tail))
+    return thinfat_table_free_chain(table, table, table->ci_chain, THINFAT_TABLE_EVENT_ALLOC_UNDONE);
+  return thinfat_core_callback(table->alloc_client, table->alloc_event, THINFAT_INVALID_SECTOR, NULL);
+}
+
+static thinfat_result_t thinfat_table_next_piece(thinfat_table_t *table)
+{
+  const thinfat_table_extent_t *last = &table->pieces[table->nc_pieces - 1];
+  if (++table->i_piece < table->nc_pieces)
+    return thinfat_table_create_chain(table);
+  if (table->cc_unplanned == 0)
+    return thinfat_core_callback(table->alloc_client, table->alloc_event, THINFAT_INVALID_SECTOR, &table->ci_chain);
+
+  //The next batch hangs off the end of this one
+  table->ci_tail = last->ci_start + last->cc_length - 1;
+  table->i_piece = 0;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  if (table->free_map != NULL)
+  {
+    if ((table->nc_pieces = thinfat_table_plan(table, table->cc_unplanned)) == 0)
+      return thinfat_table_abandon(table);
+    return thinfat_table_create_chain(table);
+  }
+#endif
+  return thinfat_table_search_fat(table, table->cc_unplanned, 1);
+}
+
 static thinfat_result_t thinfat_table_create_chain_callback(thinfat_table_t *table, thinfat_sector_t s_param, void *p_param)
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
-  unsigned int i = table->ci_from % (THINFAT_SECTOR_SIZE >> tf->type);
-  thinfat_cluster_t ci_start = (s_param - tf->si_hidden - tf->sc_reserved) * (THINFAT_SECTOR_SIZE >> tf->type);
-  for (; i < THINFAT_SECTOR_SIZE >> tf->type; i++)
+  unsigned int i = table->ci_from % (tf->sz_sector >> tf->type);
+  thinfat_cluster_t ci_start = (s_param - tf->si_hidden - tf->sc_reserved) * (tf->sz_sector >> tf->type);
+  for (; i < tf->sz_sector >> tf->type; i++)
   {
     if (ci_start + i + 1 == table->ci_to)
     {
@@ -134,7 +515,16 @@ static thinfat_result_t thinfat_table_create_chain_callback(thinfat_table_t *tab
       {
         thinfat_write_u16(*(void **)p_param, i * 2, 0xFFF8);
       }
-      return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
+      thinfat_cache_touch(table->cache);
+      //Each piece after the first hangs off the end of the one before
+      if (table->i_piece > 0)
+      {
+        const thinfat_table_extent_t *prev = &table->pieces[table->i_piece - 1];
+        return thinfat_table_concatenate(table, table, prev->ci_start + prev->cc_length - 1, table->pieces[table->i_piece].ci_start, THINFAT_TABLE_EVENT_PIECE_LINKED);
+      }
+      if (THINFAT_IS_CLUSTER_VALID(table->ci_tail))
+        return thinfat_table_concatenate(table, table, table->ci_tail, table->pieces[0].ci_start, THINFAT_TABLE_EVENT_PIECE_LINKED);
+      return thinfat_table_next_piece(table);
     }
     else
     {
@@ -150,51 +540,275 @@ static thinfat_result_t thinfat_table_create_chain_callback(thinfat_table_t *tab
     }
   }
   thinfat_cache_touch(table->cache);
-  table->ci_from = (table->ci_from + (THINFAT_SECTOR_SIZE >> tf->type)) / (THINFAT_SECTOR_SIZE >> tf->type) * (THINFAT_SECTOR_SIZE >> tf->type);
+  table->ci_from = (table->ci_from + (tf->sz_sector >> tf->type)) / (tf->sz_sector >> tf->type) * (tf->sz_sector >> tf->type);
   return thinfat_cached_read_single(table, table->cache, s_param + 1, THINFAT_TABLE_EVENT_CREATE_CHAIN_READ);
 }
 
+/*
+ * Takes the free runs among the first nc_valid entries of a FAT sector as
+ * pieces, running on the last one if it reaches up to them, until cc_search
+ * clusters are gathered. True once they are, or once the batch is full.
+ */
+static int thinfat_table_gather(thinfat_table_t *table, const uint32_t *mask, thinfat_cluster_t ci_current, thinfat_cluster_t nc_valid)
+{
+  thinfat_cluster_t bi = 0, bi_run, cc_run;
+  while (table->cc_search > 0 && (cc_run = thinfat_scan_next_run(mask, bi, nc_valid, &bi_run)) > 0)
+  {
+    thinfat_table_extent_t *last = table->nc_pieces > 0 ? &table->pieces[table->nc_pieces - 1] : NULL;
+    if (cc_run > table->cc_search)
+      cc_run = table->cc_search;
+    if (last != NULL && last->ci_start + last->cc_length == ci_current + bi_run)
+      last->cc_length += cc_run;
+    else if (table->nc_pieces == THINFAT_CONFIG_ALLOC_PIECES)
+      return 1;
+    else
+    {
+      table->pieces[table->nc_pieces].ci_start = ci_current + bi_run;
+      table->pieces[table->nc_pieces++].cc_length = cc_run;
+    }
+    table->cc_search -= cc_run;
+    bi = bi_run + cc_run;
+  }
+  return table->cc_search == 0;
+}
+
 static thinfat_result_t thinfat_table_search_read_callback(thinfat_table_t *table, thinfat_sector_t si_read, void *p_param)
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
   thinfat_cluster_t cc_total = (tf->si_hidden + tf->sc_volume_size - tf->si_data) >> tf->ctos_shift;
-  thinfat_cluster_t ci_current = (si_read - tf->si_hidden - tf->sc_reserved) * (THINFAT_SECTOR_SIZE >> tf->type);
-  for (unsigned int i = 0; i < THINFAT_SECTOR_SIZE >> tf->type; i++)
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type;
+  thinfat_cluster_t ci_current = (si_read - tf->si_hidden - tf->sc_reserved) * nc_entries;
+  uint32_t mask[THINFAT_CONFIG_MAX_SECTOR_SIZE / 2 / 32];
+
+  thinfat_cluster_t nc_valid = nc_entries;
+  if (ci_current + nc_valid > cc_total + 2)
+    nc_valid = ci_current < cc_total + 2 ? cc_total + 2 - ci_current : 0;
+  thinfat_scan_zero_mask(tf->type, *(void **)p_param, nc_entries, mask);
+  if (!table->search_gather)
   {
-    if (ci_current + i >= cc_total + 2)
-      return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
+    thinfat_cluster_t i = thinfat_scan_find_run(mask, 0, nc_valid, table->cc_search, &table->cc_search_count);
+    if (i < nc_valid)
+    {
+      thinfat_cluster_t ci_start = ci_current + i - table->cc_search + 1;
+      return thinfat_core_callback(table, THINFAT_TABLE_EVENT_SEARCH_FOUND, THINFAT_INVALID_SECTOR, &ci_start);
+    }
+  }
+  else if (thinfat_table_gather(table, mask, ci_current, nc_valid))
+  {
+    table->cc_unplanned = table->cc_search;
+    return thinfat_table_create_chain(table);
+  }
 
-    thinfat_cluster_t ci_value;
-    if (tf->type == THINFAT_TYPE_FAT32)
-      ci_value = thinfat_read_u32(*(void **)p_param, i * 4) & THINFAT_FAT32_CLUSTER_MASK;
-    else
-      ci_value = thinfat_read_u16(*(void **)p_param, i * 2);
-    if (ci_value == 0)
+  //Gathering must not come back to the sector it began at, whose runs it has taken already
+  thinfat_sector_t si_table = tf->si_hidden + tf->sc_reserved, si_last = table->si_search_end - (table->search_gather ? 1 : 0);
+  if (nc_valid == nc_entries && si_read + 1 < si_table + tf->sc_table_size && !(table->search_wrapped && si_read >= si_last))
+    return thinfat_cached_read_single(table, table->cache, si_read + 1, THINFAT_TABLE_EVENT_SEARCH_READ);
+  //Past the end, the search goes on from the start of the FAT up to the sector it began at
+  if (!table->search_wrapped && table->si_search_end > si_table)
+  {
+    table->search_wrapped = 1;
+    table->cc_search_count = 0;
+    return thinfat_cached_read_single(table, table->cache, si_table, THINFAT_TABLE_EVENT_SEARCH_READ);
+  }
+  //No run is long enough, so the FAT is read again for the runs the chain can be made of
+  if (!table->search_gather && (tf->cc_free == THINFAT_UNKNOWN_FREE_COUNT || table->cc_search <= tf->cc_free))
+    return thinfat_table_search_fat(table, table->cc_search, 1);
+  //What was gathered has not been linked yet, so only earlier batches need freeing
+  return thinfat_table_abandon(table);
+}
+
+static int thinfat_table_compare_cluster(const void *a, const void *b)
+{
+  thinfat_cluster_t x = *(const thinfat_cluster_t *)a, y = *(const thinfat_cluster_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static inline thinfat_sector_t thinfat_table_sector_of(thinfat_t *tf, thinfat_cluster_t ci)
+{
+  return tf->si_hidden + tf->sc_reserved + ci / (tf->sz_sector >> tf->type);
+}
+
+//Writes cluster ci free, or the end of the chain if it is the one kept
+static void thinfat_table_free_entry(thinfat_t *tf, void *block, thinfat_cluster_t ci, uint8_t keep)
+{
+  if (tf->type == THINFAT_TYPE_FAT32)
+  {
+    uint32_t ci_value = thinfat_read_u32(block, thinfat_sector_offset(tf, ci * 4)) & THINFAT_FAT32_CLUSTER_HIGH_MASK;
+    thinfat_write_u32(block, thinfat_sector_offset(tf, ci * 4), ci_value | (keep ? THINFAT_FAT32_EOC : 0));
+  }
+  else
+  {
+    thinfat_write_u16(block, thinfat_sector_offset(tf, ci * 2), keep ? 0xFFF8 : 0);
+  }
+}
+
+static thinfat_result_t thinfat_table_free_done(thinfat_table_t *table)
+{
+  return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, &table->cc_freed);
+}
+
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+//Marks cluster ci to be zeroed; false if it cannot belong to the chain or is marked already, as in one looping back on itself
+static int thinfat_table_free_mark(thinfat_table_t *table, thinfat_cluster_t ci)
+{
+  uint32_t bit = (uint32_t)1 << (ci % 32);
+  if (ci >= table->cc_map || (table->free_marks[ci / 32] & bit))
+    return 0;
+  table->free_marks[ci / 32] |= bit;
+  if (ci < table->ci_marked)
+    table->ci_marked = ci;
+  if (ci >= table->ci_marked_end)
+    table->ci_marked_end = ci + 1;
+  return 1;
+}
+
+//Reads the FAT sector of the first cluster still marked, or calls back once there is none
+static thinfat_result_t thinfat_table_free_marked(thinfat_table_t *table)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t ci_run;
+  if (thinfat_scan_next_run(table->free_marks, table->ci_marked, table->ci_marked_end, &ci_run) == 0)
+    return thinfat_table_free_done(table);
+  table->ci_marked = ci_run;
+  return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, ci_run), THINFAT_TABLE_EVENT_FREE_WRITE);
+}
+
+//Zeroes the marked clusters the FAT sector at `block` holds, a run at a time, and moves to the next sector with any
+static thinfat_result_t thinfat_table_free_marked_callback(thinfat_table_t *table, void *block)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type;
+  thinfat_cluster_t ci_end = table->ci_marked - table->ci_marked % nc_entries + nc_entries;
+  thinfat_cluster_t ci_run, cc_run;
+
+  if (ci_end > table->ci_marked_end)
+    ci_end = table->ci_marked_end;
+  while ((cc_run = thinfat_scan_next_run(table->free_marks, table->ci_marked, ci_end, &ci_run)) > 0)
+  {
+    for (thinfat_cluster_t ci = ci_run; ci < ci_run + cc_run; ci++)
     {
-      table->cc_search_count++;
-      if (table->cc_search_count == table->cc_search)
-      {
-        thinfat_cluster_t ci_start = ci_current - table->cc_search_count + 1;
-        return thinfat_core_callback(table, THINFAT_TABLE_EVENT_SEARCH_FOUND, THINFAT_INVALID_SECTOR, &ci_start);
-      }
+      thinfat_table_free_entry(tf, block, ci, ci == table->ci_keep);
+      table->free_marks[ci / 32] &= ~((uint32_t)1 << (ci % 32));
+    }
+    if (table->ci_keep >= ci_run && table->ci_keep < ci_run + cc_run)
+    {
+      if (table->ci_keep > ci_run)
+        thinfat_table_account(table, ci_run, table->ci_keep - ci_run, 1);
+      if (table->ci_keep + 1 < ci_run + cc_run)
+        thinfat_table_account(table, table->ci_keep + 1, ci_run + cc_run - table->ci_keep - 1, 1);
+      table->cc_freed += cc_run - 1;
     }
     else
     {
-      table->cc_search_count = 0;
+      thinfat_table_account(table, ci_run, cc_run, 1);
+      table->cc_freed += cc_run;
     }
+    table->ci_marked = ci_run + cc_run;
   }
-  if (si_read + 1 < tf->sc_table_size)
-    return thinfat_cached_read_single(table, table->cache, si_read + 1, THINFAT_TABLE_EVENT_SEARCH_READ);
-  else
-    return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
+  thinfat_cache_touch(table->cache);
+  table->ci_marked = ci_end;
+  return thinfat_table_free_marked(table);
+}
+#endif
+
+//Zeroes the batch from the first of its FAT sectors on, in cluster order
+static thinfat_result_t thinfat_table_free_batch(thinfat_table_t *table)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  qsort(table->free_batch, table->nc_batch, sizeof(thinfat_cluster_t), thinfat_table_compare_cluster);
+  table->i_batch = 0;
+  return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, table->free_batch[0]), THINFAT_TABLE_EVENT_FREE_WRITE);
+}
+
+/*
+ * Gathers the links of the chain the FAT sector at `block` holds, from
+ * ci_free on, and moves to the sector of the next one. Marked clusters are
+ * written once the chain has ended, or the batch once it is full.
+ */
+static thinfat_result_t thinfat_table_free_read_callback(thinfat_table_t *table, const void *block)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type, ci_sector = table->ci_free;
+
+  for (;;)
+  {
+    thinfat_cluster_t ci_next = thinfat_table_entry(tf, block, table->ci_free);
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+    if (table->free_marking)
+    {
+      if (!thinfat_table_free_mark(table, table->ci_free) || ci_next < 2 || !THINFAT_IS_CLUSTER_VALID(ci_next))
+        return thinfat_table_free_marked(table);
+      table->ci_free = ci_next;
+      if (ci_next / nc_entries != ci_sector / nc_entries)
+        return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, ci_next), THINFAT_TABLE_EVENT_FREE_READ);
+      continue;
+    }
+#endif
+    table->free_batch[table->nc_batch++] = table->ci_free;
+    table->ci_free = ci_next < 2 || !THINFAT_IS_CLUSTER_VALID(ci_next) ? THINFAT_INVALID_CLUSTER : ci_next;
+    if (!THINFAT_IS_CLUSTER_VALID(table->ci_free) || table->nc_batch == THINFAT_CONFIG_FREE_BATCH)
+      return thinfat_table_free_batch(table);
+    if (ci_next / nc_entries != ci_sector / nc_entries)
+      return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, ci_next), THINFAT_TABLE_EVENT_FREE_READ);
+  }
+}
+
+/*
+ * Zeroes the entries of the batch the FAT sector at `block` holds, or marks
+ * the end of the chain in the one kept. A corrupt chain looping back on
+ * itself shows up as the same cluster twice, and ends at an entry already
+ * zeroed once the walk comes back to it.
+ */
+static thinfat_result_t thinfat_table_free_write_callback(thinfat_table_t *table, void *block)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type, ci_sector;
+
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  if (table->free_marking)
+    return thinfat_table_free_marked_callback(table, block);
+#endif
+  ci_sector = table->free_batch[table->i_batch];
+  for (; table->i_batch < table->nc_batch; table->i_batch++)
+  {
+    thinfat_cluster_t ci = table->free_batch[table->i_batch];
+    uint8_t keep = ci == table->ci_keep;
+    if (ci / nc_entries != ci_sector / nc_entries)
+      break;
+    if (table->i_batch > 0 && table->free_batch[table->i_batch - 1] == ci)
+      continue;
+    thinfat_table_free_entry(tf, block, ci, keep);
+    if (keep)
+      continue;
+    if (table->cc_freed_run > 0 && table->ci_freed_run + table->cc_freed_run != ci)
+    {
+      thinfat_table_account(table, table->ci_freed_run, table->cc_freed_run, 1);
+      table->cc_freed_run = 0;
+    }
+    if (table->cc_freed_run++ == 0)
+      table->ci_freed_run = ci;
+    table->cc_freed++;
+  }
+  thinfat_cache_touch(table->cache);
+  if (table->i_batch < table->nc_batch)
+    return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, table->free_batch[table->i_batch]), THINFAT_TABLE_EVENT_FREE_WRITE);
+
+  if (table->cc_freed_run > 0)
+    thinfat_table_account(table, table->ci_freed_run, table->cc_freed_run, 1);
+  table->cc_freed_run = 0;
+  table->nc_batch = 0;
+  if (THINFAT_IS_CLUSTER_VALID(table->ci_free))
+    return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, table->ci_free), THINFAT_TABLE_EVENT_FREE_READ);
+  return thinfat_table_free_done(table);
 }
 
 static thinfat_result_t thinfat_table_deallocate_callback(thinfat_table_t *table, thinfat_sector_t s_param, void *p_param)
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
-  unsigned int i = table->ci_from % (THINFAT_SECTOR_SIZE >> tf->type);
+  unsigned int i = table->ci_from % (tf->sz_sector >> tf->type);
+  thinfat_cluster_t ci_start = table->ci_from - i;
 
-  for (; i < THINFAT_SECTOR_SIZE >> tf->type; i++)
+  for (; i < tf->sz_sector >> tf->type; i++)
   {
     if (tf->type == THINFAT_TYPE_FAT32)
     {
@@ -205,13 +819,14 @@ static thinfat_result_t thinfat_table_deallocate_callback(thinfat_table_t *table
     {
       thinfat_write_u16(*(void **)p_param, i * 2, 0);
     }
-    if (table->ci_from + i + 1 == table->ci_to)
+    if (ci_start + i + 1 == table->ci_to)
     {
+      thinfat_cache_touch(table->cache);
       return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
     }
   }
   thinfat_cache_touch(table->cache);
-  table->ci_from = (table->ci_from + (THINFAT_SECTOR_SIZE >> tf->type)) / (THINFAT_SECTOR_SIZE >> tf->type) * (THINFAT_SECTOR_SIZE >> tf->type);
+  table->ci_from = (table->ci_from + (tf->sz_sector >> tf->type)) / (tf->sz_sector >> tf->type) * (tf->sz_sector >> tf->type);
   return thinfat_cached_read_single(table, table->cache, s_param + 1, THINFAT_TABLE_EVENT_DEALLOCATE_READ);
 }
 
@@ -219,31 +834,95 @@ thinfat_result_t thinfat_table_init(thinfat_table_t *table, thinfat_t *parent, t
 {
   table->parent = parent;
   table->cache = cache;
+  table->ci_chain = THINFAT_INVALID_CLUSTER;
+  table->free_batch = NULL;
+  table->nc_pieces = 0;
+  table->nc_runs = 0;
+  table->alloc_policy = THINFAT_CONFIG_ALLOC_BEST_FIT ? THINFAT_ALLOC_BEST_FIT : THINFAT_ALLOC_NEXT_FIT;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  table->free_map = NULL;
+  table->cc_map = 0;
+  table->free_marks = NULL;
+  table->nc_scan_streams = THINFAT_CONFIG_TABLE_SCAN_STREAMS;
+  table->extents = NULL;
+  table->nc_extents = 0;
+  table->nc_extents_max = 0;
+  table->extents_complete = 0;
+  table->nc_streams = 0;
+  for (unsigned int i = 0; i < THINFAT_CONFIG_TABLE_SCAN_STREAMS; i++)
+    table->streams[i].buffer = NULL;
+#endif
   return THINFAT_RESULT_OK;
 }
 
-static thinfat_result_t thinfat_table_search(thinfat_table_t *table, thinfat_cluster_t cc_search)
+//Reads the FAT from the sector of the next free cluster on, wrapping around, for a run of cc_search free clusters or, gathering, for the runs that make them up
+static thinfat_result_t thinfat_table_search_fat(thinfat_table_t *table, thinfat_cluster_t cc_search, uint8_t gather)
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
 
   thinfat_cluster_t ci_initial = tf->ci_next_free;
-  if (!THINFAT_IS_CLUSTER_VALID(ci_initial))
+  if (ci_initial < 2 || !THINFAT_IS_CLUSTER_VALID(ci_initial))
     ci_initial = 2;
   
-  thinfat_sector_t si_table = tf->si_hidden + tf->sc_reserved + ci_initial / (THINFAT_SECTOR_SIZE >> tf->type);
+  thinfat_sector_t si_table = tf->si_hidden + tf->sc_reserved + ci_initial / (tf->sz_sector >> tf->type);
 
   table->cc_search = cc_search;
   table->cc_search_count = 0;
+  table->si_search_end = si_table;
+  table->search_wrapped = 0;
+  table->search_gather = gather;
+  table->nc_pieces = 0;
 
   return thinfat_cached_read_single(table, table->cache, si_table, THINFAT_TABLE_EVENT_SEARCH_READ);
 }
 
+static thinfat_result_t thinfat_table_search(thinfat_table_t *table, thinfat_cluster_t cc_search)
+{
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  thinfat_t *tf = (thinfat_t *)table->parent;
+
+  if (table->free_map != NULL)
+  {
+    thinfat_cluster_t ci_initial = tf->ci_next_free;
+    if (ci_initial < 2 || !THINFAT_IS_CLUSTER_VALID(ci_initial))
+      ci_initial = 2;
+    table->nc_pieces = 0;
+    table->cc_unplanned = 0;
+    if (table->alloc_policy == THINFAT_ALLOC_NEXT_FIT)
+    {
+      //A run may not wrap past the end, so the second pass overlaps the first by cc_search - 1
+      thinfat_cluster_t ci_start = THINFAT_INVALID_CLUSTER;
+      if (ci_initial < table->cc_map)
+        ci_start = thinfat_table_find_run(table, ci_initial, table->cc_map, cc_search);
+      if (ci_start == THINFAT_INVALID_CLUSTER)
+        ci_start = thinfat_table_find_run(table, 2, ci_initial + cc_search - 1 < table->cc_map ? ci_initial + cc_search - 1 : table->cc_map, cc_search);
+      if (ci_start != THINFAT_INVALID_CLUSTER)
+      {
+        table->pieces[0].ci_start = ci_start;
+        table->pieces[0].cc_length = cc_search;
+        table->nc_pieces = 1;
+      }
+    }
+    if (table->nc_pieces == 0 && (table->nc_pieces = thinfat_table_plan(table, cc_search)) == 0)
+      return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
+    return thinfat_table_create_chain(table);
+  }
+#endif
+
+  return thinfat_table_search_fat(table, cc_search, 0);
+}
+
 thinfat_result_t thinfat_table_allocate(void *client, thinfat_table_t *table, thinfat_cluster_t cc_allocate, thinfat_core_event_t event)
 {
   //thinfat_t *tf = (thinfat_t *)table->parent;
 
   table->client = client;
   table->event = event;
+  table->alloc_client = client;
+  table->alloc_event = event;
+  table->i_piece = 0;
+  table->nc_runs = 0;
+  table->ci_tail = THINFAT_INVALID_CLUSTER;
 
   return thinfat_table_search(table, cc_allocate);
 }
@@ -252,12 +931,13 @@ thinfat_result_t thinfat_table_deallocate(void *client, thinfat_table_t *table,
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
 
-  thinfat_sector_t si_read = tf->si_hidden + tf->sc_reserved + ci_deallocate / (THINFAT_SECTOR_SIZE >> tf->type);
+  thinfat_sector_t si_read = tf->si_hidden + tf->sc_reserved + ci_deallocate / (tf->sz_sector >> tf->type);
 
   table->client = client;
   table->event = event;
   table->ci_from = ci_deallocate;
   table->ci_to = ci_deallocate + cc_deallocate;
+  thinfat_table_account(table, ci_deallocate, cc_deallocate, 1);
 
   return thinfat_cached_read_single(table, table->cache, si_read, THINFAT_TABLE_EVENT_DEALLOCATE_READ);
 }
@@ -266,17 +946,288 @@ thinfat_result_t thinfat_table_concatenate(void *client, thinfat_table_t *table,
 {
   thinfat_t *tf = (thinfat_t *)table->parent;
 
-  thinfat_sector_t si_read = tf->si_hidden + tf->sc_reserved + ci_from / (THINFAT_SECTOR_SIZE >> tf->type);
+  thinfat_sector_t si_read = tf->si_hidden + tf->sc_reserved + ci_from / (tf->sz_sector >> tf->type);
 
   table->client = client;
   table->event = event;
   table->ci_from = ci_from;
   table->ci_to = ci_to;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  thinfat_table_mark(table, ci_from, 1, ci_to == 0);
+#endif
 
   return thinfat_cached_read_single(table, table->cache, si_read, THINFAT_TABLE_EVENT_CONCATENATE_READ);
 }
 
-thinfat_result_t thinfat_table_truncate(void *client, thinfat_table_t *table, thinfat_cluster_t ci_from, thinfat_core_event_t event)
+static thinfat_result_t thinfat_table_free(void *client, thinfat_table_t *table, thinfat_cluster_t ci_start, thinfat_cluster_t ci_keep, thinfat_core_event_t event)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+
+  table->free_marking = 0;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  //The marks take as much memory as the free-cluster bitmap; without room for them, the chain is freed in batches
+  if (table->free_map != NULL && table->free_marks == NULL)
+    table->free_marks = (uint32_t *)calloc((table->cc_map + 31) / 32, sizeof(uint32_t));
+  table->free_marking = table->free_map != NULL && table->free_marks != NULL;
+  table->ci_marked = table->cc_map;
+  table->ci_marked_end = 0;
+#endif
+  if (!table->free_marking && table->free_batch == NULL && (table->free_batch = (thinfat_cluster_t *)malloc(THINFAT_CONFIG_FREE_BATCH * sizeof(thinfat_cluster_t))) == NULL)
+    return THINFAT_RESULT_UNSUPPORTED;
+  table->client = client;
+  table->event = event;
+  table->ci_free = ci_start;
+  table->ci_keep = ci_keep;
+  table->cc_freed_run = 0;
+  table->cc_freed = 0;
+  table->nc_batch = 0;
+  if (ci_start < 2 || !THINFAT_IS_CLUSTER_VALID(ci_start))
+    return thinfat_table_free_done(table);
+  return thinfat_cached_read_single(table, table->cache, thinfat_table_sector_of(tf, ci_start), THINFAT_TABLE_EVENT_FREE_READ);
+}
+
+thinfat_result_t thinfat_table_free_chain(void *client, thinfat_table_t *table, thinfat_cluster_t ci_head, thinfat_core_event_t event)
+{
+  return thinfat_table_free(client, table, ci_head, THINFAT_INVALID_CLUSTER, event);
+}
+
+thinfat_result_t thinfat_table_truncate(void *client, thinfat_table_t *table, thinfat_cluster_t ci_last, thinfat_core_event_t event)
+{
+  return thinfat_table_free(client, table, ci_last, ci_last, event);
+}
+
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+static thinfat_sector_t thinfat_table_scan_sectors(thinfat_t *tf)
+{
+  thinfat_sector_t sc_scan = thinfat_btos(tf, THINFAT_CONFIG_TABLE_SCAN_SIZE);
+  return sc_scan > 0 ? sc_scan : 1;
+}
+
+static thinfat_result_t thinfat_table_scan_read(thinfat_table_t *table, thinfat_table_stream_t *stream)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_segment_t segment;
+
+  stream->sc_read = thinfat_table_scan_sectors(tf);
+  if (stream->sc_read > stream->so_end - stream->so_next)
+    stream->sc_read = stream->so_end - stream->so_next;
+  segment.data = stream->buffer;
+  segment.sc_data = stream->sc_read;
+  return thinfat_phy_read_vector(table, tf->phy, tf->si_hidden + tf->sc_reserved + stream->so_next, &segment, 1, THINFAT_TABLE_EVENT_SCAN_READ);
+}
+
+//Counts the free clusters of the slice [ci_begin, ci_end) in the map and notes its runs
+static void thinfat_table_summarize(thinfat_table_t *table, thinfat_table_stream_t *stream, thinfat_cluster_t ci_begin, thinfat_cluster_t ci_end)
+{
+  thinfat_cluster_t ci = ci_begin, ci_run, cc_run;
+
+  stream->summary.cc_free = thinfat_scan_count(&table->free_map[ci_begin / 32], (ci_end - ci_begin + 31) / 32);
+  stream->summary.ci_first = THINFAT_INVALID_CLUSTER;
+  stream->summary.ci_longest = THINFAT_INVALID_CLUSTER;
+  stream->summary.cc_longest = 0;
+  stream->cc_head = 0;
+  stream->cc_tail = 0;
+  while ((cc_run = thinfat_scan_next_run(table->free_map, ci, ci_end, &ci_run)) > 0)
+  {
+    if (stream->summary.ci_first == THINFAT_INVALID_CLUSTER)
+      stream->summary.ci_first = ci_run;
+    if (ci_run == ci_begin)
+      stream->cc_head = cc_run;
+    if (ci_run + cc_run == ci_end)
+      stream->cc_tail = cc_run;
+    if (cc_run > stream->summary.cc_longest)
+    {
+      stream->summary.ci_longest = ci_run;
+      stream->summary.cc_longest = cc_run;
+    }
+    ci = ci_run + cc_run;
+  }
+}
+
+//Adds up the slices in order, joining free runs that cross from one into the next
+static void thinfat_table_merge(thinfat_table_t *table)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_table_summary_t *summary = &table->summary;
+  thinfat_cluster_t ci_open = THINFAT_INVALID_CLUSTER, cc_open = 0;
+
+  summary->cc_free = 0;
+  summary->ci_first = THINFAT_INVALID_CLUSTER;
+  summary->ci_longest = THINFAT_INVALID_CLUSTER;
+  summary->cc_longest = 0;
+  for (unsigned int i = 0; i < table->nc_streams; i++)
+  {
+    thinfat_table_stream_t *stream = &table->streams[i];
+    thinfat_cluster_t ci_begin = i * table->sc_slice * (tf->sz_sector >> tf->type);
+    thinfat_cluster_t ci_end = stream->so_end * (tf->sz_sector >> tf->type);
+    if (ci_end > table->cc_map)
+      ci_end = table->cc_map;
+
+    summary->cc_free += stream->summary.cc_free;
+    if (summary->ci_first == THINFAT_INVALID_CLUSTER)
+      summary->ci_first = stream->summary.ci_first;
+    if (cc_open == 0)
+      ci_open = ci_begin;
+    if (stream->cc_head == ci_end - ci_begin)
+    {
+      cc_open += stream->cc_head;
+      continue;
+    }
+    cc_open += stream->cc_head;
+    if (cc_open > summary->cc_longest)
+    {
+      summary->ci_longest = ci_open;
+      summary->cc_longest = cc_open;
+    }
+    if (stream->summary.cc_longest > summary->cc_longest)
+    {
+      summary->ci_longest = stream->summary.ci_longest;
+      summary->cc_longest = stream->summary.cc_longest;
+    }
+    cc_open = stream->cc_tail;
+    ci_open = ci_end - stream->cc_tail;
+  }
+  if (cc_open > summary->cc_longest)
+  {
+    summary->ci_longest = ci_open;
+    summary->cc_longest = cc_open;
+  }
+}
+
+static thinfat_result_t thinfat_table_scan_read_callback(thinfat_table_t *table, thinfat_sector_t si_end)
+{
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type;
+  thinfat_table_stream_t *stream = &table->streams[(si_end - 1 - tf->si_hidden - tf->sc_reserved) / table->sc_slice];
+  thinfat_cluster_t ci = stream->so_next * nc_entries;
+  thinfat_cluster_t nc_words = (table->cc_map + 31) / 32 - ci / 32;
+  uint32_t *mask = &table->free_map[ci / 32];
+
+  //Sectors hold a multiple of 32 entries, and the last read covers the map's last word
+  if (nc_words > stream->sc_read * nc_entries / 32)
+    nc_words = stream->sc_read * nc_entries / 32;
+  thinfat_scan_zero_mask(tf->type, stream->buffer, nc_words * 32, mask);
+  if (ci == 0)
+    mask[0] &= ~(uint32_t)3;
+  if (ci / 32 + nc_words == (table->cc_map + 31) / 32 && table->cc_map % 32 != 0)
+    mask[nc_words - 1] &= ((uint32_t)1 << (table->cc_map % 32)) - 1;
+
+  stream->so_next += stream->sc_read;
+  if (stream->so_next < stream->so_end)
+    return thinfat_table_scan_read(table, stream);
+
+  thinfat_cluster_t ci_begin = (thinfat_cluster_t)(stream - table->streams) * table->sc_slice * nc_entries;
+  thinfat_cluster_t ci_end = stream->so_end * nc_entries;
+  thinfat_table_summarize(table, stream, ci_begin, ci_end < table->cc_map ? ci_end : table->cc_map);
+  free(stream->buffer);
+  stream->buffer = NULL;
+  for (unsigned int i = 0; i < table->nc_streams; i++)
+    if (table->streams[i].buffer != NULL)
+      return THINFAT_RESULT_OK;
+
+  thinfat_table_merge(table);
+  thinfat_table_index_rebuild(table);
+  //Corrections to FSInfo go back at the next sync
+  if (tf->cc_free != table->summary.cc_free)
+    tf->fsinfo_dirty = 1;
+  tf->cc_free = table->summary.cc_free;
+  //FSInfo only hints at where to look, and FAT16 has no hint at all
+  if (tf->ci_next_free < 2 || tf->ci_next_free >= table->cc_map || !thinfat_table_is_free(table, tf->ci_next_free))
+  {
+    tf->ci_next_free = table->summary.ci_first != THINFAT_INVALID_CLUSTER ? table->summary.ci_first : 2;
+    tf->fsinfo_dirty = 1;
+  }
+  THINFAT_INFO("Free clusters: " TFF_U32 " of " TFF_U32 ", longest run " TFF_U32 " @ " TFF_X32 "\n",
+               tf->cc_free, table->cc_map - 2, table->summary.cc_longest, table->summary.ci_longest);
+  return thinfat_core_callback(table->client, table->event, THINFAT_INVALID_SECTOR, NULL);
+}
+#endif
+
+/*
+ * Reads the whole FAT once to build the free-cluster bitmap, count the free
+ * clusters and find the longest free run, then calls back. The FAT is cut
+ * into slices that are read side by side, so that drivers keeping several
+ * requests in flight overlap them.
+ */
+thinfat_result_t thinfat_table_scan(void *client, thinfat_table_t *table, thinfat_core_event_t event)
+{
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  thinfat_t *tf = (thinfat_t *)table->parent;
+  thinfat_cluster_t cc_total = (tf->si_hidden + tf->sc_volume_size - tf->si_data) >> tf->ctos_shift;
+  thinfat_cluster_t nc_entries = tf->sz_sector >> tf->type;
+  thinfat_sector_t sc_map;
+
+  thinfat_table_release(table);
+  if (table->nc_scan_streams == 0)
+    return thinfat_core_callback(client, event, THINFAT_INVALID_SECTOR, NULL);
+  table->client = client;
+  table->event = event;
+  table->cc_map = cc_total + 2;
+  if (table->cc_map > tf->sc_table_size * nc_entries)
+    table->cc_map = tf->sc_table_size * nc_entries;
+  sc_map = (table->cc_map + nc_entries - 1) / nc_entries;
+  table->sc_slice = (sc_map + table->nc_scan_streams - 1) / table->nc_scan_streams;
+  table->nc_streams = (sc_map + table->sc_slice - 1) / table->sc_slice;
+  table->free_map = (uint32_t *)calloc((table->cc_map + 31) / 32, sizeof(uint32_t));
+  for (unsigned int i = 0; i < table->nc_streams && table->free_map != NULL; i++)
+  {
+    table->streams[i].so_next = i * table->sc_slice;
+    table->streams[i].so_end = table->streams[i].so_next + table->sc_slice < sc_map ? table->streams[i].so_next + table->sc_slice : sc_map;
+    table->streams[i].buffer = (uint8_t *)malloc(thinfat_stob(tf, thinfat_table_scan_sectors(tf)));
+    if (table->streams[i].buffer == NULL)
+      thinfat_table_release(table);
+  }
+  //Without the memory, allocation goes on reading the FAT as it would without the bitmap
+  if (table->free_map == NULL)
+  {
+    THINFAT_INFO("No memory for the free-cluster bitmap.\n");
+    return thinfat_core_callback(client, event, THINFAT_INVALID_SECTOR, NULL);
+  }
+  for (unsigned int i = 0; i < table->nc_streams; i++)
+  {
+    thinfat_result_t result = thinfat_table_scan_read(table, &table->streams[i]);
+    if (result != THINFAT_RESULT_OK)
+      return result;
+  }
+  return THINFAT_RESULT_OK;
+#else
+  (void)table;
+  return thinfat_core_callback(client, event, THINFAT_INVALID_SECTOR, NULL);
+#endif
+}
+
+void thinfat_table_release(thinfat_table_t *table)
+{
+  free(table->free_batch);
+  table->free_batch = NULL;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  free(table->free_map);
+  table->free_map = NULL;
+  table->cc_map = 0;
+  free(table->free_marks);
+  table->free_marks = NULL;
+  free(table->extents);
+  table->extents = NULL;
+  table->nc_extents = 0;
+  table->nc_extents_max = 0;
+  table->extents_complete = 0;
+  for (unsigned int i = 0; i < table->nc_streams; i++)
+  {
+    free(table->streams[i].buffer);
+    table->streams[i].buffer = NULL;
+  }
+  table->nc_streams = 0;
+#endif
+}
+
+//Bytes the free-cluster bitmap takes, 0 when there is none
+size_t thinfat_table_map_size(const thinfat_table_t *table)
 {
-  return thinfat_table_concatenate(client, table, ci_from, THINFAT_FAT32_EOC, event);
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  if (table->free_map != NULL)
+    return (table->cc_map + 31) / 32 * sizeof(uint32_t);
+#else
+  (void)table;
+#endif
+  return 0;
 }
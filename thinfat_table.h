@@ -7,11 +7,38 @@
 #ifndef THINFAT_TABLE_H
 #define THINFAT_TABLE_H
 
-#include "thinfat_common.h"
+#include "thinfat.h"
 
 struct thinfat_tag;
 struct thinfat_cache_tag;
 
+//Free space as the mount-time scan found it, or one slice of it
+typedef struct thinfat_table_summary_tag
+{
+  thinfat_cluster_t cc_free;
+  thinfat_cluster_t ci_first;
+  thinfat_cluster_t ci_longest, cc_longest;
+}
+thinfat_table_summary_t;
+
+//cc_length clusters from ci_start on
+typedef struct thinfat_table_extent_tag
+{
+  thinfat_cluster_t ci_start;
+  thinfat_cluster_t cc_length;
+}
+thinfat_table_extent_t;
+
+//One slice of the FAT the mount-time scan reads, with the free runs it found at either end
+typedef struct thinfat_table_stream_tag
+{
+  uint8_t *buffer;
+  thinfat_sector_t so_next, so_end, sc_read;
+  thinfat_cluster_t cc_head, cc_tail;
+  thinfat_table_summary_t summary;
+}
+thinfat_table_stream_t;
+
 typedef struct thinfat_table_tag
 {
   void *client;
@@ -22,30 +49,133 @@ typedef struct thinfat_table_tag
   {
     struct
     {
-      thinfat_cluster_t ci_current;
+      //Cluster the walk has reached and its offset in the chain, with the links and FAT sectors it took
+      thinfat_cluster_t ci_current, co_current;
       thinfat_sector_t so_seek;
+      thinfat_cluster_t cc_hops;
+      unsigned int nc_sectors;
+      thinfat_core_event_t link_event;
     };
     struct
     {
       thinfat_cluster_t cc_search_count;
       thinfat_cluster_t cc_search;
+      //FAT sector the search began at, which it comes back to after wrapping around
+      thinfat_sector_t si_search_end;
+      uint8_t search_wrapped;
+      //Whether free runs are gathered into pieces, once no single run is long enough
+      uint8_t search_gather;
     };
     struct
     {
       thinfat_cluster_t ci_from;
       thinfat_cluster_t ci_to;
     };
+    struct
+    {
+      //Next cluster of the chain being freed, the run of freed clusters not yet accounted for, and the total
+      thinfat_cluster_t ci_free;
+      thinfat_cluster_t ci_freed_run, cc_freed_run;
+      thinfat_cluster_t cc_freed;
+      //Cluster kept as the new end of the chain, THINFAT_INVALID_CLUSTER if none
+      thinfat_cluster_t ci_keep;
+      //Clusters gathered in the batch, and how many of them are written
+      unsigned int nc_batch, i_batch;
+      //With free_marks in use instead: the clusters left to zero lie in [ci_marked, ci_marked_end)
+      uint8_t free_marking;
+      thinfat_cluster_t ci_marked, ci_marked_end;
+    };
   };
+  //First cluster of the chain the last allocation made
+  thinfat_cluster_t ci_chain;
+  //THINFAT_CONFIG_FREE_BATCH clusters of the chain being freed, allocated on first use
+  thinfat_cluster_t *free_batch;
+  //Runs of free clusters the batch of the allocation in progress is made of, linked in this order
+  thinfat_table_extent_t pieces[THINFAT_CONFIG_ALLOC_PIECES];
+  unsigned int nc_pieces, i_piece;
+  //Runs the last allocation took in all its batches, clusters left for the batches after this one, and the end of those linked
+  unsigned int nc_runs;
+  thinfat_cluster_t cc_unplanned, ci_tail;
+  void *alloc_client;
+  thinfat_core_event_t alloc_event;
+  thinfat_alloc_policy_t alloc_policy;
+#if THINFAT_CONFIG_ENABLE_FREE_BITMAP
+  //Bit ci set while cluster ci is free; NULL until a scan has completed
+  uint32_t *free_map;
+  thinfat_cluster_t cc_map;
+  //Bit ci set while cluster ci waits to be zeroed by the free in progress, allocated on first use
+  uint32_t *free_marks;
+  thinfat_table_stream_t streams[THINFAT_CONFIG_TABLE_SCAN_STREAMS];
+  unsigned int nc_scan_streams, nc_streams;
+  thinfat_sector_t sc_slice;
+  thinfat_table_summary_t summary;
+  /*
+   * Maximal runs of free clusters in the bitmap by position, in an array
+   * grown up to THINFAT_CONFIG_FREE_EXTENTS; `complete` while no run is left
+   * out. Every change to the bitmap is carried over, so only an incomplete
+   * index that no longer holds a fit needs rebuilding.
+   */
+  thinfat_table_extent_t *extents;
+  unsigned int nc_extents, nc_extents_max;
+  uint8_t extents_complete;
+#endif
 }
 thinfat_table_t;
 
+/*
+ * What thinfat_table_lookup() calls back with: the cluster found, and how
+ * many clusters from it on the FAT sector it came from shows to be
+ * contiguous. It starts with the cluster, so clients may read it as one.
+ * The walk took cc_hops links, read from nc_sectors FAT sectors.
+ */
+typedef struct thinfat_table_run_tag
+{
+  thinfat_cluster_t ci_next;
+  thinfat_cluster_t cc_run;
+  thinfat_cluster_t cc_hops;
+  unsigned int nc_sectors;
+}
+thinfat_table_run_t;
+
 thinfat_result_t thinfat_table_callback(thinfat_table_t *table, thinfat_core_event_t event, thinfat_sector_t s_param, void *p_param);
 
 thinfat_result_t thinfat_table_init(thinfat_table_t *table, thinfat_t *parent, struct thinfat_cache_tag *cache);
+/*
+ * Follows the chain from cluster ci_current, which holds sector so_current
+ * of it, to the cluster holding sector so_seek. Every link a FAT sector
+ * holds is followed before the next one is read, so a walk costs one cache
+ * read per FAT sector it crosses. A seek backwards takes a single link.
+ */
 thinfat_result_t thinfat_table_lookup(void *client, thinfat_table_t *table, thinfat_cluster_t ci_current, thinfat_sector_t so_current, thinfat_sector_t so_seek, thinfat_core_event_t event);
+//The same, also calling back with link_event for every cluster passed on the way, with its first sector offset and a pointer to it
+thinfat_result_t thinfat_table_walk(void *client, thinfat_table_t *table, thinfat_cluster_t ci_current, thinfat_sector_t so_current, thinfat_sector_t so_seek, thinfat_core_event_t link_event, thinfat_core_event_t event);
+/*
+ * Calls back with a pointer to the first cluster of the new chain, or with
+ * NULL if there is no room. A chain no free run can hold is made of several,
+ * THINFAT_CONFIG_ALLOC_PIECES at a time: the longest ones with the
+ * free-cluster bitmap, else those found first reading the FAT on. Each batch
+ * is linked to the one before, and a chain that still falls short frees
+ * what it had taken. The pieces of the last batch are left in pieces[], and
+ * nc_runs counts those of all of them.
+ */
 thinfat_result_t thinfat_table_allocate(void *client, thinfat_table_t *table, thinfat_cluster_t cc_alloc, thinfat_core_event_t event);
 thinfat_result_t thinfat_table_deallocate(void *client, thinfat_table_t *table, thinfat_cluster_t ci_dealloc, thinfat_cluster_t cc_dealloc, thinfat_core_event_t event);
 thinfat_result_t thinfat_table_concatenate(void *client, thinfat_table_t *table, thinfat_cluster_t ci_from, thinfat_cluster_t ci_to, thinfat_core_event_t event);
-thinfat_result_t thinfat_table_truncate(void *client, thinfat_table_t *table, thinfat_cluster_t ci_from, thinfat_core_event_t event);
+/*
+ * Both walk a chain and free it. With the free-cluster bitmap, the whole
+ * chain is marked in a second bitmap as it is walked, and then each FAT
+ * sector holding some of it is zeroed once, in order, however fragmented
+ * the chain is. Without it, the clusters are gathered up to
+ * THINFAT_CONFIG_FREE_BATCH at a time and sorted, so that a sector is
+ * dirtied once per batch instead. The free count follows run by run.
+ * free_chain frees it all from ci_head on, truncate ends it at ci_last and
+ * frees what followed.
+ * Either calls back with a pointer to the number of clusters freed.
+ */
+thinfat_result_t thinfat_table_free_chain(void *client, thinfat_table_t *table, thinfat_cluster_t ci_head, thinfat_core_event_t event);
+thinfat_result_t thinfat_table_truncate(void *client, thinfat_table_t *table, thinfat_cluster_t ci_last, thinfat_core_event_t event);
+thinfat_result_t thinfat_table_scan(void *client, thinfat_table_t *table, thinfat_core_event_t event);
+void thinfat_table_release(thinfat_table_t *table);
+size_t thinfat_table_map_size(const thinfat_table_t *table);
 
 #endif
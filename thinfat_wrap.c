@@ -36,6 +36,12 @@ thinfat_result_t thinfat_user_callback(thinfat_t *tf, thinfat_event_t event, thi
   case THINFAT_EVENT_ALLOCATE:
     printf("Cluster allocation completed.\n");
     break;
+  case THINFAT_EVENT_SYNC:
+  case THINFAT_EVENT_UNMOUNT:
+    //A sync stopped by a flush that failed calls back with NULL, and why for s_param
+    if (p_param == NULL && s_param != THINFAT_INVALID_SECTOR)
+      *(thinfat_result_t *)tf->phy->arg = (thinfat_result_t)s_param;
+    break;
   }
   tf->phy->cb_flag = true;
   thinfat_phy_signal(tf->phy);
@@ -56,8 +62,20 @@ thinfat_result_t tfwrap_mount(thinfat_t *tf, thinfat_sector_t si_base)
 
 thinfat_result_t tfwrap_unmount(thinfat_t *tf)
 {
+  thinfat_result_t res, synced = THINFAT_RESULT_OK;
+  thinfat_phy_enter(tf->phy);
+  tf->phy->arg = &synced;
+  res = thinfat_phy_leave(tf->phy, thinfat_unmount(tf, THINFAT_EVENT_UNMOUNT));
+  return res != THINFAT_RESULT_OK ? res : synced;
+}
+
+thinfat_result_t tfwrap_sync(thinfat_t *tf)
+{
+  thinfat_result_t res, synced = THINFAT_RESULT_OK;
   thinfat_phy_enter(tf->phy);
-  return thinfat_phy_leave(tf->phy, thinfat_unmount(tf, THINFAT_USER_EVENT));
+  tf->phy->arg = &synced;
+  res = thinfat_phy_leave(tf->phy, thinfat_sync(tf, THINFAT_EVENT_SYNC));
+  return res != THINFAT_RESULT_OK ? res : synced;
 }
 
 thinfat_result_t tfwrap_dump_current_directory(thinfat_t *tf)